@@ -24,4 +24,13 @@
 
 typedef float FM_FLOAT;
 
+// Type of the model parameters w and v. Building with -DFM_PARAM_SINGLE halves
+// the memory and bandwidth of the model; predictions, gradients and sampling
+// statistics are still accumulated in double.
+#ifdef FM_PARAM_SINGLE
+typedef float FM_PARAM_FLOAT;
+#else
+typedef double FM_PARAM_FLOAT;
+#endif
+
 #endif /*FM_DATA_H_*/
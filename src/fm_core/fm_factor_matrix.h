@@ -0,0 +1,284 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_factor_matrix.h: Storage for the pairwise factors v of a factorization
+// machine with a selectable memory layout.
+//
+// - factor-major:    v(f,i) is stored at f*num_attribute + i. All values of
+//                    one factor are contiguous, which is what the column
+//                    sweeps of ALS/MCMC need.
+// - attribute-major: v(f,i) is stored at i*stride + f. The factors of one
+//                    attribute are contiguous and every attribute starts on
+//                    its own cache line, which is what prediction and SGD
+//                    need (one cache miss per nonzero instead of one per
+//                    factor and nonzero).
+
+#ifndef FM_FACTOR_MATRIX_H_
+#define FM_FACTOR_MATRIX_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <assert.h>
+#include "../util/memory.h"
+#include "../util/random.h"
+
+const int FM_LAYOUT_FACTOR_MAJOR = 0;
+const int FM_LAYOUT_ATTRIBUTE_MAJOR = 1;
+
+const uint FM_CACHE_LINE_SIZE = 64;
+
+template <typename T> class fm_factor_matrix {
+ public:
+  fm_factor_matrix();
+  fm_factor_matrix(const fm_factor_matrix<T>& m);
+  ~fm_factor_matrix();
+
+  fm_factor_matrix<T>& operator=(const fm_factor_matrix<T>& m);
+
+  void setSize(uint p_num_factor, uint p_num_attribute, int p_layout);
+  // changes the number of attributes and keeps the values of the remaining
+  // attributes; the values of new attributes are 0
+  void resize(uint p_num_attribute);
+  // converts the stored values into the given layout
+  void setLayout(int p_layout);
+  // use external memory (e.g. a memory mapped model file) that holds the
+  // values in the given layout; the memory is not freed by the matrix
+  void attach(T* p_value, uint p_num_factor, uint p_num_attribute, int p_layout, uint p_stride);
+
+  void init(T v);
+  void init(double mean, double stdev);
+
+  T& operator() (uint f, uint i);
+  T operator() (uint f, uint i) const;
+
+  // pointer to the num_factor contiguous factors of attribute i (attribute-major only)
+  T* attribute(uint i) const;
+  // pointer to the num_attribute contiguous values of factor f (factor-major only)
+  T* factor(uint f) const;
+
+  // number of stored values including the padding
+  uint64 size() const;
+  // stride that setSize uses for the given dimensions and layout
+  static uint computeStride(uint p_num_factor, uint p_num_attribute, int p_layout);
+
+  T* value;
+  uint num_factor;
+  uint num_attribute;
+  uint stride; // distance between two attributes (attribute-major) or two factors (factor-major)
+  int layout;
+
+ protected:
+  static T* allocate(uint64 size);
+  static void release(T* p, uint64 size);
+
+  bool owner; // is value allocated by this matrix
+};
+
+// Implementation
+template <typename T> fm_factor_matrix<T>::fm_factor_matrix() {
+  value = NULL;
+  num_factor = 0;
+  num_attribute = 0;
+  stride = 0;
+  layout = FM_LAYOUT_FACTOR_MAJOR;
+  owner = true;
+}
+
+template <typename T> fm_factor_matrix<T>::fm_factor_matrix(const fm_factor_matrix<T>& m) {
+  value = NULL;
+  num_factor = 0;
+  num_attribute = 0;
+  stride = 0;
+  layout = FM_LAYOUT_FACTOR_MAJOR;
+  owner = true;
+  *this = m;
+}
+
+template <typename T> fm_factor_matrix<T>::~fm_factor_matrix() {
+  if (owner) { release(value, size()); }
+}
+
+template <typename T> fm_factor_matrix<T>& fm_factor_matrix<T>::operator=(const fm_factor_matrix<T>& m) {
+  if (this == &m) { return *this; }
+  setSize(m.num_factor, m.num_attribute, m.layout);
+  for (uint64 j = 0; j < size(); j++) {
+    value[j] = m.value[j];
+  }
+  return *this;
+}
+
+template <typename T> uint fm_factor_matrix<T>::computeStride(uint p_num_factor, uint p_num_attribute, int p_layout) {
+  if (p_layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    // pad the factors of each attribute to a multiple of the cache line
+    uint per_line = FM_CACHE_LINE_SIZE / sizeof(T);
+    return ((p_num_factor + per_line - 1) / per_line) * per_line;
+  } else if (p_layout == FM_LAYOUT_FACTOR_MAJOR) {
+    return p_num_attribute;
+  } else {
+    throw "unknown factor layout";
+  }
+}
+
+template <typename T> uint64 fm_factor_matrix<T>::size() const {
+  if (layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    return (uint64) num_attribute * stride;
+  } else {
+    return (uint64) num_factor * stride;
+  }
+}
+
+template <typename T> T* fm_factor_matrix<T>::allocate(uint64 size) {
+  if (size == 0) { return NULL; }
+  MemoryLog::getInstance().logNew("fm_factor_matrix", sizeof(T), size);
+  T* p = static_cast<T*>(::operator new[](sizeof(T) * size, std::align_val_t(FM_CACHE_LINE_SIZE)));
+  for (uint64 j = 0; j < size; j++) {
+    p[j] = 0;
+  }
+  return p;
+}
+
+template <typename T> void fm_factor_matrix<T>::release(T* p, uint64 size) {
+  if (p == NULL) { return; }
+  MemoryLog::getInstance().logFree("fm_factor_matrix", sizeof(T), size);
+  ::operator delete[](p, std::align_val_t(FM_CACHE_LINE_SIZE));
+}
+
+template <typename T> void fm_factor_matrix<T>::setSize(uint p_num_factor, uint p_num_attribute, int p_layout) {
+  uint p_stride = computeStride(p_num_factor, p_num_attribute, p_layout);
+  if ((value != NULL) && (p_num_factor == num_factor) && (p_num_attribute == num_attribute) && (p_layout == layout) && (p_stride == stride)) {
+    return;
+  }
+  if (owner) { release(value, size()); }
+  num_factor = p_num_factor;
+  num_attribute = p_num_attribute;
+  layout = p_layout;
+  stride = p_stride;
+  value = allocate(size());
+  owner = true;
+}
+
+template <typename T> void fm_factor_matrix<T>::resize(uint p_num_attribute) {
+  if (p_num_attribute == num_attribute) { return; }
+  uint p_stride = computeStride(num_factor, p_num_attribute, layout);
+  uint64 p_size = (layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? (uint64) p_num_attribute * p_stride : (uint64) num_factor * p_stride;
+  T* p_value = allocate(p_size);
+  uint n = std::min(num_attribute, p_num_attribute);
+  if (layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    for (uint i = 0; i < n; i++) {
+      std::copy(value + (uint64) i * stride, value + (uint64) i * stride + num_factor, p_value + (uint64) i * p_stride);
+    }
+  } else {
+    for (uint f = 0; f < num_factor; f++) {
+      std::copy(value + (uint64) f * stride, value + (uint64) f * stride + n, p_value + (uint64) f * p_stride);
+    }
+  }
+  if (owner) { release(value, size()); }
+  value = p_value;
+  num_attribute = p_num_attribute;
+  stride = p_stride;
+  owner = true;
+}
+
+template <typename T> void fm_factor_matrix<T>::attach(T* p_value, uint p_num_factor, uint p_num_attribute, int p_layout, uint p_stride) {
+  if (p_stride != computeStride(p_num_factor, p_num_attribute, p_layout)) {
+    throw "unexpected stride of the factor matrix";
+  }
+  if (reinterpret_cast<uintptr_t>(p_value) % FM_CACHE_LINE_SIZE != 0) {
+    throw "factor matrix is not aligned to the cache line size";
+  }
+  if (owner) { release(value, size()); }
+  num_factor = p_num_factor;
+  num_attribute = p_num_attribute;
+  layout = p_layout;
+  stride = p_stride;
+  value = p_value;
+  owner = false;
+}
+
+template <typename T> void fm_factor_matrix<T>::setLayout(int p_layout) {
+  if (p_layout == layout) { return; }
+  uint p_stride = computeStride(num_factor, num_attribute, p_layout);
+  uint64 p_size = (p_layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? (uint64) num_attribute * p_stride : (uint64) num_factor * p_stride;
+  T* p_value = allocate(p_size);
+  // transpose in blocks of attributes so that both sides stay in the cache
+  const uint block = 64;
+  for (uint i0 = 0; i0 < num_attribute; i0 += block) {
+    uint i1 = std::min(num_attribute, i0 + block);
+    for (uint f = 0; f < num_factor; f++) {
+      for (uint i = i0; i < i1; i++) {
+        if (p_layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+          p_value[(uint64) i * p_stride + f] = value[(uint64) f * stride + i];
+        } else {
+          p_value[(uint64) f * p_stride + i] = value[(uint64) i * stride + f];
+        }
+      }
+    }
+  }
+  if (owner) { release(value, size()); }
+  value = p_value;
+  layout = p_layout;
+  stride = p_stride;
+  owner = true;
+}
+
+template <typename T> void fm_factor_matrix<T>::init(T v) {
+  for (uint f = 0; f < num_factor; f++) {
+    for (uint i = 0; i < num_attribute; i++) {
+      (*this)(f, i) = v;
+    }
+  }
+}
+
+template <typename T> void fm_factor_matrix<T>::init(double mean, double stdev) {
+  // draw in factor-major order, so that the model does not depend on the layout
+  for (uint f = 0; f < num_factor; f++) {
+    for (uint i = 0; i < num_attribute; i++) {
+      (*this)(f, i) = ran_gaussian(mean, stdev);
+    }
+  }
+}
+
+template <typename T> T& fm_factor_matrix<T>::operator() (uint f, uint i) {
+  if (layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    return value[(uint64) i * stride + f];
+  } else {
+    return value[(uint64) f * stride + i];
+  }
+}
+
+template <typename T> T fm_factor_matrix<T>::operator() (uint f, uint i) const {
+  if (layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    return value[(uint64) i * stride + f];
+  } else {
+    return value[(uint64) f * stride + i];
+  }
+}
+
+template <typename T> T* fm_factor_matrix<T>::attribute(uint i) const {
+  assert(layout == FM_LAYOUT_ATTRIBUTE_MAJOR);
+  return value + (uint64) i * stride;
+}
+
+template <typename T> T* fm_factor_matrix<T>::factor(uint f) const {
+  assert(layout == FM_LAYOUT_FACTOR_MAJOR);
+  return value + (uint64) f * stride;
+}
+
+#endif /*FM_FACTOR_MATRIX_H_*/
@@ -0,0 +1,226 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_kernel.h: Vectorized kernels for the pairwise part of the FM prediction
+//
+// For a row x and attribute-major factors v the kernel computes for all f
+//   sum(f)     = \sum_i v_if x_i
+//   sum_sqr(f) = \sum_i (v_if x_i)^2
+// in double, also if v is stored in single precision.
+// The AVX2 and AVX-512 versions process all factors of one nonzero at once
+// and keep the accumulators in registers. They use separate multiplies and
+// additions (no fused multiply-add) in the same order as the portable
+// version, so all versions give bit-identical results. The version is
+// selected once at startup by CPUID.
+// All kernels are also instantiated for the common numbers of factors
+// K = 4, 8, 16, 32, 64; there the loops over the factors have a fixed trip
+// count and are unrolled completely. K = 0 is the version for any number of
+// factors.
+
+#ifndef FM_KERNEL_H_
+#define FM_KERNEL_H_
+
+#include <string>
+#include <type_traits>
+#include "../util/fmatrix.h"
+#include "fm_data.h"
+#include "fm_factor_matrix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FM_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*fm_accumulate_fn)(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr);
+
+template <int K> void fm_accumulate_generic(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr);
+#ifdef FM_KERNEL_X86
+template <int K> __attribute__((target("avx2"), optimize("fp-contract=off")))
+void fm_accumulate_avx2(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr);
+template <int K> __attribute__((target("avx512f"), optimize("fp-contract=off")))
+void fm_accumulate_avx512(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr);
+#endif
+
+// computes sum and sum_sqr with the fastest kernel for this CPU and num_factor
+void fm_accumulate(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr);
+
+// calls fn(std::integral_constant<int, K>()) with K = num_factor if num_factor
+// is one of the specialized sizes 4, 8, 16, 32, 64 and with K = 0 otherwise
+template <typename F> void fm_dispatch_num_factor(int num_factor, F fn);
+
+// name of the kernel that is used on this CPU ("generic", "avx2" or "avx512")
+std::string fm_kernel_name();
+
+// Implementation
+template <typename F> void fm_dispatch_num_factor(int num_factor, F fn) {
+  switch (num_factor) {
+    case 4: fn(std::integral_constant<int, 4>()); break;
+    case 8: fn(std::integral_constant<int, 8>()); break;
+    case 16: fn(std::integral_constant<int, 16>()); break;
+    case 32: fn(std::integral_constant<int, 32>()); break;
+    case 64: fn(std::integral_constant<int, 64>()); break;
+    default: fn(std::integral_constant<int, 0>()); break;
+  }
+}
+
+template <int K> void fm_accumulate_generic(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr) {
+  if (K > 0) { num_factor = K; }
+  for (int f = 0; f < num_factor; f++) {
+    sum[f] = 0;
+    sum_sqr[f] = 0;
+  }
+  for (uint i = 0; i < x.size; i++) {
+    const FM_PARAM_FLOAT* v_i = v.attribute(x.data[i].id);
+    for (int f = 0; f < num_factor; f++) {
+      double d = (double) v_i[f] * x.data[i].value;
+      sum[f] += d;
+      sum_sqr[f] += d*d;
+    }
+  }
+}
+
+#ifdef FM_KERNEL_X86
+// load 4 or 8 parameters as doubles
+__attribute__((target("avx2"))) inline __m256d fm_load4_pd(const double* p) { return _mm256_load_pd(p); }
+__attribute__((target("avx2"))) inline __m256d fm_load4_pd(const float* p) { return _mm256_cvtps_pd(_mm_load_ps(p)); }
+__attribute__((target("avx512f"))) inline __m512d fm_load8_pd(const double* p) { return _mm512_load_pd(p); }
+__attribute__((target("avx512f"))) inline __m512d fm_load8_pd(const float* p) { return _mm512_maskz_cvtps_pd(0xFF, _mm256_load_ps(p)); }
+
+// The rows of v are padded with zeros to a full cache line, so the last
+// vector of a row can always be loaded completely; only the first num_factor
+// lanes are written back.
+template <int K> __attribute__((target("avx2"), optimize("fp-contract=off")))
+void fm_accumulate_avx2(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr) {
+  if (K > 0) { num_factor = K; }
+  const int width = 4;
+  const int unroll = (K > 0) ? std::max(1, std::min(4, K / width)) : 4;
+  alignas(32) double out_sum[width * unroll];
+  alignas(32) double out_sum_sqr[width * unroll];
+  for (int f0 = 0; f0 < num_factor; f0 += width * unroll) {
+    int num_vec = std::min(unroll, (num_factor - f0 + width - 1) / width);
+    __m256d acc_sum[unroll];
+    __m256d acc_sum_sqr[unroll];
+    for (int j = 0; j < unroll; j++) {
+      acc_sum[j] = _mm256_setzero_pd();
+      acc_sum_sqr[j] = _mm256_setzero_pd();
+    }
+    for (uint i = 0; i < x.size; i++) {
+      const FM_PARAM_FLOAT* v_i = v.attribute(x.data[i].id) + f0;
+      __m256d x_i = _mm256_set1_pd(x.data[i].value);
+      for (int j = 0; j < num_vec; j++) {
+        __m256d d = _mm256_mul_pd(fm_load4_pd(v_i + j * width), x_i);
+        acc_sum[j] = _mm256_add_pd(acc_sum[j], d);
+        acc_sum_sqr[j] = _mm256_add_pd(acc_sum_sqr[j], _mm256_mul_pd(d, d));
+      }
+    }
+    for (int j = 0; j < num_vec; j++) {
+      _mm256_store_pd(out_sum + j * width, acc_sum[j]);
+      _mm256_store_pd(out_sum_sqr + j * width, acc_sum_sqr[j]);
+    }
+    int num_out = std::min(width * unroll, num_factor - f0);
+    for (int f = 0; f < num_out; f++) {
+      sum[f0 + f] = out_sum[f];
+      sum_sqr[f0 + f] = out_sum_sqr[f];
+    }
+  }
+}
+
+// with 32 registers all accumulators of up to 64 factors fit at once
+template <int K> __attribute__((target("avx512f"), optimize("fp-contract=off")))
+void fm_accumulate_avx512(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr) {
+  if (K > 0) { num_factor = K; }
+  const int width = 8;
+  const int unroll = (K > 0) ? std::max(1, std::min(8, K / width)) : 4;
+  alignas(64) double out_sum[width * unroll];
+  alignas(64) double out_sum_sqr[width * unroll];
+  for (int f0 = 0; f0 < num_factor; f0 += width * unroll) {
+    int num_vec = std::min(unroll, (num_factor - f0 + width - 1) / width);
+    __m512d acc_sum[unroll];
+    __m512d acc_sum_sqr[unroll];
+    for (int j = 0; j < unroll; j++) {
+      acc_sum[j] = _mm512_setzero_pd();
+      acc_sum_sqr[j] = _mm512_setzero_pd();
+    }
+    for (uint i = 0; i < x.size; i++) {
+      const FM_PARAM_FLOAT* v_i = v.attribute(x.data[i].id) + f0;
+      __m512d x_i = _mm512_set1_pd(x.data[i].value);
+      for (int j = 0; j < num_vec; j++) {
+        __m512d d = _mm512_mul_pd(fm_load8_pd(v_i + j * width), x_i);
+        acc_sum[j] = _mm512_add_pd(acc_sum[j], d);
+        acc_sum_sqr[j] = _mm512_add_pd(acc_sum_sqr[j], _mm512_mul_pd(d, d));
+      }
+    }
+    for (int j = 0; j < num_vec; j++) {
+      _mm512_store_pd(out_sum + j * width, acc_sum[j]);
+      _mm512_store_pd(out_sum_sqr + j * width, acc_sum_sqr[j]);
+    }
+    int num_out = std::min(width * unroll, num_factor - f0);
+    for (int f = 0; f < num_out; f++) {
+      sum[f0 + f] = out_sum[f];
+      sum_sqr[f0 + f] = out_sum_sqr[f];
+    }
+  }
+}
+#endif
+
+template <int K> fm_accumulate_fn fm_select_accumulate() {
+#ifdef FM_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return fm_accumulate_avx512<K>;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return fm_accumulate_avx2<K>;
+  }
+#endif
+  return fm_accumulate_generic<K>;
+}
+
+// kernels for K = 0, 4, 8, 16, 32, 64
+const fm_accumulate_fn fm_accumulate_kernel[] = {
+  fm_select_accumulate<0>(),
+  fm_select_accumulate<4>(),
+  fm_select_accumulate<8>(),
+  fm_select_accumulate<16>(),
+  fm_select_accumulate<32>(),
+  fm_select_accumulate<64>()
+};
+
+void fm_accumulate(const sparse_row<FM_FLOAT>& x, const fm_factor_matrix<FM_PARAM_FLOAT>& v, int num_factor, double* sum, double* sum_sqr) {
+  int kernel;
+  switch (num_factor) {
+    case 4: kernel = 1; break;
+    case 8: kernel = 2; break;
+    case 16: kernel = 3; break;
+    case 32: kernel = 4; break;
+    case 64: kernel = 5; break;
+    default: kernel = 0; break;
+  }
+  fm_accumulate_kernel[kernel](x, v, num_factor, sum, sum_sqr);
+}
+
+std::string fm_kernel_name() {
+#ifdef FM_KERNEL_X86
+  if (fm_accumulate_kernel[0] == fm_accumulate_avx512<0>) { return "avx512"; }
+  if (fm_accumulate_kernel[0] == fm_accumulate_avx2<0>) { return "avx2"; }
+#endif
+  return "generic";
+}
+
+#endif /*FM_KERNEL_H_*/
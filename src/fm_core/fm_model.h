@@ -27,25 +27,89 @@
 #ifndef FM_MODEL_H_
 #define FM_MODEL_H_
 
+#include <cstring>
+#include <memory>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "../util/matrix.h"
 #include "../util/fmatrix.h"
 
 #include "fm_data.h"
+#include "fm_factor_matrix.h"
+#include "fm_kernel.h"
 
+const int FM_MODEL_FORMAT_TEXT = 0;
+const int FM_MODEL_FORMAT_BINARY = 1;
+
+// Binary model files start with this header (in native byte order), followed
+// by w (num_attribute values) and v (size_v values in the stored layout,
+// including the padding of the layout). Both arrays start at a multiple of
+// FM_CACHE_LINE_SIZE, so the file can be mapped into memory and used as is.
+const char FM_MODEL_FILE_MAGIC[8] = { 'l', 'i', 'b', 'F', 'M', 'b', 'i', 'n' };
+const uint FM_MODEL_FILE_VERSION = 1;
+const uint FM_MODEL_DTYPE_DOUBLE = 1;
+const uint FM_MODEL_DTYPE_FLOAT = 2;
+// files of the other type are converted when they are loaded
+const uint FM_MODEL_DTYPE_PARAM = (sizeof(FM_PARAM_FLOAT) == sizeof(float)) ? FM_MODEL_DTYPE_FLOAT : FM_MODEL_DTYPE_DOUBLE;
+
+#ifdef FM_PARAM_SINGLE
+typedef DVectorFloat DVectorParam;
+#else
+typedef DVectorDouble DVectorParam;
+#endif
+
+struct fm_model_file_header {
+  char magic[8];
+  uint version;
+  uint header_size;
+  uint k0;
+  uint k1;
+  uint num_factor;
+  uint num_attribute;
+  uint dtype;
+  int layout;
+  uint stride;
+  uint reserved;
+  double w0;
+  uint64 offset_w; // byte offset of w from the beginning of the file
+  uint64 offset_v; // byte offset of v from the beginning of the file
+  uint64 size_v;   // number of values of v
+};
 
 class fm_model {
  public:
   fm_model();
   void debug();
   void init();
-  double predict(sparse_row<FM_FLOAT>& x);
-  double predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr);
-  void saveModel(std::string model_file_path);
+  // changes the number of attributes; the parameters of new attributes are
+  // initialized like in init()
+  void resize(uint num_attribute);
+  void setLayout(int layout);
+  // The predict functions only read the model, so one model can be used by
+  // several threads at the same time (as long as nobody learns).
+  double predict(const sparse_row<FM_FLOAT>& x) const;
+  double predict(const sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr) const;
+  // sum and sum_sqr are caller-owned buffers of num_factor elements; after the
+  // call they contain the per factor sums that SGD needs for the gradients
+  double predict(const sparse_row<FM_FLOAT>& x, double* sum, double* sum_sqr) const;
+  // writes the first num_saved_attribute attributes (0 = all), e.g. of a
+  // model that has room for more attributes than it has seen
+  void saveModel(std::string model_file_path, int format = FM_MODEL_FORMAT_TEXT, uint num_saved_attribute = 0);
+  // Reads a text or binary model (detected automatically), returns 0 if the
+  // file is malformed or does not match the dimensions of this model. If
+  // num_attribute is 0, it is taken from the file (for a text model from the
+  // number of rows of v). Binary models are memory mapped copy-on-write where possible, so
+  // processes that only predict share the pages of the file.
   int loadModel(std::string model_file_path);
 
   double w0;
-  DVectorDouble w;
-  DMatrixDouble v;
+  DVectorParam w;
+  fm_factor_matrix<FM_PARAM_FLOAT> v;
 
   // the following values should be set:
   uint num_attribute;
@@ -53,6 +117,8 @@ class fm_model {
   bool k0, k1;
   int num_factor;
 
+  int layout; // memory layout of v, FM_LAYOUT_FACTOR_MAJOR or FM_LAYOUT_ATTRIBUTE_MAJOR
+
   double reg0;
   double regw, regv;
 
@@ -61,10 +127,18 @@ class fm_model {
 
  private:
   void splitString(const std::string& s, char c, std::vector<std::string>& v);
+  void saveModelText(std::string model_file_path, uint num_saved_attribute);
+  void saveModelBinary(std::string model_file_path, uint num_saved_attribute);
+  int loadModelText(std::string model_file_path);
+  int loadModelBinary(std::string model_file_path);
+  template <typename S> int readParameters(std::ifstream& in, const fm_model_file_header& header);
 
-  DVector<double> m_sum, m_sum_sqr;
+  std::shared_ptr<void> mapping; // memory mapped model file that w and v point into
 };
 
+// up to this number of factors predict(x) keeps its scratch space on the stack
+const int FM_PREDICT_STACK_FACTORS = 256;
+
 // Implementation
 fm_model::fm_model() {
   num_factor = 0;
@@ -75,6 +149,7 @@ fm_model::fm_model() {
   regv = 0.0;
   k0 = true;
   k1 = true;
+  layout = FM_LAYOUT_FACTOR_MAJOR;
 }
 
 void fm_model::debug() {
@@ -82,6 +157,8 @@ void fm_model::debug() {
   std::cout << "use w0=" << k0 << std::endl;
   std::cout << "use w1=" << k1 << std::endl;
   std::cout << "dim v =" << num_factor << std::endl;
+  std::cout << "layout v=" << (layout == FM_LAYOUT_ATTRIBUTE_MAJOR ? "attribute-major" : "factor-major") << std::endl;
+  std::cout << "kernel=" << fm_kernel_name() << std::endl;
   std::cout << "reg_w0=" << reg0 << std::endl;
   std::cout << "reg_w=" << regw << std::endl;
   std::cout << "reg_v=" << regv << std::endl;
@@ -91,18 +168,50 @@ void fm_model::debug() {
 void fm_model::init() {
   w0 = 0;
   w.setSize(num_attribute);
-  v.setSize(num_factor, num_attribute);
+  v.setSize(num_factor, num_attribute, layout);
   w.init(0);
   v.init(init_mean, init_stdev);
-  m_sum.setSize(num_factor);
-  m_sum_sqr.setSize(num_factor);
 }
 
-double fm_model::predict(sparse_row<FM_FLOAT>& x) {
-  return predict(x, m_sum, m_sum_sqr);
+void fm_model::resize(uint num_attribute) {
+  uint old_num_attribute = std::min(this->num_attribute, num_attribute);
+  w.resize(num_attribute);
+  for (uint i = old_num_attribute; i < num_attribute; i++) {
+    w(i) = 0;
+  }
+  v.resize(num_attribute);
+  for (int f = 0; f < num_factor; f++) {
+    for (uint i = old_num_attribute; i < num_attribute; i++) {
+      v(f,i) = ran_gaussian(init_mean, init_stdev);
+    }
+  }
+  this->num_attribute = num_attribute;
+}
+
+void fm_model::setLayout(int layout) {
+  this->layout = layout;
+  v.setLayout(layout);
+}
+
+double fm_model::predict(const sparse_row<FM_FLOAT>& x) const {
+  if (num_factor <= FM_PREDICT_STACK_FACTORS) {
+    alignas(FM_CACHE_LINE_SIZE) double sum[FM_PREDICT_STACK_FACTORS];
+    alignas(FM_CACHE_LINE_SIZE) double sum_sqr[FM_PREDICT_STACK_FACTORS];
+    return predict(x, sum, sum_sqr);
+  } else {
+    // too large for the stack: one buffer per thread, allocated on first use
+    thread_local std::vector<double> sum, sum_sqr;
+    sum.resize(num_factor);
+    sum_sqr.resize(num_factor);
+    return predict(x, sum.data(), sum_sqr.data());
+  }
 }
 
-double fm_model::predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr) {
+double fm_model::predict(const sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<double> &sum_sqr) const {
+  return predict(x, sum.value, sum_sqr.value);
+}
+
+double fm_model::predict(const sparse_row<FM_FLOAT>& x, double* sum, double* sum_sqr) const {
   double result = 0;
   if (k0) {
     result += w0;
@@ -110,18 +219,25 @@ double fm_model::predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<
   if (k1) {
     for (uint i = 0; i < x.size; i++) {
       assert(x.data[i].id < num_attribute);
-      result += w(x.data[i].id) * x.data[i].value;
+      result += (double) w(x.data[i].id) * x.data[i].value;
     }
   }
-  for (int f = 0; f < num_factor; f++) {
-    sum(f) = 0;
-    sum_sqr(f) = 0;
-    for (uint i = 0; i < x.size; i++) {
-      double d = v(f,x.data[i].id) * x.data[i].value;
-      sum(f) += d;
-      sum_sqr(f) += d*d;
+  if (v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    fm_accumulate(x, v, num_factor, sum, sum_sqr);
+    for (int f = 0; f < num_factor; f++) {
+      result += 0.5 * (sum[f]*sum[f] - sum_sqr[f]);
+    }
+  } else {
+    for (int f = 0; f < num_factor; f++) {
+      sum[f] = 0;
+      sum_sqr[f] = 0;
+      for (uint i = 0; i < x.size; i++) {
+        double d = (double) v(f,x.data[i].id) * x.data[i].value;
+        sum[f] += d;
+        sum_sqr[f] += d*d;
+      }
+      result += 0.5 * (sum[f]*sum[f] - sum_sqr[f]);
     }
-    result += 0.5 * (sum(f)*sum(f) - sum_sqr(f));
   }
   return result;
 }
@@ -129,7 +245,20 @@ double fm_model::predict(sparse_row<FM_FLOAT>& x, DVector<double> &sum, DVector<
 /*
  * Write the FM model (all the parameters) in a file.
  */
-void fm_model::saveModel(std::string model_file_path){
+void fm_model::saveModel(std::string model_file_path, int format, uint num_saved_attribute) {
+  if ((num_saved_attribute == 0) || (num_saved_attribute > num_attribute)) {
+    num_saved_attribute = num_attribute;
+  }
+  if (format == FM_MODEL_FORMAT_TEXT) {
+    saveModelText(model_file_path, num_saved_attribute);
+  } else if (format == FM_MODEL_FORMAT_BINARY) {
+    saveModelBinary(model_file_path, num_saved_attribute);
+  } else {
+    throw "unknown model format";
+  }
+}
+
+void fm_model::saveModelText(std::string model_file_path, uint num_saved_attribute) {
   std::ofstream out_model;
   out_model.open(model_file_path.c_str());
   if (k0) {
@@ -138,12 +267,12 @@ void fm_model::saveModel(std::string model_file_path){
   }
   if (k1) {
     out_model << "#unary interactions Wj" << std::endl;
-    for (uint i = 0; i<num_attribute; i++){
+    for (uint i = 0; i<num_saved_attribute; i++){
       out_model <<  w(i) << std::endl;
     }
   }
   out_model << "#pairwise interactions Vj,f" << std::endl;
-  for (uint i = 0; i<num_attribute; i++){
+  for (uint i = 0; i<num_saved_attribute; i++){
     for (int f = 0; f < num_factor; f++) {
       out_model << v(f,i);
       if (f!=num_factor-1){ out_model << ' '; }
@@ -153,14 +282,193 @@ void fm_model::saveModel(std::string model_file_path){
   out_model.close();
 }
 
+void fm_model::saveModelBinary(std::string model_file_path, uint num_saved_attribute) {
+  std::ofstream out(model_file_path.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (! out.is_open()) {
+    throw "Unable to open file " + model_file_path;
+  }
+  fm_model_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FM_MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = FM_MODEL_FILE_VERSION;
+  header.header_size = sizeof(header);
+  header.k0 = k0;
+  header.k1 = k1;
+  header.num_factor = num_factor;
+  header.num_attribute = num_saved_attribute;
+  header.dtype = FM_MODEL_DTYPE_PARAM;
+  header.layout = v.layout;
+  header.stride = fm_factor_matrix<FM_PARAM_FLOAT>::computeStride(num_factor, num_saved_attribute, v.layout);
+  header.w0 = k0 ? w0 : 0;
+  const uint64 align = FM_CACHE_LINE_SIZE;
+  header.offset_w = ((sizeof(header) + align - 1) / align) * align;
+  header.offset_v = ((header.offset_w + sizeof(FM_PARAM_FLOAT) * num_saved_attribute + align - 1) / align) * align;
+  header.size_v = (v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? (uint64) num_saved_attribute * header.stride : (uint64) num_factor * header.stride;
+
+  const char padding[FM_CACHE_LINE_SIZE] = { 0 };
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(padding, header.offset_w - sizeof(header));
+  if (k1) {
+    out.write(reinterpret_cast<const char*>(w.value), sizeof(FM_PARAM_FLOAT) * num_saved_attribute);
+  } else {
+    for (uint i = 0; i < num_saved_attribute; i++) {
+      FM_PARAM_FLOAT zero = 0;
+      out.write(reinterpret_cast<const char*>(&zero), sizeof(FM_PARAM_FLOAT));
+    }
+  }
+  out.write(padding, header.offset_v - header.offset_w - sizeof(FM_PARAM_FLOAT) * num_saved_attribute);
+  if ((v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) || (num_saved_attribute == num_attribute)) {
+    // the saved attributes are a prefix of v
+    out.write(reinterpret_cast<const char*>(v.value), sizeof(FM_PARAM_FLOAT) * header.size_v);
+  } else {
+    for (int f = 0; f < num_factor; f++) {
+      out.write(reinterpret_cast<const char*>(v.factor(f)), sizeof(FM_PARAM_FLOAT) * num_saved_attribute);
+    }
+  }
+  out.close();
+  if (out.fail()) {
+    throw "Unable to write file " + model_file_path;
+  }
+}
+
+int fm_model::loadModel(std::string model_file_path) {
+  char magic[sizeof(FM_MODEL_FILE_MAGIC)];
+  {
+    std::ifstream in(model_file_path.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (! in.is_open()) { return 0; }
+    in.read(magic, sizeof(magic));
+    if (! in) { return loadModelText(model_file_path); }
+  }
+  if (memcmp(magic, FM_MODEL_FILE_MAGIC, sizeof(magic)) == 0) {
+    return loadModelBinary(model_file_path);
+  } else {
+    return loadModelText(model_file_path);
+  }
+}
+
+int fm_model::loadModelBinary(std::string model_file_path) {
+  fm_model_file_header header;
+  uint64 file_size;
+  {
+    std::ifstream in(model_file_path.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (! in.is_open()) { return 0; }
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (! in) { return 0; }
+    in.seekg(0, std::ios_base::end);
+    file_size = in.tellg();
+  }
+  if ((header.version != FM_MODEL_FILE_VERSION) || (header.header_size != sizeof(header))) { return 0; }
+  if ((header.layout != FM_LAYOUT_FACTOR_MAJOR) && (header.layout != FM_LAYOUT_ATTRIBUTE_MAJOR)) { return 0; }
+  uint64 dtype_size;
+  uint stride;
+  if (header.dtype == FM_MODEL_DTYPE_DOUBLE) {
+    dtype_size = sizeof(double);
+    stride = fm_factor_matrix<double>::computeStride(header.num_factor, header.num_attribute, header.layout);
+  } else if (header.dtype == FM_MODEL_DTYPE_FLOAT) {
+    dtype_size = sizeof(float);
+    stride = fm_factor_matrix<float>::computeStride(header.num_factor, header.num_attribute, header.layout);
+  } else {
+    return 0;
+  }
+  if (header.stride != stride) { return 0; }
+  uint64 size_v = (header.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? (uint64) header.num_attribute * header.stride : (uint64) header.num_factor * header.stride;
+  if ((header.size_v != size_v) || (header.offset_w % FM_CACHE_LINE_SIZE != 0) || (header.offset_v % FM_CACHE_LINE_SIZE != 0)) { return 0; }
+  if ((header.offset_w + dtype_size * header.num_attribute > header.offset_v) || (header.offset_v + dtype_size * size_v > file_size)) { return 0; }
+
+  if (num_attribute == 0) {
+    // not configured yet: take the dimensions from the file
+    k0 = header.k0;
+    k1 = header.k1;
+    num_factor = header.num_factor;
+    num_attribute = header.num_attribute;
+    layout = header.layout;
+  } else if ((k0 != (bool) header.k0) || (k1 != (bool) header.k1) || (num_factor != (int) header.num_factor) || (num_attribute != header.num_attribute)) {
+    return 0;
+  }
+
+  w0 = header.w0;
+#ifndef _WIN32
+  if (header.dtype == FM_MODEL_DTYPE_PARAM) {
+    int fd = open(model_file_path.c_str(), O_RDONLY);
+    if (fd < 0) { return 0; }
+    // private writable mapping: the pages are shared with the page cache as
+    // long as they are only read and copied if somebody learns on the model
+    void* addr = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) { return 0; }
+    mapping = std::shared_ptr<void>(addr, [file_size](void* p) { munmap(p, file_size); });
+    char* base = static_cast<char*>(addr);
+    w.attach(reinterpret_cast<FM_PARAM_FLOAT*>(base + header.offset_w), header.num_attribute);
+    v.attach(reinterpret_cast<FM_PARAM_FLOAT*>(base + header.offset_v), header.num_factor, header.num_attribute, header.layout, header.stride);
+    // convert to the requested layout (this copies v into private memory)
+    v.setLayout(layout);
+    return 1;
+  }
+#endif
+  std::ifstream in(model_file_path.c_str(), std::ios_base::in | std::ios_base::binary);
+  int result;
+  if (header.dtype == FM_MODEL_DTYPE_DOUBLE) {
+    result = readParameters<double>(in, header);
+  } else {
+    result = readParameters<float>(in, header);
+  }
+  v.setLayout(layout);
+  return result;
+}
+
+/*
+ * Reads w and v stored as type S and converts them to FM_PARAM_FLOAT.
+ */
+template <typename S> int fm_model::readParameters(std::ifstream& in, const fm_model_file_header& header) {
+  std::vector<S> buffer(header.num_attribute);
+  in.seekg(header.offset_w, std::ios_base::beg);
+  in.read(reinterpret_cast<char*>(buffer.data()), sizeof(S) * header.num_attribute);
+  w.setSize(header.num_attribute);
+  for (uint i = 0; i < header.num_attribute; i++) {
+    w(i) = buffer[i];
+  }
+  // v is read one attribute (attribute-major) or one factor (factor-major) at a time
+  v.setSize(header.num_factor, header.num_attribute, header.layout);
+  uint num_lines = (header.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? header.num_attribute : header.num_factor;
+  uint line_size = (header.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) ? header.num_factor : header.num_attribute;
+  buffer.resize(header.stride);
+  in.seekg(header.offset_v, std::ios_base::beg);
+  for (uint l = 0; l < num_lines; l++) {
+    in.read(reinterpret_cast<char*>(buffer.data()), sizeof(S) * header.stride);
+    FM_PARAM_FLOAT* line = v.value + (uint64) l * v.stride;
+    for (uint j = 0; j < line_size; j++) {
+      line[j] = buffer[j];
+    }
+  }
+  return in ? 1 : 0;
+}
+
 /*
  * Read the FM model (all the parameters) from a file.
  * If no valid conversion could be performed, the function std::atof returns zero (0.0).
  */
-int fm_model::loadModel(std::string model_file_path) {
+int fm_model::loadModelText(std::string model_file_path) {
   std::string line;
   std::ifstream model_file (model_file_path.c_str());
   if (model_file.is_open()){
+    if (num_attribute == 0) {
+      // the rows after "#pairwise interactions Vj,f" are the attributes
+      bool in_v = false;
+      while (std::getline(model_file, line)) {
+        if (in_v && ! line.empty()) {
+          num_attribute++;
+        } else if (line.compare(0, 9, "#pairwise") == 0) {
+          in_v = true;
+        }
+      }
+      if (num_attribute == 0) { return 0; }
+      model_file.clear();
+      model_file.seekg(0);
+    }
+    w0 = 0;
+    w.setSize(num_attribute);
+    w.init(0);
+    v.setSize(num_factor, num_attribute, layout);
     if (k0) {
       if(!std::getline(model_file,line)){return 0;} // "#global bias W0"
       if(!std::getline(model_file,line)){return 0;}
@@ -0,0 +1,274 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_posterior.h: Samples of the FM parameters drawn by MCMC, for predicting
+// data that was not known at learning time
+//
+// Every sample has its own w0 (double), w and v (float, attribute-major).
+// The samples are stored one after another, so adding a sample only appends
+// to the arrays. In files, every sample is written as its w0, w and v, so
+// samples can be appended to a file, too.
+
+#ifndef FM_POSTERIOR_H_
+#define FM_POSTERIOR_H_
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../util/fmatrix.h"
+#include "fm_data.h"
+#include "fm_model.h"
+
+const char FM_POSTERIOR_FILE_MAGIC[8] = { 'l', 'i', 'b', 'F', 'M', 'p', 's', 't' };
+const uint FM_POSTERIOR_FILE_VERSION = 3;
+
+// Posterior files start with this header, followed by the samples (see
+// writeSamples).
+struct fm_posterior_file_header {
+  char magic[8];
+  uint version;
+  uint header_size;
+  uint k0;
+  uint k1;
+  uint num_factor;
+  uint num_attribute;
+  uint num_samples;
+  uint task;
+  double min_target;
+  double max_target;
+};
+
+class fm_posterior {
+ public:
+  fm_posterior();
+
+  // removes all samples; new samples have the dimensions of fm
+  void init(const fm_model& fm);
+  // adds the parameters of fm as a new sample
+  void add(const fm_model& fm);
+  // adds all samples of other, which has the same dimensions
+  void add(const fm_posterior& other);
+
+  // the raw prediction of every sample for x in out[0], ...,
+  // out[num_samples-1]; attributes unknown to the samples are ignored
+  void predict(const sparse_row<FM_FLOAT>& x, double* out) const;
+
+  void save(std::string filename);
+  // returns 0 if the file is not a valid posterior
+  int load(std::string filename);
+  // writes the samples first, ..., num_samples-1 without a file header: for
+  // every sample w0 (double), w (float, num_attribute) and v (float,
+  // num_attribute * num_factor)
+  void writeSamples(std::ostream& out, uint first) const;
+  // reads num samples of writeSamples; they replace the current samples
+  bool readSamples(std::istream& in, uint num);
+
+  // bytes used by the samples
+  uint64 getMemorySize() const;
+  void debug();
+
+  bool k0, k1;
+  int num_factor;
+  uint num_attribute;
+  uint num_samples;
+  // the task (0=regression, 1=classification) and the range of the targets
+  // of the learner, so that loaded samples predict without the training data
+  uint task;
+  double min_target, max_target;
+
+  std::vector<double> w0;
+  std::vector<float> w;
+  std::vector<float> v;
+};
+
+// Implementation
+fm_posterior::fm_posterior() {
+  k0 = true;
+  k1 = true;
+  num_factor = 0;
+  num_attribute = 0;
+  num_samples = 0;
+  task = 0;
+  min_target = 0;
+  max_target = 0;
+}
+
+void fm_posterior::init(const fm_model& fm) {
+  k0 = fm.k0;
+  k1 = fm.k1;
+  num_factor = fm.num_factor;
+  num_attribute = fm.num_attribute;
+  num_samples = 0;
+  w0.clear();
+  w.clear();
+  v.clear();
+}
+
+void fm_posterior::add(const fm_model& fm) {
+  assert((fm.num_attribute == num_attribute) && (fm.num_factor == num_factor));
+  w0.push_back(k0 ? fm.w0 : 0);
+  // the arrays grow by one sample at once (zeros), which is filled in place
+  uint64 w_offset = w.size();
+  uint64 v_offset = v.size();
+  w.resize(w_offset + num_attribute);
+  v.resize(v_offset + (uint64) num_attribute * num_factor);
+  if (k1) {
+    float* w_s = w.data() + w_offset;
+    for (uint i = 0; i < num_attribute; i++) {
+      w_s[i] = fm.w(i);
+    }
+  }
+  float* v_s = v.data() + v_offset;
+  for (int f = 0; f < num_factor; f++) {
+    for (uint i = 0; i < num_attribute; i++) {
+      v_s[(uint64) i * num_factor + f] = fm.v(f,i);
+    }
+  }
+  num_samples++;
+}
+
+void fm_posterior::add(const fm_posterior& other) {
+  assert((other.num_attribute == num_attribute) && (other.num_factor == num_factor));
+  w0.insert(w0.end(), other.w0.begin(), other.w0.end());
+  w.insert(w.end(), other.w.begin(), other.w.end());
+  v.insert(v.end(), other.v.begin(), other.v.end());
+  num_samples += other.num_samples;
+}
+
+void fm_posterior::predict(const sparse_row<FM_FLOAT>& x, double* out) const {
+  double sum[FM_PREDICT_STACK_FACTORS];
+  double sum_sqr[FM_PREDICT_STACK_FACTORS];
+  double* p_sum = sum;
+  double* p_sum_sqr = sum_sqr;
+  if (num_factor > FM_PREDICT_STACK_FACTORS) {
+    thread_local std::vector<double> large_sum, large_sum_sqr;
+    large_sum.resize(num_factor);
+    large_sum_sqr.resize(num_factor);
+    p_sum = large_sum.data();
+    p_sum_sqr = large_sum_sqr.data();
+  }
+  for (uint s = 0; s < num_samples; s++) {
+    const float* w_s = w.data() + (uint64) s * num_attribute;
+    const float* v_s = v.data() + (uint64) s * num_attribute * num_factor;
+    double result = w0[s];
+    for (int f = 0; f < num_factor; f++) {
+      p_sum[f] = 0;
+      p_sum_sqr[f] = 0;
+    }
+    for (uint i = 0; i < x.size; i++) {
+      uint id = x.data[i].id;
+      if (id >= num_attribute) { continue; }
+      double x_i = x.data[i].value;
+      result += (double) w_s[id] * x_i;
+      const float* v_i = v_s + (uint64) id * num_factor;
+      for (int f = 0; f < num_factor; f++) {
+        double d = (double) v_i[f] * x_i;
+        p_sum[f] += d;
+        p_sum_sqr[f] += d*d;
+      }
+    }
+    for (int f = 0; f < num_factor; f++) {
+      result += 0.5 * (p_sum[f]*p_sum[f] - p_sum_sqr[f]);
+    }
+    out[s] = result;
+  }
+}
+
+void fm_posterior::writeSamples(std::ostream& out, uint first) const {
+  for (uint s = first; s < num_samples; s++) {
+    out.write(reinterpret_cast<const char*>(&(w0[s])), sizeof(double));
+    out.write(reinterpret_cast<const char*>(w.data() + (uint64) s * num_attribute), sizeof(float) * num_attribute);
+    out.write(reinterpret_cast<const char*>(v.data() + (uint64) s * num_attribute * num_factor), sizeof(float) * num_attribute * num_factor);
+  }
+}
+
+bool fm_posterior::readSamples(std::istream& in, uint num) {
+  num_samples = num;
+  w0.resize(num_samples);
+  w.resize((uint64) num_samples * num_attribute);
+  v.resize((uint64) num_samples * num_attribute * num_factor);
+  for (uint s = 0; s < num_samples; s++) {
+    in.read(reinterpret_cast<char*>(&(w0[s])), sizeof(double));
+    in.read(reinterpret_cast<char*>(w.data() + (uint64) s * num_attribute), sizeof(float) * num_attribute);
+    in.read(reinterpret_cast<char*>(v.data() + (uint64) s * num_attribute * num_factor), sizeof(float) * num_attribute * num_factor);
+  }
+  return (bool) in;
+}
+
+void fm_posterior::save(std::string filename) {
+  std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (! out.is_open()) {
+    throw "Unable to open file " + filename;
+  }
+  fm_posterior_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FM_POSTERIOR_FILE_MAGIC, sizeof(header.magic));
+  header.version = FM_POSTERIOR_FILE_VERSION;
+  header.header_size = sizeof(header);
+  header.k0 = k0;
+  header.k1 = k1;
+  header.num_factor = num_factor;
+  header.num_attribute = num_attribute;
+  header.num_samples = num_samples;
+  header.task = task;
+  header.min_target = min_target;
+  header.max_target = max_target;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  writeSamples(out, 0);
+  out.close();
+  if (out.fail()) {
+    throw "Unable to write file " + filename;
+  }
+}
+
+int fm_posterior::load(std::string filename) {
+  std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (! in.is_open()) { return 0; }
+  fm_posterior_file_header header;
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (! in) { return 0; }
+  if (memcmp(header.magic, FM_POSTERIOR_FILE_MAGIC, sizeof(header.magic)) != 0) { return 0; }
+  if ((header.version != FM_POSTERIOR_FILE_VERSION) || (header.header_size != sizeof(header))) { return 0; }
+  k0 = header.k0;
+  k1 = header.k1;
+  num_factor = header.num_factor;
+  num_attribute = header.num_attribute;
+  task = header.task;
+  min_target = header.min_target;
+  max_target = header.max_target;
+  if (! readSamples(in, header.num_samples)) { return 0; }
+  return 1;
+}
+
+uint64 fm_posterior::getMemorySize() const {
+  return sizeof(double) * w0.size() + sizeof(float) * (w.size() + v.size());
+}
+
+void fm_posterior::debug() {
+  std::cout << "num_samples=" << num_samples << std::endl;
+  std::cout << "num_attributes=" << num_attribute << std::endl;
+  std::cout << "task=" << task << std::endl;
+  std::cout << "min_target=" << min_target << std::endl;
+  std::cout << "max_target=" << max_target << std::endl;
+  std::cout << "dim v =" << num_factor << std::endl;
+  std::cout << "memory=" << getMemorySize() << " bytes" << std::endl;
+}
+
+#endif /*FM_POSTERIOR_H_*/
@@ -0,0 +1,421 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_quantized.h: Read-only quantized copy of a trained FM model for serving
+//
+// The pairwise factors are stored attribute-major in one of two formats:
+// - int8: v_if ~= scale_i * q_if with q_if in [-127, 127] and one float scale
+//         per attribute (scale_i = max_f |v_if| / 127), 1 byte per factor
+// - fp16: IEEE half precision, 2 bytes per factor
+// w is stored as float, w0 as double. Predictions are accumulated in double.
+// The AVX2 kernel gives the same results as the portable one.
+
+#ifndef FM_QUANTIZED_H_
+#define FM_QUANTIZED_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../util/matrix.h"
+#include "../util/fmatrix.h"
+#include "fm_data.h"
+#include "fm_kernel.h"
+#include "fm_model.h"
+
+const int FM_QUANTIZE_INT8 = 1;
+const int FM_QUANTIZE_FP16 = 2;
+
+const char FM_QUANTIZED_FILE_MAGIC[8] = { 'l', 'i', 'b', 'F', 'M', 'q', 'n', 't' };
+const uint FM_QUANTIZED_FILE_VERSION = 1;
+
+// Quantized model files start with this header, followed by w (float), the
+// per attribute scales (float, int8 only) and v (stride values per attribute).
+struct fm_quantized_file_header {
+  char magic[8];
+  uint version;
+  uint header_size;
+  uint type;
+  uint k0;
+  uint k1;
+  uint num_factor;
+  uint num_attribute;
+  uint stride;
+  double w0;
+};
+
+// conversion between float and IEEE half precision (round to nearest even)
+uint16_t fm_float_to_half(float f);
+float fm_half_to_float(uint16_t h);
+
+class fm_quantized_model {
+ public:
+  fm_quantized_model();
+
+  void quantize(const fm_model& fm, int type);
+  void save(std::string filename);
+  // returns 0 if the file is not a valid quantized model
+  int load(std::string filename);
+
+  double predict(const sparse_row<FM_FLOAT>& x) const;
+  // bytes used by the parameters
+  uint64 getMemorySize() const;
+  std::string getTypeName() const;
+  void debug();
+
+  int type;
+  bool k0, k1;
+  int num_factor;
+  uint num_attribute;
+  uint stride; // number of stored factors per attribute (padded to 16 bytes)
+
+  double w0;
+  DVector<float> w;
+  DVector<float> v_scale;   // int8 only
+  // num_attribute * stride values, which may exceed the range of uint
+  std::vector<int8_t> v_int8;
+  std::vector<uint16_t> v_fp16;
+
+ protected:
+  void setSize(int p_type, int p_num_factor, uint p_num_attribute);
+};
+
+typedef void (*fm_quantized_accumulate_fn)(const sparse_row<FM_FLOAT>& x, const fm_quantized_model& q, double* sum, double* sum_sqr);
+
+// Implementation
+uint16_t fm_float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t exponent = (x >> 23) & 0xff;
+  uint32_t mantissa = x & 0x7fffff;
+  if (exponent == 0xff) {
+    // inf or nan
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  int e = (int) exponent - 127 + 15;
+  if (e >= 0x1f) {
+    // overflow to inf
+    return sign | 0x7c00;
+  }
+  if (e <= 0) {
+    // subnormal half or zero
+    if (e < -10) { return sign; }
+    mantissa |= 0x800000;
+    uint32_t shift = 14 - e;
+    uint32_t half_mantissa = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if ((rest > halfway) || ((rest == halfway) && (half_mantissa & 1))) {
+      half_mantissa++;
+    }
+    return sign | half_mantissa;
+  }
+  uint16_t h = sign | (e << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if ((rest > 0x1000) || ((rest == 0x1000) && (h & 1))) {
+    // may carry into the exponent, which is the correct rounding
+    h++;
+  }
+  return h;
+}
+
+float fm_half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // subnormal half: normalize
+    int e = -1;
+    do {
+      e++;
+      mantissa <<= 1;
+    } while ((mantissa & 0x400) == 0);
+    x = sign | ((uint32_t) (127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+void fm_quantized_accumulate_generic(const sparse_row<FM_FLOAT>& x, const fm_quantized_model& q, double* sum, double* sum_sqr) {
+  for (int f = 0; f < q.num_factor; f++) {
+    sum[f] = 0;
+    sum_sqr[f] = 0;
+  }
+  for (uint i = 0; i < x.size; i++) {
+    uint64 offset = (uint64) x.data[i].id * q.stride;
+    if (q.type == FM_QUANTIZE_INT8) {
+      const int8_t* v_i = q.v_int8.data() + offset;
+      double x_scaled = (double) q.v_scale(x.data[i].id) * x.data[i].value;
+      for (int f = 0; f < q.num_factor; f++) {
+        double d = (double) v_i[f] * x_scaled;
+        sum[f] += d;
+        sum_sqr[f] += d*d;
+      }
+    } else {
+      const uint16_t* v_i = q.v_fp16.data() + offset;
+      for (int f = 0; f < q.num_factor; f++) {
+        double d = (double) fm_half_to_float(v_i[f]) * x.data[i].value;
+        sum[f] += d;
+        sum_sqr[f] += d*d;
+      }
+    }
+  }
+}
+
+#ifdef FM_KERNEL_X86
+// The rows are padded to 16 bytes, so groups of 4 factors can always be
+// loaded completely.
+__attribute__((target("avx2,f16c"), optimize("fp-contract=off")))
+void fm_quantized_accumulate_avx2(const sparse_row<FM_FLOAT>& x, const fm_quantized_model& q, double* sum, double* sum_sqr) {
+  const int width = 4;
+  const int unroll = 4;
+  alignas(32) double out_sum[width * unroll];
+  alignas(32) double out_sum_sqr[width * unroll];
+  for (int f0 = 0; f0 < q.num_factor; f0 += width * unroll) {
+    int num_vec = std::min(unroll, (q.num_factor - f0 + width - 1) / width);
+    __m256d acc_sum[unroll];
+    __m256d acc_sum_sqr[unroll];
+    for (int j = 0; j < unroll; j++) {
+      acc_sum[j] = _mm256_setzero_pd();
+      acc_sum_sqr[j] = _mm256_setzero_pd();
+    }
+    for (uint i = 0; i < x.size; i++) {
+      uint64 offset = (uint64) x.data[i].id * q.stride + f0;
+      if (q.type == FM_QUANTIZE_INT8) {
+        const int8_t* v_i = q.v_int8.data() + offset;
+        __m256d x_i = _mm256_set1_pd((double) q.v_scale(x.data[i].id) * x.data[i].value);
+        for (int j = 0; j < num_vec; j++) {
+          int32_t packed;
+          memcpy(&packed, v_i + j * width, sizeof(packed));
+          __m256d v = _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(packed)));
+          __m256d d = _mm256_mul_pd(v, x_i);
+          acc_sum[j] = _mm256_add_pd(acc_sum[j], d);
+          acc_sum_sqr[j] = _mm256_add_pd(acc_sum_sqr[j], _mm256_mul_pd(d, d));
+        }
+      } else {
+        const uint16_t* v_i = q.v_fp16.data() + offset;
+        __m256d x_i = _mm256_set1_pd(x.data[i].value);
+        for (int j = 0; j < num_vec; j++) {
+          __m256d v = _mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(v_i + j * width))));
+          __m256d d = _mm256_mul_pd(v, x_i);
+          acc_sum[j] = _mm256_add_pd(acc_sum[j], d);
+          acc_sum_sqr[j] = _mm256_add_pd(acc_sum_sqr[j], _mm256_mul_pd(d, d));
+        }
+      }
+    }
+    for (int j = 0; j < num_vec; j++) {
+      _mm256_store_pd(out_sum + j * width, acc_sum[j]);
+      _mm256_store_pd(out_sum_sqr + j * width, acc_sum_sqr[j]);
+    }
+    int num_out = std::min(width * unroll, q.num_factor - f0);
+    for (int f = 0; f < num_out; f++) {
+      sum[f0 + f] = out_sum[f];
+      sum_sqr[f0 + f] = out_sum_sqr[f];
+    }
+  }
+}
+#endif
+
+fm_quantized_accumulate_fn fm_select_quantized_accumulate() {
+#ifdef FM_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+    return fm_quantized_accumulate_avx2;
+  }
+#endif
+  return fm_quantized_accumulate_generic;
+}
+
+const fm_quantized_accumulate_fn fm_quantized_accumulate = fm_select_quantized_accumulate();
+
+fm_quantized_model::fm_quantized_model() {
+  type = FM_QUANTIZE_INT8;
+  k0 = true;
+  k1 = true;
+  num_factor = 0;
+  num_attribute = 0;
+  stride = 0;
+  w0 = 0;
+}
+
+void fm_quantized_model::setSize(int p_type, int p_num_factor, uint p_num_attribute) {
+  if ((p_type != FM_QUANTIZE_INT8) && (p_type != FM_QUANTIZE_FP16)) {
+    throw "unknown quantization type";
+  }
+  type = p_type;
+  num_factor = p_num_factor;
+  num_attribute = p_num_attribute;
+  uint per_16_bytes = (type == FM_QUANTIZE_INT8) ? 16 : 8;
+  stride = ((num_factor + per_16_bytes - 1) / per_16_bytes) * per_16_bytes;
+  w.setSize(num_attribute);
+  w.init(0);
+  if (type == FM_QUANTIZE_INT8) {
+    v_scale.setSize(num_attribute);
+    v_scale.init(0);
+    v_int8.assign((uint64) num_attribute * stride, 0);
+    v_fp16.clear();
+  } else {
+    v_scale.setSize(0);
+    v_int8.clear();
+    v_fp16.assign((uint64) num_attribute * stride, 0);
+  }
+}
+
+void fm_quantized_model::quantize(const fm_model& fm, int type) {
+  setSize(type, fm.num_factor, fm.num_attribute);
+  k0 = fm.k0;
+  k1 = fm.k1;
+  w0 = k0 ? fm.w0 : 0;
+  for (uint i = 0; i < num_attribute; i++) {
+    w(i) = k1 ? fm.w(i) : 0;
+    if (type == FM_QUANTIZE_INT8) {
+      double max_abs = 0;
+      for (int f = 0; f < num_factor; f++) {
+        max_abs = std::max(max_abs, std::abs((double) fm.v(f,i)));
+      }
+      float scale = max_abs / 127.0;
+      v_scale(i) = scale;
+      int8_t* v_i = v_int8.data() + (uint64) i * stride;
+      for (int f = 0; f < num_factor; f++) {
+        if (scale > 0) {
+          double q = std::round(fm.v(f,i) / scale);
+          v_i[f] = (int8_t) std::max(-127.0, std::min(127.0, q));
+        }
+      }
+    } else {
+      uint16_t* v_i = v_fp16.data() + (uint64) i * stride;
+      for (int f = 0; f < num_factor; f++) {
+        v_i[f] = fm_float_to_half(fm.v(f,i));
+      }
+    }
+  }
+}
+
+double fm_quantized_model::predict(const sparse_row<FM_FLOAT>& x) const {
+  alignas(FM_CACHE_LINE_SIZE) double sum[FM_PREDICT_STACK_FACTORS];
+  alignas(FM_CACHE_LINE_SIZE) double sum_sqr[FM_PREDICT_STACK_FACTORS];
+  double* p_sum = sum;
+  double* p_sum_sqr = sum_sqr;
+  if (num_factor > FM_PREDICT_STACK_FACTORS) {
+    thread_local std::vector<double> large_sum, large_sum_sqr;
+    large_sum.resize(num_factor);
+    large_sum_sqr.resize(num_factor);
+    p_sum = large_sum.data();
+    p_sum_sqr = large_sum_sqr.data();
+  }
+  double result = 0;
+  if (k0) {
+    result += w0;
+  }
+  if (k1) {
+    for (uint i = 0; i < x.size; i++) {
+      assert(x.data[i].id < num_attribute);
+      result += (double) w(x.data[i].id) * x.data[i].value;
+    }
+  }
+  fm_quantized_accumulate(x, *this, p_sum, p_sum_sqr);
+  for (int f = 0; f < num_factor; f++) {
+    result += 0.5 * (p_sum[f]*p_sum[f] - p_sum_sqr[f]);
+  }
+  return result;
+}
+
+uint64 fm_quantized_model::getMemorySize() const {
+  return sizeof(float) * ((uint64) w.dim + v_scale.dim) + sizeof(int8_t) * v_int8.size() + sizeof(uint16_t) * v_fp16.size();
+}
+
+std::string fm_quantized_model::getTypeName() const {
+  return (type == FM_QUANTIZE_INT8) ? "int8" : "fp16";
+}
+
+void fm_quantized_model::debug() {
+  std::cout << "quantization=" << getTypeName() << std::endl;
+  std::cout << "num_attributes=" << num_attribute << std::endl;
+  std::cout << "dim v =" << num_factor << std::endl;
+  std::cout << "stride v =" << stride << std::endl;
+  std::cout << "memory=" << getMemorySize() << " bytes" << std::endl;
+}
+
+void fm_quantized_model::save(std::string filename) {
+  std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (! out.is_open()) {
+    throw "Unable to open file " + filename;
+  }
+  fm_quantized_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FM_QUANTIZED_FILE_MAGIC, sizeof(header.magic));
+  header.version = FM_QUANTIZED_FILE_VERSION;
+  header.header_size = sizeof(header);
+  header.type = type;
+  header.k0 = k0;
+  header.k1 = k1;
+  header.num_factor = num_factor;
+  header.num_attribute = num_attribute;
+  header.stride = stride;
+  header.w0 = w0;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(w.value), sizeof(float) * w.dim);
+  if (type == FM_QUANTIZE_INT8) {
+    out.write(reinterpret_cast<const char*>(v_scale.value), sizeof(float) * v_scale.dim);
+    out.write(reinterpret_cast<const char*>(v_int8.data()), sizeof(int8_t) * v_int8.size());
+  } else {
+    out.write(reinterpret_cast<const char*>(v_fp16.data()), sizeof(uint16_t) * v_fp16.size());
+  }
+  out.close();
+  if (out.fail()) {
+    throw "Unable to write file " + filename;
+  }
+}
+
+int fm_quantized_model::load(std::string filename) {
+  std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (! in.is_open()) { return 0; }
+  fm_quantized_file_header header;
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (! in) { return 0; }
+  if (memcmp(header.magic, FM_QUANTIZED_FILE_MAGIC, sizeof(header.magic)) != 0) { return 0; }
+  if ((header.version != FM_QUANTIZED_FILE_VERSION) || (header.header_size != sizeof(header))) { return 0; }
+  if ((header.type != (uint) FM_QUANTIZE_INT8) && (header.type != (uint) FM_QUANTIZE_FP16)) { return 0; }
+  setSize(header.type, header.num_factor, header.num_attribute);
+  if (header.stride != stride) { return 0; }
+  k0 = header.k0;
+  k1 = header.k1;
+  w0 = header.w0;
+  in.read(reinterpret_cast<char*>(w.value), sizeof(float) * w.dim);
+  if (type == FM_QUANTIZE_INT8) {
+    in.read(reinterpret_cast<char*>(v_scale.value), sizeof(float) * v_scale.dim);
+    in.read(reinterpret_cast<char*>(v_int8.data()), sizeof(int8_t) * v_int8.size());
+  } else {
+    in.read(reinterpret_cast<char*>(v_fp16.data()), sizeof(uint16_t) * v_fp16.size());
+  }
+  return in ? 1 : 0;
+}
+
+#endif /*FM_QUANTIZED_H_*/
@@ -0,0 +1,145 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_scorer.h: Scoring of many candidates for one fixed context
+//
+// The score of a row (context, candidate) is the prediction of the FM for the
+// concatenation of both rows. With s_f and q_f the factor sums of the context
+// and c_f and p_f the ones of the candidate, the pairwise part splits into
+//   0.5 \sum_f ((s_f+c_f)^2 - (q_f+p_f))
+//     = 0.5 \sum_f (s_f^2 - q_f) + 0.5 \sum_f (c_f^2 - p_f) + \sum_f s_f c_f
+// The context part is computed once in setContext, so scoring a candidate
+// costs O(k * nnz(candidate)) independent of the size of the context.
+
+#ifndef FM_SCORER_H_
+#define FM_SCORER_H_
+
+#include <algorithm>
+#include <vector>
+#include "../util/matrix.h"
+#include "../util/fmatrix.h"
+#include "../util/parallel.h"
+#include "fm_data.h"
+#include "fm_model.h"
+
+// number of candidates that are handed to a thread at once
+const uint FM_SCORE_GRAIN_CANDIDATES = 4096;
+
+struct fm_scored_candidate {
+  double score;
+  uint index; // position of the candidate in the input
+};
+
+// strict order of the ranking: higher score first, ties by lower index
+inline bool fm_better_candidate(const fm_scored_candidate& a, const fm_scored_candidate& b) {
+  return (a.score > b.score) || ((a.score == b.score) && (a.index < b.index));
+}
+
+class fm_candidate_scorer {
+ public:
+  // the model must not change while the scorer is used
+  fm_candidate_scorer(const fm_model* fm);
+
+  void setContext(const sparse_row<FM_FLOAT>& context);
+
+  // prediction of the model for the concatenation of context and candidate
+  double score(const sparse_row<FM_FLOAT>& candidate) const;
+  double score(const sparse_row<FM_FLOAT>& candidate, double* sum, double* sum_sqr) const;
+
+  // the k best candidates ordered by fm_better_candidate; the candidates are
+  // scored in parallel with the threads of pool, the result does not depend
+  // on the number of threads
+  void topK(const sparse_row<FM_FLOAT>* candidates, uint num_candidates, uint k, ThreadPool& pool, std::vector<fm_scored_candidate>& out) const;
+
+ protected:
+  const fm_model* fm;
+  double context_offset; // linear and pairwise part of the context
+  DVector<double> context_sum;
+};
+
+// Implementation
+fm_candidate_scorer::fm_candidate_scorer(const fm_model* fm) {
+  this->fm = fm;
+  context_offset = 0;
+  context_sum.setSize(fm->num_factor);
+  context_sum.init(0);
+}
+
+void fm_candidate_scorer::setContext(const sparse_row<FM_FLOAT>& context) {
+  context_sum.setSize(fm->num_factor);
+  DVector<double> context_sum_sqr;
+  context_sum_sqr.setSize(fm->num_factor);
+  context_offset = fm->predict(context, context_sum, context_sum_sqr);
+  // the bias is added again with every candidate
+  if (fm->k0) {
+    context_offset -= fm->w0;
+  }
+}
+
+double fm_candidate_scorer::score(const sparse_row<FM_FLOAT>& candidate) const {
+  if (fm->num_factor <= FM_PREDICT_STACK_FACTORS) {
+    alignas(FM_CACHE_LINE_SIZE) double sum[FM_PREDICT_STACK_FACTORS];
+    alignas(FM_CACHE_LINE_SIZE) double sum_sqr[FM_PREDICT_STACK_FACTORS];
+    return score(candidate, sum, sum_sqr);
+  } else {
+    thread_local std::vector<double> sum, sum_sqr;
+    sum.resize(fm->num_factor);
+    sum_sqr.resize(fm->num_factor);
+    return score(candidate, sum.data(), sum_sqr.data());
+  }
+}
+
+double fm_candidate_scorer::score(const sparse_row<FM_FLOAT>& candidate, double* sum, double* sum_sqr) const {
+  double result = context_offset + fm->predict(candidate, sum, sum_sqr);
+  for (int f = 0; f < fm->num_factor; f++) {
+    result += context_sum(f) * sum[f];
+  }
+  return result;
+}
+
+void fm_candidate_scorer::topK(const sparse_row<FM_FLOAT>* candidates, uint num_candidates, uint k, ThreadPool& pool, std::vector<fm_scored_candidate>& out) const {
+  out.clear();
+  if (k == 0) { return; }
+  // one heap per thread with the worst of its best k candidates on top
+  std::vector< std::vector<fm_scored_candidate> > heap(pool.getNumThreads());
+  pool.parallel_for(0, num_candidates, FM_SCORE_GRAIN_CANDIDATES, [&](uint64 begin, uint64 end, int thread) {
+    std::vector<fm_scored_candidate>& h = heap[thread];
+    for (uint64 c = begin; c < end; c++) {
+      fm_scored_candidate candidate;
+      candidate.score = score(candidates[c]);
+      candidate.index = c;
+      if (h.size() < k) {
+        h.push_back(candidate);
+        std::push_heap(h.begin(), h.end(), fm_better_candidate);
+      } else if (fm_better_candidate(candidate, h.front())) {
+        std::pop_heap(h.begin(), h.end(), fm_better_candidate);
+        h.back() = candidate;
+        std::push_heap(h.begin(), h.end(), fm_better_candidate);
+      }
+    }
+  });
+  for (uint t = 0; t < heap.size(); t++) {
+    out.insert(out.end(), heap[t].begin(), heap[t].end());
+  }
+  uint num_out = std::min((uint64) k, (uint64) out.size());
+  std::partial_sort(out.begin(), out.begin() + num_out, out.end(), fm_better_candidate);
+  out.resize(num_out);
+}
+
+#endif /*FM_SCORER_H_*/
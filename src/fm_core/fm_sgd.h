@@ -28,100 +28,130 @@
 #ifndef FM_SGD_H_
 #define FM_SGD_H_
 
+#include <algorithm>
+#include <vector>
 #include "fm_model.h"
+#include "fm_kernel.h"
 
-void fm_SGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+// SGD step for the global bias w0
+void fm_SGD_w0(fm_model* fm, const double& learn_rate, const double multiplier) {
   if (fm->k0) {
     double& w0 = fm->w0;
     w0 -= learn_rate * (multiplier + fm->reg0 * w0);
   }
+}
+
+// SGD step for the parameters w and v of the attributes of x
+void fm_SGD_row(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
   if (fm->k1) {
     for (uint i = 0; i < x.size; i++) {
-      double& w = fm->w(x.data[i].id);
+      FM_PARAM_FLOAT& w = fm->w(x.data[i].id);
       w -= learn_rate * (multiplier * x.data[i].value + fm->regw * w);
     }
   }
-  for (int f = 0; f < fm->num_factor; f++) {
-    for (uint i = 0; i < x.size; i++) {
-      double& v = fm->v(f,x.data[i].id);
-      double grad = sum(f) * x.data[i].value - v * x.data[i].value * x.data[i].value;
-      v -= learn_rate * (multiplier * grad + fm->regv * v);
+  if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    fm_dispatch_num_factor(fm->num_factor, [&](auto k) {
+      const int num_factor = (decltype(k)::value > 0) ? decltype(k)::value : fm->num_factor;
+      const double* sum_f = sum.value;
+      for (uint i = 0; i < x.size; i++) {
+        FM_PARAM_FLOAT* v_i = fm->v.attribute(x.data[i].id);
+        for (int f = 0; f < num_factor; f++) {
+          FM_PARAM_FLOAT& v = v_i[f];
+          double grad = sum_f[f] * x.data[i].value - (double) v * x.data[i].value * x.data[i].value;
+          v -= learn_rate * (multiplier * grad + fm->regv * v);
+        }
+      }
+    });
+  } else {
+    for (int f = 0; f < fm->num_factor; f++) {
+      for (uint i = 0; i < x.size; i++) {
+        FM_PARAM_FLOAT& v = fm->v(f,x.data[i].id);
+        double grad = sum(f) * x.data[i].value - (double) v * x.data[i].value * x.data[i].value;
+        v -= learn_rate * (multiplier * grad + fm->regv * v);
+      }
     }
   }
 }
 
-void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x_pos, sparse_row<DATA_FLOAT> &x_neg, const double multiplier, DVector<double> &sum_pos, DVector<double> &sum_neg, DVector<bool> &grad_visited, DVector<double> &grad) {
-  if (fm->k0) {
-    double& w0 = fm->w0;
-    w0 -= fm->reg0 * w0; // w0 should always be 0
+// SGD step for all parameters of x
+void fm_SGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  fm_SGD_w0(fm, learn_rate, multiplier);
+  fm_SGD_row(fm, learn_rate, x, multiplier, sum);
+}
+
+// Scratch of fm_pairSGD: one entry per distinct attribute of the two rows,
+// so its size is bounded by the nonzeros of the pair and not by the number of
+// attributes. Every thread needs its own scratch.
+struct fm_pair_coef {
+  uint id;
+  double x_pos_sum;  // \sum of x_pos,i with id i
+  double x_neg_sum;  // \sum of x_neg,i with id i
+  double x_sqr_diff; // \sum x_pos,i^2 - \sum x_neg,i^2
+};
+typedef std::vector<fm_pair_coef> fm_pair_scratch;
+
+// SGD step for the gradient of multiplier * (y(x_pos) - y(x_neg)); sum_pos and
+// sum_neg are the factor sums of both predictions. w0 cancels out, so it is
+// not touched; the caller regularizes it (see fm_learn_sgd_bpr).
+void fm_pairSGD(fm_model* fm, const double& learn_rate, sparse_row<DATA_FLOAT> &x_pos, sparse_row<DATA_FLOAT> &x_neg, const double multiplier, DVector<double> &sum_pos, DVector<double> &sum_neg, fm_pair_scratch& coef) {
+  // merge the entries of both rows by attribute
+  coef.clear();
+  for (uint i = 0; i < x_pos.size; i++) {
+    double x = x_pos.data[i].value;
+    fm_pair_coef c = { x_pos.data[i].id, x, 0, x * x };
+    coef.push_back(c);
   }
-  if (fm->k1) {
-    for (uint i = 0; i < x_pos.size; i++) {
-      grad(x_pos.data[i].id) = 0;
-      grad_visited(x_pos.data[i].id) = false;
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      grad(x_neg.data[i].id) = 0;
-      grad_visited(x_neg.data[i].id) = false;
-    }
-    for (uint i = 0; i < x_pos.size; i++) {
-      grad(x_pos.data[i].id) += x_pos.data[i].value;
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      grad(x_neg.data[i].id) -= x_neg.data[i].value;
-    }
-    for (uint i = 0; i < x_pos.size; i++) {
-      uint& attr_id = x_pos.data[i].id;
-      if (! grad_visited(attr_id)) {
-        double& w = fm->w(attr_id);
-        w -= learn_rate * (multiplier * grad(attr_id) + fm->regw * w);
-        grad_visited(attr_id) = true;
-      }
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      uint& attr_id = x_neg.data[i].id;
-      if (! grad_visited(attr_id)) {
-        double& w = fm->w(attr_id);
-        w -= learn_rate * (multiplier * grad(attr_id) + fm->regw * w);
-        grad_visited(attr_id) = true;
-      }
+  for (uint i = 0; i < x_neg.size; i++) {
+    double x = x_neg.data[i].value;
+    fm_pair_coef c = { x_neg.data[i].id, 0, x, - x * x };
+    coef.push_back(c);
+  }
+  std::sort(coef.begin(), coef.end(), [](const fm_pair_coef& a, const fm_pair_coef& b) { return a.id < b.id; });
+  uint num_coef = 0;
+  for (uint j = 0; j < coef.size(); j++) {
+    if ((num_coef > 0) && (coef[num_coef - 1].id == coef[j].id)) {
+      coef[num_coef - 1].x_pos_sum += coef[j].x_pos_sum;
+      coef[num_coef - 1].x_neg_sum += coef[j].x_neg_sum;
+      coef[num_coef - 1].x_sqr_diff += coef[j].x_sqr_diff;
+    } else {
+      coef[num_coef++] = coef[j];
     }
   }
+  coef.resize(num_coef);
 
-  for (int f = 0; f < fm->num_factor; f++) {
-    for (uint i = 0; i < x_pos.size; i++) {
-      grad(x_pos.data[i].id) = 0;
-      grad_visited(x_pos.data[i].id) = false;
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      grad(x_neg.data[i].id) = 0;
-      grad_visited(x_neg.data[i].id) = false;
-    }
-    for (uint i = 0; i < x_pos.size; i++) {
-      grad(x_pos.data[i].id) += sum_pos(f) * x_pos.data[i].value - fm->v(f, x_pos.data[i].id) * x_pos.data[i].value * x_pos.data[i].value;
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      grad(x_neg.data[i].id) -= sum_neg(f) * x_neg.data[i].value - fm->v(f, x_neg.data[i].id) * x_neg.data[i].value * x_neg.data[i].value;
+  if (fm->k1) {
+    for (uint j = 0; j < coef.size(); j++) {
+      FM_PARAM_FLOAT& w = fm->w(coef[j].id);
+      w -= learn_rate * (multiplier * (coef[j].x_pos_sum - coef[j].x_neg_sum) + fm->regw * w);
     }
-    for (uint i = 0; i < x_pos.size; i++) {
-      uint& attr_id = x_pos.data[i].id;
-      if (! grad_visited(attr_id)) {
-        double& v = fm->v(f,attr_id);
-        v -= learn_rate * (multiplier * grad(attr_id) + fm->regv * v);
-        grad_visited(attr_id) = true;
+  }
+
+  // grad_v_if = sum_pos(f) * x_pos,i - sum_neg(f) * x_neg,i - v_if * (x_pos,i^2 - x_neg,i^2)
+  const double* s_pos = sum_pos.value;
+  const double* s_neg = sum_neg.value;
+  if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    fm_dispatch_num_factor(fm->num_factor, [&](auto k) {
+      const int num_factor = (decltype(k)::value > 0) ? decltype(k)::value : fm->num_factor;
+      for (uint j = 0; j < coef.size(); j++) {
+        const fm_pair_coef& c = coef[j];
+        FM_PARAM_FLOAT* v_a = fm->v.attribute(c.id);
+        for (int f = 0; f < num_factor; f++) {
+          FM_PARAM_FLOAT& v = v_a[f];
+          double g = s_pos[f] * c.x_pos_sum - s_neg[f] * c.x_neg_sum - (double) v * c.x_sqr_diff;
+          v -= learn_rate * (multiplier * g + fm->regv * v);
+        }
       }
-    }
-    for (uint i = 0; i < x_neg.size; i++) {
-      uint& attr_id = x_neg.data[i].id;
-      if (! grad_visited(attr_id)) {
-        double& v = fm->v(f,attr_id);
-        v -= learn_rate * (multiplier * grad(attr_id) + fm->regv * v);
-        grad_visited(attr_id) = true;
+    });
+  } else {
+    for (int f = 0; f < fm->num_factor; f++) {
+      for (uint j = 0; j < coef.size(); j++) {
+        const fm_pair_coef& c = coef[j];
+        FM_PARAM_FLOAT& v = fm->v(f, c.id);
+        double g = s_pos[f] * c.x_pos_sum - s_neg[f] * c.x_neg_sum - (double) v * c.x_sqr_diff;
+        v -= learn_rate * (multiplier * g + fm->regv * v);
       }
     }
-
-
   }
-
 }
+
 #endif /*FM_SGD_H_*/
@@ -49,16 +49,61 @@
 #include "../util/util.h"
 #include "../util/cmdline.h"
 #include "../fm_core/fm_model.h"
+#include "../fm_core/fm_quantized.h"
 #include "src/Data.h"
 #include "src/fm_learn.h"
 #include "src/fm_learn_sgd.h"
 #include "src/fm_learn_sgd_element.h"
 #include "src/fm_learn_sgd_element_adapt_reg.h"
+#include "src/fm_learn_sgd_element_adagrad.h"
+#include "src/fm_learn_sgd_element_adam.h"
+#include "src/fm_learn_sgd_element_ftrl.h"
+#include "src/fm_learn_sgd_bpr.h"
+#include "src/fm_learn_sgd_stream.h"
 #include "src/fm_learn_mcmc_simultaneous.h"
 
 
 using namespace std;
 
+// compares the quantized model with the full precision model of fml on data
+void report_quantization_error(fm_learn* fml, const fm_quantized_model& fm_q, Data& data) {
+  DVector<double> pred_full;
+  pred_full.setSize(data.num_cases);
+  fml->predict_batch(data, pred_full, fml->num_threads);
+
+  double err_full = 0, err_q = 0;
+  double max_diff = 0, sum_diff = 0;
+  for (data.data->begin(); !data.data->end(); data.data->next()) {
+    uint row = data.data->getRowIndex();
+    double p_full = pred_full(row);
+    double p_q = fm_q.predict(data.data->getRow());
+    double diff = std::abs(p_full - p_q);
+    max_diff = std::max(max_diff, diff);
+    sum_diff += diff;
+    if (fml->task == fm_learn::TASK_REGRESSION) {
+      p_full = std::max(fml->min_target, std::min(fml->max_target, p_full));
+      p_q = std::max(fml->min_target, std::min(fml->max_target, p_q));
+      err_full += (p_full - data.target(row)) * (p_full - data.target(row));
+      err_q += (p_q - data.target(row)) * (p_q - data.target(row));
+    } else {
+      err_full += ((p_full >= 0) == (data.target(row) >= 0)) ? 1 : 0;
+      err_q += ((p_q >= 0) == (data.target(row) >= 0)) ? 1 : 0;
+    }
+  }
+  uint num_rows = data.data->getNumRows();
+  std::string metric = "accuracy";
+  if (fml->task == fm_learn::TASK_REGRESSION) {
+    metric = "rmse";
+    err_full = std::sqrt(err_full / num_rows);
+    err_q = std::sqrt(err_q / num_rows);
+  } else {
+    err_full /= num_rows;
+    err_q /= num_rows;
+  }
+  std::cout << "Quantized (" << fm_q.getTypeName() << ")\t" << "Test " << metric << ": full=" << err_full << "\tquantized=" << err_q << "\tdelta=" << (err_q - err_full) << std::endl;
+  std::cout << "Quantized (" << fm_q.getTypeName() << ")\t" << "Test |prediction difference|: max=" << max_diff << "\tmean=" << (sum_diff / num_rows) << std::endl;
+}
+
 int main(int argc, char **argv) {
 
   try {
@@ -75,9 +120,9 @@ int main(int argc, char **argv) {
 
     const std::string param_task       = cmdline.registerParameter("task", "r=regression, c=binary classification [MANDATORY]");
     const std::string param_meta_file  = cmdline.registerParameter("meta", "filename for meta information about data set");
-    const std::string param_train_file = cmdline.registerParameter("train", "filename for training data [MANDATORY]");
+    const std::string param_train_file = cmdline.registerParameter("train", "filename for training data [MANDATORY, except for MCMC with -load_model]");
     const std::string param_test_file  = cmdline.registerParameter("test", "filename for test data [MANDATORY]");
-    const std::string param_val_file   = cmdline.registerParameter("validation", "filename for validation data (only for SGDA)");
+    const std::string param_val_file   = cmdline.registerParameter("validation", "filename for validation data (for SGDA and for the stop criterion -patience)");
     const std::string param_out        = cmdline.registerParameter("out", "filename for output");
 
     const std::string param_dim        = cmdline.registerParameter("dim", "'k0,k1,k2': k0=use bias, k1=use 1-way interactions, k2=dim of 2-way interactions; default=1,1,8");
@@ -86,7 +131,34 @@ int main(int argc, char **argv) {
     const std::string param_num_iter   = cmdline.registerParameter("iter", "number of iterations; default=100");
     const std::string param_learn_rate = cmdline.registerParameter("learn_rate", "learn_rate for SGD; default=0.1");
 
-    const std::string param_method     = cmdline.registerParameter("method", "learning method (SGD, SGDA, ALS, MCMC); default=MCMC");
+    const std::string param_method     = cmdline.registerParameter("method", "learning method (SGD, SGDA, ADAGRAD, ADAM, FTRL, BPR, ALS, MCMC); ADAGRAD, ADAM and FTRL are SGD with adaptive per-parameter learning rates; BPR is SGD for pairwise ranking of the rows with positive target, see -bpr_item_group; default=MCMC");
+    const std::string param_layout     = cmdline.registerParameter("layout", "memory layout of the 2-way factors: 'attribute' (factors of one attribute are contiguous) or 'factor' (factor-major); ALS and MCMC always use 'factor'; default=attribute");
+
+    const std::string param_threads    = cmdline.registerParameter("threads", "number of threads for SGD learning, MCMC and ALS sampling, prediction and evaluation; SGDA runs its theta and lambda steps on two threads; 0=one per hardware thread; default=1");
+    const std::string param_chains     = cmdline.registerParameter("chains", "for MCMC: number of independent chains; they run on up to -threads threads (one thread per chain), their samples are merged into one prediction and the R-hat of the test predictions is reported; default=1");
+    const std::string param_checkpoint = cmdline.registerParameter("checkpoint", "for MCMC and ALS: filename for checkpoints of the sampler state (model, priors, prediction sums, random state); the posterior samples (-posterior_every) are appended to the file with the suffix .posterior; several chains write one file each with the suffix .chain<c>");
+    const std::string param_checkpoint_every = cmdline.registerParameter("checkpoint_every", "for -checkpoint: number of iterations between two checkpoints; the last iteration is always written; default=1");
+    const std::string param_resume     = cmdline.registerParameter("resume", "for -checkpoint: 1=continue after the iterations of the checkpoint if it exists (with the same data and options); -iter is the total number of iterations; default=0");
+    const std::string param_posterior_every = cmdline.registerParameter("posterior_every", "for MCMC: keep every n-th sample after the first 5 iterations for -save_model and for predicting data other than -test; every kept sample takes about #attributes * (1 + k2) * 4 bytes in memory and in the file (36 MB for 1M attributes and k2=8), so the file grows with (#iterations - 5) / n; 0=none (not allowed with -save_model); default=0");
+    const std::string param_batch_size = cmdline.registerParameter("batch_size", "number of rows per SGD step; >1 updates every parameter once per mini-batch with the mean gradient (same model for any number of threads, not with -sgd_parallel partitioned); default=1");
+    const std::string param_adam_beta  = cmdline.registerParameter("adam_beta", "'b1,b2' for ADAM: decay rates of the first and second moments; default=0.9,0.999");
+    const std::string param_ftrl_beta  = cmdline.registerParameter("ftrl_beta", "beta for FTRL: smoothing of the per-parameter learning rates; default=1");
+    const std::string param_ftrl_l1    = cmdline.registerParameter("ftrl_l1", "L1 regularization of the 1-way interactions for FTRL (sparse models); default=0");
+    const std::string param_bpr_item_group = cmdline.registerParameter("bpr_item_group", "for BPR: attribute group (-meta) of the items, all other attributes are the context; default=last group");
+    const std::string param_bpr_neg_exponent = cmdline.registerParameter("bpr_neg_exponent", "for BPR: negative items are sampled with probability ~ popularity^e (e >= 0); 0=uniform; default=1");
+    const std::string param_max_time   = cmdline.registerParameter("max_time", "stop learning before the next iteration would exceed this many seconds of wall-clock time; default=0 (no limit)");
+    const std::string param_patience   = cmdline.registerParameter("patience", "stop learning after this many iterations without an improvement of the validation measure by more than -min_delta and keep the best parameters; the measure is taken on -validation (for MCMC on the mean prediction of the samples so far); default=0 (off)");
+    const std::string param_min_delta  = cmdline.registerParameter("min_delta", "minimum improvement of the validation measure for -patience; default=0");
+    const std::string param_min_param_change = cmdline.registerParameter("min_param_change", "stop learning if the relative change of all parameters in one iteration is below this value; default=0 (off)");
+    const std::string param_sgd_parallel = cmdline.registerParameter("sgd_parallel", "parallel SGD: 'hogwild' (lock-free updates; not for ADAGRAD, ADAM and FTRL, which are always partitioned) or 'partitioned' (rounds of rows without common attributes; same model for any number of threads); default=hogwild");
+    const std::string param_shuffle    = cmdline.registerParameter("shuffle", "shuffle the training rows in every iteration of SGD, SGDA, ADAGRAD, ADAM, FTRL and BPR; data on disk (-cache_size) is read in a random order of its cache blocks, see -shuffle_buffer; default=0");
+    const std::string param_shuffle_buffer = cmdline.registerParameter("shuffle_buffer", "for -shuffle with data on disk: number of cache blocks whose rows are mixed in memory; 0=only the order of the blocks is random; default=1");
+    const std::string param_eval_every = cmdline.registerParameter("eval_every", "for the SGD-based methods: evaluate the test and validation data only every n-th iteration and after the last one; default=1");
+    const std::string param_eval_sample = cmdline.registerParameter("eval_sample", "for SGD, SGDA, ADAGRAD, ADAM and FTRL: evaluate the test and validation data on a fixed random sample of this many rows; 0=all rows; default=0");
+    const std::string param_stream     = cmdline.registerParameter("stream", "for SGD: read the training rows in libFM format from this file, FIFO or 'stdin' and make one SGD step per row; no -train or -test; the model grows with new attribute ids and is written to -save_model at every checkpoint");
+    const std::string param_stream_checkpoint = cmdline.registerParameter("stream_checkpoint", "for -stream: number of rows between two checkpoints (progress report and -save_model); 0=only at the end; default=100000");
+    const std::string param_stream_max_attribute = cmdline.registerParameter("stream_max_attribute", "for -stream: attribute ids are taken modulo this value, so the model has a fixed size; default=0 (the model grows)");
+    const std::string param_eval_train = cmdline.registerParameter("eval_train", "for SGD, SGDA, ADAGRAD, ADAM and FTRL: 'full' (extra pass over the training data after each iteration) or 'progressive' (errors of the predictions made during the SGD pass before each step); default=full");
 
     const std::string param_verbosity  = cmdline.registerParameter("verbosity", "how much infos to print; default=0");
     const std::string param_r_log      = cmdline.registerParameter("rlog", "write measurements within iterations to a file; default=''");
@@ -98,8 +170,11 @@ int main(int argc, char **argv) {
 
     const std::string param_cache_size = cmdline.registerParameter("cache_size", "cache size for data storage (only applicable if data is in binary format), default=infty");
 
-    const std::string param_save_model = cmdline.registerParameter("save_model", "filename for writing the FM model");
-    const std::string param_load_model = cmdline.registerParameter("load_model", "filename for reading the FM model");
+    const std::string param_save_model = cmdline.registerParameter("save_model", "filename for writing the FM model; for MCMC the posterior samples (see -posterior_every)");
+    const std::string param_load_model = cmdline.registerParameter("load_model", "filename for reading the FM model (text or binary, detected automatically); for MCMC the posterior samples of -save_model, which predict -test without learning and without -train (the task and the target range are stored with the samples)");
+    const std::string param_model_format = cmdline.registerParameter("model_format", "format for -save_model: 'text' or 'binary' (memory mappable, fast to load); default=text");
+    const std::string param_export_quantized = cmdline.registerParameter("export_quantized", "filename for writing a quantized copy of the FM model for inference; the accuracy on the test data is compared with the full model");
+    const std::string param_quantize   = cmdline.registerParameter("quantize", "type for -export_quantized: 'int8' (per attribute scale) or 'fp16'; default=int8");
 
     const std::string param_do_sampling  = "do_sampling";
     const std::string param_do_multilevel  = "do_multilevel";
@@ -120,15 +195,9 @@ int main(int argc, char **argv) {
     if (! cmdline.hasParameter(param_dim)) { cmdline.setValue(param_dim, "1,1,8"); }
 
     // Check for invalid flags.
-    if (! cmdline.getValue(param_method).compare("mcmc") && cmdline.hasParameter(param_save_model)) {
-      std::cout << "WARNING: -save_model enabled only for SGD and ALS." << std::endl;
-      cmdline.removeParameter(param_save_model);
-      return 0;
-    }
-
-    if (! cmdline.getValue(param_method).compare("mcmc") && cmdline.hasParameter(param_load_model)) {
-      std::cout << "WARNING: -load_model enabled only for SGD and ALS." << std::endl;
-      cmdline.removeParameter(param_load_model);
+    if (! cmdline.getValue(param_method).compare("mcmc") && cmdline.hasParameter(param_export_quantized)) {
+      std::cout << "WARNING: -export_quantized enabled only for SGD and ALS." << std::endl;
+      cmdline.removeParameter(param_export_quantized);
       return 0;
     }
 
@@ -137,13 +206,165 @@ int main(int argc, char **argv) {
       if (! cmdline.hasParameter(param_do_sampling)) { cmdline.setValue(param_do_sampling, "0"); }
       if (! cmdline.hasParameter(param_do_multilevel)) { cmdline.setValue(param_do_multilevel, "0"); }
     }
+    // MCMC saves and loads posterior samples instead of a single model;
+    // loaded samples predict the test data without learning
+    const bool mcmc_sampling = ! cmdline.getValue(param_method).compare("mcmc") && cmdline.getValue(param_do_sampling, true);
+    const bool load_posterior = mcmc_sampling && cmdline.hasParameter(param_load_model);
+    if (mcmc_sampling && cmdline.hasParameter(param_save_model) && ! load_posterior && (cmdline.getValue(param_posterior_every, 0) <= 0)) {
+      throw "-save_model for MCMC needs -posterior_every n > 0 (every n-th sample is saved, see -help)";
+    }
+
+    // (0) Streaming SGD: no data is loaded, the rows are read one by one
+    if (cmdline.hasParameter(param_stream)) {
+      if (cmdline.getValue(param_method).compare("sgd")) {
+        throw "-stream is only supported with -method sgd";
+      }
+      fm_learn_sgd_stream fml;
+      fml.max_attribute = std::max(0, cmdline.getValue(param_stream_max_attribute, 0));
+      fm_model fm;
+      {
+        fm.num_attribute = fml.max_attribute;
+        fm.init_stdev = cmdline.getValue(param_init_stdev, 0.1);
+        vector<int> dim = cmdline.getIntValues(param_dim);
+        assert(dim.size() == 3);
+        fm.k0 = dim[0] != 0;
+        fm.k1 = dim[1] != 0;
+        fm.num_factor = dim[2];
+        if (! cmdline.getValue(param_layout, "attribute").compare("attribute")) {
+          fm.layout = FM_LAYOUT_ATTRIBUTE_MAJOR;
+        } else if (! cmdline.getValue(param_layout).compare("factor")) {
+          fm.layout = FM_LAYOUT_FACTOR_MAJOR;
+        } else {
+          throw "unknown layout " + cmdline.getValue(param_layout);
+        }
+        if (cmdline.hasParameter(param_load_model)) {
+          std::cout << "Reading FM model... \t" << std::endl;
+          if (! fm.loadModel(cmdline.getValue(param_load_model))) {
+            throw "unable to read the model " + cmdline.getValue(param_load_model);
+          }
+        } else {
+          fm.init();
+        }
+        vector<double> reg = cmdline.getDblValues(param_regular);
+        assert((reg.size() == 0) || (reg.size() == 1) || (reg.size() == 3));
+        fm.reg0 = (reg.size() > 0) ? reg[0] : 0.0;
+        fm.regw = (reg.size() == 3) ? reg[1] : fm.reg0;
+        fm.regv = (reg.size() == 3) ? reg[2] : fm.reg0;
+      }
+      DataMetaInfo meta(0);
+      fml.fm = &fm;
+      fml.meta = &meta;
+      fml.num_iter = 1;
+      if (! cmdline.getValue("task").compare("r") ) {
+        fml.task = fm_learn::TASK_REGRESSION;
+      } else if (! cmdline.getValue("task").compare("c") ) {
+        fml.task = fm_learn::TASK_CLASSIFICATION;
+      } else {
+        throw "unknown task";
+      }
+      RLog* rlog = NULL;
+      if (cmdline.hasParameter(param_r_log)) {
+        ofstream* out_rlog = new ofstream(cmdline.getValue(param_r_log).c_str());
+        if (! out_rlog->is_open())  {
+          throw "Unable to open file " + cmdline.getValue(param_r_log);
+        }
+        rlog = new RLog(out_rlog);
+      }
+      fml.log = rlog;
+      fml.init();
+      {
+        vector<double> lr = cmdline.getDblValues(param_learn_rate);
+        assert((lr.size() == 1) || (lr.size() == 3));
+        fml.learn_rate = (lr.size() == 1) ? lr[0] : 0;
+        fml.learn_rates(0) = lr[0];
+        fml.learn_rates(1) = (lr.size() == 3) ? lr[1] : lr[0];
+        fml.learn_rates(2) = (lr.size() == 3) ? lr[2] : lr[0];
+      }
+      fml.checkpoint_rows = std::max(0, cmdline.getValue(param_stream_checkpoint, 100000));
+      if (cmdline.hasParameter(param_save_model)) {
+        fml.checkpoint_file = cmdline.getValue(param_save_model);
+        if (! cmdline.getValue(param_model_format, "text").compare("text")) {
+          fml.checkpoint_format = FM_MODEL_FORMAT_TEXT;
+        } else if (! cmdline.getValue(param_model_format).compare("binary")) {
+          fml.checkpoint_format = FM_MODEL_FORMAT_BINARY;
+        } else {
+          throw "unknown model format " + cmdline.getValue(param_model_format);
+        }
+      }
+      if (rlog != NULL) {
+        rlog->init();
+      }
+      if (cmdline.getValue(param_verbosity, 0) > 0) {
+        fm.debug();
+        fml.debug();
+      }
+
+      if (! cmdline.getValue(param_stream).compare("stdin")) {
+        fml.learnStream(std::cin);
+      } else {
+        ifstream in(cmdline.getValue(param_stream).c_str());
+        if (! in.is_open()) {
+          throw "unable to open " + cmdline.getValue(param_stream);
+        }
+        fml.learnStream(in);
+      }
+      return 0;
+    }
+
+    // (0.1) Loaded posterior samples of MCMC predict the test data; the
+    // training data is not needed
+    if (load_posterior) {
+      fm_learn_mcmc_simultaneous fml;
+      std::cout << "Reading posterior samples... \t" << std::endl;
+      if (! fml.posterior.load(cmdline.getValue(param_load_model))) {
+        throw "malformed posterior file " + cmdline.getValue(param_load_model);
+      }
+      std::cout << "#Samples=" << fml.posterior.num_samples << std::endl;
+      if (cmdline.hasParameter(param_task) && cmdline.getValue(param_task).compare((fml.posterior.task == fm_learn::TASK_REGRESSION) ? "r" : "c")) {
+        throw "the posterior samples of " + cmdline.getValue(param_load_model) + " were learned for another task";
+      }
+      if (cmdline.hasParameter(param_relation)) {
+        throw "data with relations can only be predicted while learning";
+      }
+      fml.task = fml.posterior.task;
+      fml.min_target = fml.posterior.min_target;
+      fml.max_target = fml.posterior.max_target;
+      fml.do_sample = true;
+      fml.num_threads = cmdline.getValue(param_threads, 1);
+      if (cmdline.getValue(param_verbosity, 0) > 0) { fml.posterior.debug(); }
+
+      std::cout << "Loading test... \t" << std::endl;
+      Data test(
+        cmdline.getValue(param_cache_size, 0),
+        true, // the rows are predicted by the samples
+        false // no transpose data
+      );
+      test.load(cmdline.getValue(param_test_file));
+      if (cmdline.getValue(param_verbosity, 0) > 0) { test.debug(); }
+      if (fml.posterior.num_attribute < (uint) test.num_feature) {
+        std::cout << "WARNING: the posterior samples have fewer attributes than the data; the other attributes are ignored." << std::endl;
+      }
+
+      if (cmdline.hasParameter(param_out)) {
+        DVector<double> pred;
+        pred.setSize(test.num_cases);
+        fml.predict(test, pred);
+        pred.save(cmdline.getValue(param_out));
+      }
+      return 0;
+    }
+
+    const bool sgd_method =
+      !cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda") ||
+      !cmdline.getValue(param_method).compare("adagrad") || !cmdline.getValue(param_method).compare("adam") ||
+      !cmdline.getValue(param_method).compare("ftrl") || !cmdline.getValue(param_method).compare("bpr");
 
     // (1) Load the data
     std::cout << "Loading train...\t" << std::endl;
     Data train(
       cmdline.getValue(param_cache_size, 0),
       ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-      ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+      ! sgd_method // no transpose data for sgd, sgda, adagrad, adam, ftrl, bpr
     );
     train.load(cmdline.getValue(param_train_file));
     if (cmdline.getValue(param_verbosity, 0) > 0) { train.debug(); }
@@ -152,21 +373,21 @@ int main(int argc, char **argv) {
     Data test(
       cmdline.getValue(param_cache_size, 0),
       ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-      ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+      ! sgd_method // no transpose data for sgd, sgda, adagrad, adam, ftrl, bpr
     );
     test.load(cmdline.getValue(param_test_file));
     if (cmdline.getValue(param_verbosity, 0) > 0) { test.debug(); }
 
     Data* validation = NULL;
     if (cmdline.hasParameter(param_val_file)) {
-      if (cmdline.getValue(param_method).compare("sgda")) {
-        std::cout << "WARNING: Validation data is only used for SGDA. The data is ignored." << std::endl;
+      if (! sgd_method && (cmdline.getValue(param_patience, 0) <= 0)) {
+        std::cout << "WARNING: Validation data is only used for SGD-based methods and for -patience. The data is ignored." << std::endl;
       } else {
         std::cout << "Loading validation set...\t" << std::endl;
         validation = new Data(
           cmdline.getValue(param_cache_size, 0),
-          ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-          ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+          true, // the rows are predicted, also by mcmc and als
+          false // no transpose data
         );
         validation->load(cmdline.getValue(param_val_file));
         if (cmdline.getValue(param_verbosity, 0) > 0) { validation->debug(); }
@@ -186,7 +407,7 @@ int main(int argc, char **argv) {
         relation(i) = new RelationData(
           cmdline.getValue(param_cache_size, 0),
           ! (!cmdline.getValue(param_method).compare("mcmc")), // no original data for mcmc
-          ! (!cmdline.getValue(param_method).compare("sgd") || !cmdline.getValue(param_method).compare("sgda")) // no transpose data for sgd, sgda
+          ! sgd_method // no transpose data for sgd, sgda, adagrad, adam, ftrl, bpr
         );
         relation(i)->load(rel[i]);
         train.relation(i).data = relation(i);
@@ -254,8 +475,19 @@ int main(int argc, char **argv) {
         fm.k1 = dim[1] != 0;
         fm.num_factor = dim[2];
       }
-      fm.init();
-
+      if (! cmdline.getValue(param_method).compare("mcmc")) {
+        fm.layout = FM_LAYOUT_FACTOR_MAJOR;
+      } else if (! cmdline.getValue(param_layout, "attribute").compare("attribute")) {
+        fm.layout = FM_LAYOUT_ATTRIBUTE_MAJOR;
+      } else if (! cmdline.getValue(param_layout).compare("factor")) {
+        fm.layout = FM_LAYOUT_FACTOR_MAJOR;
+      } else {
+        throw "unknown layout " + cmdline.getValue(param_layout);
+      }
+      // a loaded model brings its own parameters, so they are not allocated twice
+      if (! cmdline.hasParameter(param_load_model)) {
+        fm.init();
+      }
     }
 
     // (2.1) load the FM model
@@ -269,9 +501,44 @@ int main(int argc, char **argv) {
 
     // (3) Setup the learning method:
     fm_learn* fml;
-    if (! cmdline.getValue(param_method).compare("sgd")) {
-      fml = new fm_learn_sgd_element();
+    if (! cmdline.getValue(param_method).compare("sgd") || ! cmdline.getValue(param_method).compare("adagrad") ||
+        ! cmdline.getValue(param_method).compare("adam") || ! cmdline.getValue(param_method).compare("ftrl")) {
+      if (! cmdline.getValue(param_method).compare("adagrad")) {
+        fml = new fm_learn_sgd_element_adagrad();
+      } else if (! cmdline.getValue(param_method).compare("adam")) {
+        fml = new fm_learn_sgd_element_adam();
+        if (cmdline.hasParameter(param_adam_beta)) {
+          vector<double> beta = cmdline.getDblValues(param_adam_beta);
+          if (beta.size() != 2) {
+            throw "-adam_beta needs two values 'b1,b2'";
+          }
+          ((fm_learn_sgd_element_adam*)fml)->beta1 = beta[0];
+          ((fm_learn_sgd_element_adam*)fml)->beta2 = beta[1];
+        }
+      } else if (! cmdline.getValue(param_method).compare("ftrl")) {
+        fml = new fm_learn_sgd_element_ftrl();
+        ((fm_learn_sgd_element_ftrl*)fml)->beta = cmdline.getValue(param_ftrl_beta, 1.0);
+        ((fm_learn_sgd_element_ftrl*)fml)->l1 = cmdline.getValue(param_ftrl_l1, 0.0);
+      } else {
+        fml = new fm_learn_sgd_element();
+      }
+      ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
+      if (! cmdline.getValue(param_sgd_parallel, "hogwild").compare("hogwild")) {
+        ((fm_learn_sgd_element*)fml)->parallel = fm_learn_sgd_element::PARALLEL_HOGWILD;
+      } else if (! cmdline.getValue(param_sgd_parallel).compare("partitioned")) {
+        ((fm_learn_sgd_element*)fml)->parallel = fm_learn_sgd_element::PARALLEL_PARTITIONED;
+      } else {
+        throw "unknown parallel SGD " + cmdline.getValue(param_sgd_parallel);
+      }
+      ((fm_learn_sgd_element*)fml)->batch_size = std::max(1, cmdline.getValue(param_batch_size, 1));
+      fml->validation = validation;
+
+    } else if (! cmdline.getValue(param_method).compare("bpr")) {
+      fml = new fm_learn_sgd_bpr();
       ((fm_learn_sgd*)fml)->num_iter = cmdline.getValue(param_num_iter, 100);
+      ((fm_learn_sgd_bpr*)fml)->item_group = cmdline.getValue(param_bpr_item_group, -1);
+      ((fm_learn_sgd_bpr*)fml)->neg_exponent = cmdline.getValue(param_bpr_neg_exponent, 1.0);
+      fml->validation = validation;
 
     } else if (! cmdline.getValue(param_method).compare("sgda")) {
       assert(validation != NULL);
@@ -288,10 +555,22 @@ int main(int argc, char **argv) {
 
       ((fm_learn_mcmc*)fml)->do_sample = cmdline.getValue(param_do_sampling, true);
       ((fm_learn_mcmc*)fml)->do_multilevel = cmdline.getValue(param_do_multilevel, true);
+      ((fm_learn_mcmc*)fml)->num_chains = std::max(1, cmdline.getValue(param_chains, 1));
+      ((fm_learn_mcmc*)fml)->posterior_every = std::max(0, cmdline.getValue(param_posterior_every, 0));
+      if (cmdline.hasParameter(param_checkpoint)) {
+        ((fm_learn_mcmc*)fml)->checkpoint_file = cmdline.getValue(param_checkpoint);
+        ((fm_learn_mcmc*)fml)->checkpoint_every = std::max(1, cmdline.getValue(param_checkpoint_every, 1));
+        ((fm_learn_mcmc*)fml)->resume = cmdline.getValue(param_resume, 0) != 0;
+      }
     } else {
       throw "unknown method";
     }
     fml->fm = &fm;
+    fml->num_threads = cmdline.getValue(param_threads, 1);
+    fml->max_time = cmdline.getValue(param_max_time, 0.0);
+    fml->patience = cmdline.getValue(param_patience, 0);
+    fml->min_delta = cmdline.getValue(param_min_delta, 0.0);
+    fml->min_param_change = cmdline.getValue(param_min_param_change, 0.0);
     fml->max_target = train.max_target;
     fml->min_target = train.min_target;
     fml->meta = &meta;
@@ -400,6 +679,17 @@ int main(int argc, char **argv) {
             fmlsgd->learn_rates(2) = lr[2];
           }
         }
+        fmlsgd->shuffle = cmdline.getValue(param_shuffle, 0) != 0;
+        fmlsgd->shuffle_buffer = std::max(0, cmdline.getValue(param_shuffle_buffer, 1));
+        fmlsgd->eval_every = std::max(1, cmdline.getValue(param_eval_every, 1));
+        fmlsgd->eval_sample = std::max(0, cmdline.getValue(param_eval_sample, 0));
+        if (! cmdline.getValue(param_eval_train, "full").compare("full")) {
+          fmlsgd->progressive_train = false;
+        } else if (! cmdline.getValue(param_eval_train).compare("progressive")) {
+          fmlsgd->progressive_train = true;
+        } else {
+          throw "unknown training evaluation " + cmdline.getValue(param_eval_train);
+        }
       }
     }
     if (rlog != NULL) {
@@ -423,14 +713,44 @@ int main(int argc, char **argv) {
     if (cmdline.hasParameter(param_out)) {
       DVector<double> pred;
       pred.setSize(test.num_cases);
-      fml->predict(test, pred);
+      if (! cmdline.getValue(param_method).compare("mcmc")) {
+        // mcmc and als predict the test data with the sums of learning
+        ((fm_learn_mcmc*)fml)->predictTest(pred);
+      } else {
+        fml->predict(test, pred);
+      }
       pred.save(cmdline.getValue(param_out));
     }
 
     // () save the FM model
-    if (cmdline.hasParameter(param_save_model)) {
+    if (cmdline.hasParameter(param_save_model) && mcmc_sampling) {
+      std::cout << "Writing posterior samples to "<< cmdline.getValue(param_save_model) << std::endl;
+      ((fm_learn_mcmc*)fml)->posterior.save(cmdline.getValue(param_save_model));
+    } else if (cmdline.hasParameter(param_save_model)) {
       std::cout << "Writing FM model to "<< cmdline.getValue(param_save_model) << std::endl;
-      fm.saveModel(cmdline.getValue(param_save_model));
+      if (! cmdline.getValue(param_model_format, "text").compare("text")) {
+        fm.saveModel(cmdline.getValue(param_save_model), FM_MODEL_FORMAT_TEXT);
+      } else if (! cmdline.getValue(param_model_format).compare("binary")) {
+        fm.saveModel(cmdline.getValue(param_save_model), FM_MODEL_FORMAT_BINARY);
+      } else {
+        throw "unknown model format " + cmdline.getValue(param_model_format);
+      }
+    }
+
+    // () export a quantized copy of the FM model
+    if (cmdline.hasParameter(param_export_quantized)) {
+      fm_quantized_model fm_q;
+      if (! cmdline.getValue(param_quantize, "int8").compare("int8")) {
+        fm_q.quantize(fm, FM_QUANTIZE_INT8);
+      } else if (! cmdline.getValue(param_quantize).compare("fp16")) {
+        fm_q.quantize(fm, FM_QUANTIZE_FP16);
+      } else {
+        throw "unknown quantization " + cmdline.getValue(param_quantize);
+      }
+      if (cmdline.getValue(param_verbosity, 0) > 0) { fm_q.debug(); }
+      std::cout << "Writing quantized FM model to "<< cmdline.getValue(param_export_quantized) << std::endl;
+      fm_q.save(cmdline.getValue(param_export_quantized));
+      report_quantization_error(fml, fm_q, test);
     }
 
   } catch (std::string &e) {
@@ -9,11 +9,15 @@
 #include "../util/util.h"
 #include "../util/cmdline.h"
 #include "../fm_core/fm_model.h"
+#include "../fm_core/fm_scorer.h"
 #include "src/Data.h"
 #include "src/fm_learn.h"
 #include "src/fm_learn_sgd.h"
 #include "src/fm_learn_sgd_element.h"
 #include "src/fm_learn_sgd_element_adapt_reg.h"
+#include "src/fm_learn_sgd_element_adagrad.h"
+#include "src/fm_learn_sgd_element_adam.h"
+#include "src/fm_learn_sgd_element_ftrl.h"
 #include "src/fm_learn_mcmc_simultaneous.h"
 #include "pyfm.h"
 
@@ -27,7 +31,9 @@ PyFM::PyFM(const std::string& method,
            const int num_eval_cases,
            const std::string& r_log_str,
            const int verbosity,
-           const int seed) :
+           const int seed,
+           const int num_threads,
+           const int posterior_every) :
            method{method},
            reg{reg},
            num_eval_cases{num_eval_cases},
@@ -46,6 +52,12 @@ PyFM::PyFM(const std::string& method,
   this->fm.k0 = dim[0] != 0;
   this->fm.k1 = dim[1] != 0;
   this->fm.num_factor = dim[2];
+  // SGD and SGDA read all factors of an attribute at once, ALS and MCMC sweep over one factor at a time.
+  if (method == "sgd" || method == "sgda" || method == "adagrad" || method == "adam" || method == "ftrl") {
+    this->fm.layout = FM_LAYOUT_ATTRIBUTE_MAJOR;
+  } else {
+    this->fm.layout = FM_LAYOUT_FACTOR_MAJOR;
+  }
 
   // Setup the learning method.
   if (method == "sgd") {
@@ -54,6 +66,15 @@ PyFM::PyFM(const std::string& method,
   } else if (method == "sgda") {
     this->fml = std::make_unique<fm_learn_sgd_element_adapt_reg>();
     ((fm_learn_sgd*)this->fml.get())->num_iter = num_iter;
+  } else if (method == "adagrad") {
+    this->fml = std::make_unique<fm_learn_sgd_element_adagrad>();
+    ((fm_learn_sgd*)this->fml.get())->num_iter = num_iter;
+  } else if (method == "adam") {
+    this->fml = std::make_unique<fm_learn_sgd_element_adam>();
+    ((fm_learn_sgd*)this->fml.get())->num_iter = num_iter;
+  } else if (method == "ftrl") {
+    this->fml = std::make_unique<fm_learn_sgd_element_ftrl>();
+    ((fm_learn_sgd*)this->fml.get())->num_iter = num_iter;
   } else if (method == "mcmc" || method == "als") {
     bool is_mcmc = method == "mcmc";
     this->fml = std::make_unique<fm_learn_mcmc_simultaneous>();
@@ -61,11 +82,13 @@ PyFM::PyFM(const std::string& method,
     ((fm_learn_mcmc*)this->fml.get())->num_iter = num_iter;
     ((fm_learn_mcmc*)this->fml.get())->do_sample = is_mcmc;
     ((fm_learn_mcmc*)this->fml.get())->do_multilevel = is_mcmc;
+    ((fm_learn_mcmc*)this->fml.get())->posterior_every = std::max(0, posterior_every);
   } else {
     throw "Unknown method.";
   }
 
   this->fml->fm = &(this->fm);
+  this->fml->num_threads = num_threads;
   // Assume we only do regression.
   this->fml->meta = &(this->meta);
   this->fml->task = 0;
@@ -199,6 +222,7 @@ void PyFM::train(std::shared_ptr<Data> train,
   }
 
   // learn
+  this->learned_test = test;
   this->fml->learn(*train, *test);
 
   //  Prediction at the end  (not for mcmc and als)
@@ -211,7 +235,12 @@ void PyFM::train(std::shared_ptr<Data> train,
 Eigen::VectorXd PyFM::predict(std::shared_ptr<Data> test) {
   DVector<double> pred;
   pred.setSize(test->num_cases);
-  fml->predict(*test, pred);
+  fm_learn_mcmc* fml_mcmc = dynamic_cast<fm_learn_mcmc*>(fml.get());
+  if ((fml_mcmc != nullptr) && (test == learned_test)) {
+    fml_mcmc->predictTest(pred);
+  } else {
+    fml->predict(*test, pred);
+  }
   Eigen::VectorXd pred_vector(pred.dim);
   for (uint i = 0; i < pred.dim; ++i) {
     pred_vector[i] = pred(i);
@@ -220,6 +249,51 @@ Eigen::VectorXd PyFM::predict(std::shared_ptr<Data> test) {
   return pred_vector;
 }
 
+std::tuple<Eigen::VectorXi, Eigen::VectorXd> PyFM::top_k(const Eigen::SparseMatrix<double, Eigen::RowMajor>& context,
+                                                         std::shared_ptr<Data> candidates,
+                                                         const int k) {
+  if (context.rows() < 1) {
+    throw "Context needs to have one row.";
+  }
+  LargeSparseMatrixMemory<DATA_FLOAT>* data = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(candidates->data);
+  if (data == nullptr) {
+    throw "Candidates need to be in memory.";
+  }
+
+  // Copy the context row.
+  std::vector<sparse_entry<FM_FLOAT>> context_entries;
+  for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(context, 0); it; ++it) {
+    if (it.col() >= (int)this->fm.num_attribute) {
+      throw "Context has more features than the model.";
+    }
+    sparse_entry<FM_FLOAT> e;
+    e.id = it.col();
+    e.value = it.value();
+    context_entries.push_back(e);
+  }
+  sparse_row<FM_FLOAT> context_row;
+  context_row.data = context_entries.data();
+  context_row.size = context_entries.size();
+
+  if (candidates->num_feature > (int)this->fm.num_attribute) {
+    throw "Candidates have more features than the model.";
+  }
+
+  fm_candidate_scorer scorer(&(this->fm));
+  scorer.setContext(context_row);
+  this->thread_pool.setNumThreads(this->fml->num_threads);
+  std::vector<fm_scored_candidate> best;
+  scorer.topK(data->data.value, data->data.dim, std::max(0, k), this->thread_pool, best);
+
+  Eigen::VectorXi index(best.size());
+  Eigen::VectorXd score(best.size());
+  for (uint i = 0; i < best.size(); ++i) {
+    index[i] = best[i].index;
+    score[i] = best[i].score;
+  }
+  return std::make_tuple(index, score);
+}
+
 std::tuple<double, Eigen::VectorXd, Eigen::MatrixXd> PyFM::parameters() {
   std::tuple<double, Eigen::VectorXd, Eigen::MatrixXd> ret;
 
@@ -241,9 +315,19 @@ std::tuple<double, Eigen::VectorXd, Eigen::MatrixXd> PyFM::parameters() {
 
   // Copy the pairwise interactions.
   Eigen::MatrixXd pairwise(this->fm.num_attribute, this->fm.num_factor);
-  for (uint i = 0; i < this->fm.num_attribute; ++i) {
+  if (this->fm.v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    for (uint i = 0; i < this->fm.num_attribute; ++i) {
+      const FM_PARAM_FLOAT* v_i = this->fm.v.attribute(i);
+      for (int f = 0; f < this->fm.num_factor; ++f) {
+        pairwise(i, f) = v_i[f];
+      }
+    }
+  } else {
     for (int f = 0; f < this->fm.num_factor; ++f) {
-      pairwise(i, f) = this->fm.v(f, i);
+      const FM_PARAM_FLOAT* v_f = this->fm.v.factor(f);
+      for (uint i = 0; i < this->fm.num_attribute; ++i) {
+        pairwise(i, f) = v_f[i];
+      }
     }
   }
 
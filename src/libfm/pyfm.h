@@ -20,7 +20,9 @@ class PyFM {
        const int num_eval_cases=-1,
        const std::string& r_log_str="",
        const int verbosity=0,
-       const int seed=0);
+       const int seed=0,
+       const int num_threads=1,
+       const int posterior_every=0);
 
   void train(std::shared_ptr<Data> train,
              std::shared_ptr<Data> test=nullptr,
@@ -28,6 +30,12 @@ class PyFM {
 
   Eigen::VectorXd predict(std::shared_ptr<Data> test);
 
+  // the k best rows of candidates for the context (first row of context);
+  // returns the row indices and the raw model scores, best first
+  std::tuple<Eigen::VectorXi, Eigen::VectorXd> top_k(const Eigen::SparseMatrix<double, Eigen::RowMajor>& context,
+                                                     std::shared_ptr<Data> candidates,
+                                                     const int k);
+
   std::tuple<double, Eigen::VectorXd, Eigen::MatrixXd> parameters();
 
  private:
@@ -40,6 +48,10 @@ class PyFM {
   std::unique_ptr<RLog> rlog;
   fm_model fm;
   std::unique_ptr<fm_learn> fml;
+  // the test data of train(), which MCMC and ALS predict with the sums of
+  // learning (predictTest); it is held so that it stays the same object
+  std::shared_ptr<Data> learned_test;
+  ThreadPool thread_pool;
 };
 
 
@@ -54,6 +66,8 @@ PYBIND11_MODULE(pyfm, m) {
                   const int,
                   const std::string&,
                   const int,
+                  const int,
+                  const int,
                   const int>(),
          py::arg("method"),
          py::arg("dim"),
@@ -64,7 +78,9 @@ PYBIND11_MODULE(pyfm, m) {
          py::arg("num_eval_cases") = -1,
          py::arg("r_log_str") = "",
          py::arg("verbosity") = 0,
-         py::arg("seed") = 0)
+         py::arg("seed") = 0,
+         py::arg("num_threads") = 1,
+         py::arg("posterior_every") = 0)
     .def("train",
          &PyFM::train,
          py::arg("train"),
@@ -73,6 +89,11 @@ PYBIND11_MODULE(pyfm, m) {
     .def("predict",
          &PyFM::predict,
          py::arg("test") = nullptr)
+    .def("top_k",
+         &PyFM::top_k,
+         py::arg("context"),
+         py::arg("candidates"),
+         py::arg("k"))
     .def("parameters",
          &PyFM::parameters);
 
@@ -64,6 +64,9 @@ class Data {
                 const Eigen::VectorXd& target);
   void load(std::string filename);
   void debug();
+  // parses a line in libFM format into its target and its entries; returns
+  // false for empty lines and comments
+  static bool parseLine(const std::string& line, DATA_FLOAT& target, std::vector< sparse_entry<DATA_FLOAT> >& entries);
 
   LargeSparseMatrix<DATA_FLOAT>* data_t = nullptr;
   LargeSparseMatrix<DATA_FLOAT>* data = nullptr;
@@ -210,6 +213,32 @@ void Data::add_rows(const Eigen::SparseMatrix<double, Eigen::RowMajor>& data,
   }
 }
 
+bool Data::parseLine(const std::string& line, DATA_FLOAT& target, std::vector< sparse_entry<DATA_FLOAT> >& entries) {
+  entries.clear();
+  const char *pline = line.c_str();
+  while ((*pline == ' ')  || (*pline == 9)) { pline++; } // skip leading spaces
+  if ((*pline == 0)  || (*pline == '#')) { return false; }  // skip empty rows
+  DATA_FLOAT _value;
+  int nchar, _feature;
+  if (sscanf(pline, "%f%n", &_value, &nchar) < 1) {
+    throw "cannot parse line \"" + line + "\" at character " + pline[0];
+  }
+  pline += nchar;
+  target = _value;
+  while (sscanf(pline, "%d:%f%n", &_feature, &_value, &nchar) >= 2) {
+    pline += nchar;
+    sparse_entry<DATA_FLOAT> e;
+    e.id = _feature;
+    e.value = _value;
+    entries.push_back(e);
+  }
+  while ((*pline != 0) && ((*pline == ' ')  || (*pline == 9))) { pline++; } // skip trailing spaces
+  if ((*pline != 0)  && (*pline != '#')) {
+    throw "cannot parse line \"" + line + "\" at character " + pline[0];
+  }
+  return true;
+}
+
 void Data::load(std::string filename) {
 
   std::cout << "has x = " << has_x << std::endl;
@@ -25,9 +25,15 @@
 #include <cmath>
 #include "Data.h"
 #include "../../fm_core/fm_model.h"
+#include "../../util/parallel.h"
 #include "../../util/rlog.h"
 #include "../../util/util.h"
 
+// number of rows of a non-memory dataset that are buffered for one parallel batch
+const uint FM_PREDICT_BATCH_ROWS = 65536;
+// number of rows that are handed to a thread at once (prediction and learning)
+const uint FM_PREDICT_GRAIN_ROWS = 1024;
+
 class fm_learn {
  public:
   fm_learn();
@@ -36,6 +42,9 @@ class fm_learn {
   virtual double evaluate(Data& data);
   virtual void learn(Data& train, Data& test);
   virtual void predict(Data& data, DVector<double>& out) = 0;
+  // raw model predictions (no clipping or link function) for all rows of data,
+  // computed with num_threads threads; the result does not depend on num_threads
+  void predict_batch(Data& data, DVector<double>& out, int num_threads);
   virtual void debug();
 
   DataMetaInfo* meta;
@@ -50,14 +59,73 @@ class fm_learn {
   Data* validation;
   RLog* log;
 
+  int num_threads; // 0 = one per hardware thread
+
+  // Criteria to end learning before num_iter iterations (0 = off):
+  // - max_time:         wall-clock seconds for learning; learning stops if
+  //                     the next iteration would exceed the budget
+  // - patience:         number of iterations without an improvement of the
+  //                     validation loss by more than min_delta
+  // - min_param_change: relative change |theta - theta_prev| / |theta_prev|
+  //                     of all parameters in one iteration
+  // With patience the parameters of the best iteration are kept and
+  // restored at the end of learning.
+  double max_time;
+  int patience;
+  double min_delta;
+  double min_param_change;
+
  protected:
+  // loss on data for the stop criteria, lower is better: the rmse for
+  // regression, 1-accuracy for classification
+  virtual double validationLoss(Data& data);
+  // to be called before the first iteration
+  void initStopCriteria();
+  // to be called after iteration iter with the validation loss (NaN if there
+  // is none); returns true if learning should stop
+  bool stopAfterIteration(int iter, double validation_loss);
+  // sets the parameters of the best iteration if they were kept
+  void restoreBestParameters();
+  bool isBestIteration(int iter) { return best_iter == iter; }
+
+  bool keep_best; // copy the parameters of the best iteration (patience > 0)
+  double stop_start_time, stop_last_time;
+  double best_loss;
+  int best_iter;
+  double best_w0, prev_w0;
+  DVector<FM_PARAM_FLOAT> best_w, prev_w;
+  fm_factor_matrix<FM_PARAM_FLOAT> best_v, prev_v;
+
   // these functions can be overwritten (e.g. for MCMC)
   virtual double evaluate_classification(Data& data);
   virtual double evaluate_regression(Data& data);
   virtual double predict_case(Data& data);
 
+  // calls fn(rows, num_rows, first_row, thread) in parallel for consecutive
+  // ranges of at most FM_PREDICT_GRAIN_ROWS rows that cover all rows of data;
+  // rows[r] is the row with index first_row + r. The ranges are handed out
+  // in order, so with one thread the rows are visited in their order.
+  void parallel_for_rows(Data& data, const std::function<void(sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row, int thread)>& fn);
+  // calls fn(rows, num_rows, first_row) one after another for consecutive
+  // blocks of rows that cover all rows of data; data in memory is one block
+  void for_each_row_block(Data& data, const std::function<void(sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row)>& fn);
+
+  // partial sums of the evaluation measures
+  struct eval_sums {
+    double sum_sqr = 0;
+    double sum_abs = 0;
+    uint64 num_correct = 0;
+  };
+  // predicts all rows of data in parallel and sums up the errors
+  eval_sums evaluate_parallel(Data& data);
+  void evaluate_rows(Data& data, DVector<double>& pred, uint64 row_begin, uint64 row_end, eval_sums& sums);
+  // adds the error of the raw prediction p of a row with the given target
+  void evaluate_prediction(double p, DATA_FLOAT target, eval_sums& sums);
+
   DVector<double> sum, sum_sqr;
   DMatrix<double> pred_q_term;
+
+  ThreadPool thread_pool;
 };
 
 // Implementation
@@ -69,6 +137,14 @@ fm_learn::fm_learn() {
   log = NULL;
   task = 0;
   meta = NULL;
+  validation = NULL;
+  num_threads = 1;
+  max_time = 0;
+  patience = 0;
+  min_delta = 0;
+  min_param_change = 0;
+  keep_best = true;
+  best_iter = -1;
 }
 
 void fm_learn::init() {
@@ -105,52 +181,212 @@ double fm_learn::evaluate(Data& data) {
 void fm_learn::learn(Data& train, Data& test) {
 }
 
+double fm_learn::validationLoss(Data& data) {
+  if (task == TASK_CLASSIFICATION) {
+    return 1.0 - evaluate(data);
+  }
+  return evaluate(data);
+}
+
+void fm_learn::initStopCriteria() {
+  stop_start_time = getwalltime();
+  stop_last_time = stop_start_time;
+  best_loss = std::numeric_limits<double>::infinity();
+  best_iter = -1;
+  if (min_param_change > 0) {
+    prev_w0 = fm->w0;
+    prev_w.assign(fm->w);
+    prev_v = fm->v;
+  }
+}
+
+bool fm_learn::stopAfterIteration(int iter, double validation_loss) {
+  bool stop = false;
+  // iterations without a validation measure (see -eval_every) are not
+  // compared, but count for the patience
+  if ((patience > 0) && (! std::isnan(validation_loss))) {
+    if (validation_loss < best_loss - min_delta) {
+      best_loss = validation_loss;
+      best_iter = iter;
+      if (keep_best) {
+        best_w0 = fm->w0;
+        best_w.assign(fm->w);
+        best_v = fm->v;
+      }
+    } else if (iter - best_iter >= patience) {
+      std::cout << "Stop: no improvement of the validation loss in " << patience << " iterations; best iteration " << best_iter << " with " << best_loss << std::endl;
+      stop = true;
+    }
+  }
+  if (min_param_change > 0) {
+    double diff = (fm->w0 - prev_w0) * (fm->w0 - prev_w0);
+    double norm = prev_w0 * prev_w0;
+    for (uint i = 0; i < fm->w.dim; i++) {
+      double d = fm->w(i) - prev_w(i);
+      diff += d * d;
+      norm += (double) prev_w(i) * prev_w(i);
+    }
+    for (uint64 j = 0; j < fm->v.size(); j++) {
+      double d = fm->v.value[j] - prev_v.value[j];
+      diff += d * d;
+      norm += (double) prev_v.value[j] * prev_v.value[j];
+    }
+    double change = std::sqrt(diff / std::max(norm, std::numeric_limits<double>::min()));
+    if (change < min_param_change) {
+      std::cout << "Stop: relative parameter change " << change << " is below " << min_param_change << std::endl;
+      stop = true;
+    }
+    prev_w0 = fm->w0;
+    prev_w.assign(fm->w);
+    prev_v = fm->v;
+  }
+  if (max_time > 0) {
+    // the next iteration is expected to take as long as the last one
+    double now = getwalltime();
+    if ((now - stop_start_time) + (now - stop_last_time) > max_time) {
+      std::cout << "Stop: the next iteration would exceed the time budget of " << max_time << " seconds" << std::endl;
+      stop = true;
+    }
+    stop_last_time = now;
+  }
+  return stop;
+}
+
+void fm_learn::restoreBestParameters() {
+  if ((patience > 0) && keep_best && (best_iter >= 0)) {
+    std::cout << "Using the parameters of iteration " << best_iter << " with validation loss " << best_loss << std::endl;
+    fm->w0 = best_w0;
+    fm->w.assign(best_w);
+    fm->v = best_v;
+  }
+}
+
+void fm_learn::for_each_row_block(Data& data, const std::function<void(sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row)>& fn) {
+  LargeSparseMatrixMemory<DATA_FLOAT>* data_memory = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(data.data);
+  if (data_memory != NULL) {
+    // all rows are in memory and can be used directly
+    fn(data_memory->data.value, data_memory->data.dim, 0);
+    return;
+  }
+
+  // other matrices can only be iterated sequentially and their rows are only
+  // valid until the iterator moves on, so blocks of rows are copied first
+  std::vector< sparse_row<DATA_FLOAT> > rows;
+  std::vector<uint64> row_offset;
+  std::vector< sparse_entry<DATA_FLOAT> > entries;
+  uint first_row = 0;
+  data.data->begin();
+  while (! data.data->end()) {
+    rows.clear();
+    row_offset.clear();
+    entries.clear();
+    first_row = data.data->getRowIndex();
+    for (; (! data.data->end()) && (rows.size() < FM_PREDICT_BATCH_ROWS); data.data->next()) {
+      sparse_row<DATA_FLOAT>& x = data.data->getRow();
+      row_offset.push_back(entries.size());
+      entries.insert(entries.end(), x.data, x.data + x.size);
+      rows.push_back(x);
+    }
+    for (uint r = 0; r < rows.size(); r++) {
+      rows[r].data = entries.data() + row_offset[r];
+    }
+    fn(rows.data(), rows.size(), first_row);
+  }
+}
+
+void fm_learn::parallel_for_rows(Data& data, const std::function<void(sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row, int thread)>& fn) {
+  for_each_row_block(data, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row) {
+    thread_pool.parallel_for(0, num_rows, FM_PREDICT_GRAIN_ROWS, [&](uint64 row_begin, uint64 row_end, int thread) {
+      fn(rows + row_begin, row_end - row_begin, first_row + row_begin, thread);
+    });
+  });
+}
+
+void fm_learn::predict_batch(Data& data, DVector<double>& out, int num_threads) {
+  assert(data.data->getNumRows() == out.dim);
+  thread_pool.setNumThreads(num_threads);
+  const fm_model* model = fm;
+  parallel_for_rows(data, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row, int thread) {
+    for (uint r = 0; r < num_rows; r++) {
+      out(first_row + r) = model->predict(rows[r]);
+    }
+  });
+}
+
 void fm_learn::debug() {
   std::cout << "task=" << task << std::endl;
   std::cout << "min_target=" << min_target << std::endl;
   std::cout << "max_target=" << max_target << std::endl;
+  std::cout << "num_threads=" << num_threads << std::endl;
+  std::cout << "max_time=" << max_time << std::endl;
+  std::cout << "patience=" << patience << std::endl;
+  std::cout << "min_delta=" << min_delta << std::endl;
+  std::cout << "min_param_change=" << min_param_change << std::endl;
 }
 
-double fm_learn::evaluate_classification(Data& data) {
-  int num_correct = 0;
-  double eval_time = getusertime();
-  for (data.data->begin(); !data.data->end(); data.data->next()) {
-    double p = predict_case(data);
-    if (((p >= 0) && (data.target(data.data->getRowIndex()) >= 0)) || ((p < 0) && (data.target(data.data->getRowIndex()) < 0))) {
-      num_correct++;
-    }
+void fm_learn::evaluate_prediction(double p, DATA_FLOAT target, eval_sums& sums) {
+  if (task == TASK_REGRESSION) {
+    p = std::min(max_target, p);
+    p = std::max(min_target, p);
+    double err = p - target;
+    sums.sum_sqr += err*err;
+    sums.sum_abs += std::abs((double)err);
+  } else if (((p >= 0) && (target >= 0)) || ((p < 0) && (target < 0))) {
+    sums.num_correct++;
+  }
+}
+
+void fm_learn::evaluate_rows(Data& data, DVector<double>& pred, uint64 row_begin, uint64 row_end, eval_sums& sums) {
+  for (uint64 r = row_begin; r < row_end; r++) {
+    evaluate_prediction(pred(r), data.target(r), sums);
+  }
+}
+
+fm_learn::eval_sums fm_learn::evaluate_parallel(Data& data) {
+  DVector<double> pred;
+  pred.setSize(data.data->getNumRows());
+  predict_batch(data, pred, num_threads);
+  // the blocks are fixed and summed up in order, so the result does not
+  // depend on the number of threads
+  uint num_blocks = (pred.dim + FM_PREDICT_GRAIN_ROWS - 1) / FM_PREDICT_GRAIN_ROWS;
+  std::vector<eval_sums> block_sums(num_blocks);
+  thread_pool.parallel_for(0, pred.dim, FM_PREDICT_GRAIN_ROWS, [&](uint64 row_begin, uint64 row_end, int thread) {
+    evaluate_rows(data, pred, row_begin, row_end, block_sums[row_begin / FM_PREDICT_GRAIN_ROWS]);
+  });
+  eval_sums sums;
+  for (uint b = 0; b < num_blocks; b++) {
+    sums.sum_sqr += block_sums[b].sum_sqr;
+    sums.sum_abs += block_sums[b].sum_abs;
+    sums.num_correct += block_sums[b].num_correct;
   }
-  eval_time = (getusertime() - eval_time);
+  return sums;
+}
+
+double fm_learn::evaluate_classification(Data& data) {
+  double eval_time = getwalltime();
+  eval_sums sums = evaluate_parallel(data);
+  eval_time = (getwalltime() - eval_time);
   // log the values
   if (log != NULL) {
-    log->log("accuracy", (double) num_correct / (double) data.data->getNumRows());
+    log->log("accuracy", (double) sums.num_correct / (double) data.data->getNumRows());
     log->log("time_pred", eval_time);
   }
 
-  return (double) num_correct / (double) data.data->getNumRows();
+  return (double) sums.num_correct / (double) data.data->getNumRows();
 }
 
 double fm_learn::evaluate_regression(Data& data) {
-  double rmse_sum_sqr = 0;
-  double mae_sum_abs = 0;
-  double eval_time = getusertime();
-  for (data.data->begin(); !data.data->end(); data.data->next()) {
-    double p = predict_case(data);
-    p = std::min(max_target, p);
-    p = std::max(min_target, p);
-    double err = p - data.target(data.data->getRowIndex());
-    rmse_sum_sqr += err*err;
-    mae_sum_abs += std::abs((double)err);
-  }
-  eval_time = (getusertime() - eval_time);
+  double eval_time = getwalltime();
+  eval_sums sums = evaluate_parallel(data);
+  eval_time = (getwalltime() - eval_time);
   // log the values
   if (log != NULL) {
-    log->log("rmse", std::sqrt(rmse_sum_sqr/data.data->getNumRows()));
-    log->log("mae", mae_sum_abs/data.data->getNumRows());
+    log->log("rmse", std::sqrt(sums.sum_sqr/data.data->getNumRows()));
+    log->log("mae", sums.sum_abs/data.data->getNumRows());
     log->log("time_pred", eval_time);
   }
 
-  return std::sqrt(rmse_sum_sqr/data.data->getNumRows());
+  return std::sqrt(sums.sum_sqr/data.data->getNumRows());
 }
 
 #endif /*FM_LEARN_H_*/
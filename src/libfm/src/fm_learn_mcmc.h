@@ -41,7 +41,38 @@
 #ifndef FM_LEARN_MCMC_H_
 #define FM_LEARN_MCMC_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
 #include <sstream>
+#include "../../fm_core/fm_posterior.h"
+
+// number of attributes of one color that are handed to a thread at once
+const uint FM_MCMC_GRAIN_ATTRIBUTES = 16;
+
+// first value of a checkpoint file of the sampler
+const uint FM_MCMC_CHECKPOINT_ID = 0x464d4332; // "FMC2"
+
+struct fm_mcmc_checkpoint_header {
+  uint id;
+  uint param_size; // sizeof(FM_PARAM_FLOAT)
+  uint num_complete_iter;
+  uint num_attribute;
+  uint num_factor;
+  uint num_attr_groups;
+  uint num_train_cases;
+  uint num_test_cases;
+  uint num_validation_cases; // 0 without -patience
+  // the stop criteria: their options must be the same after resuming; the
+  // best iteration and its parameters follow the prediction sums
+  uint stopped; // learning was stopped early after this checkpoint
+  uint keep_best;
+  int patience;
+  double min_delta;
+  double elapsed_time; // seconds of learning before the checkpoint (-max_time)
+};
 
 struct e_q_term {
   double e;
@@ -70,11 +101,35 @@ class fm_learn_mcmc : public fm_learn {
 
   virtual void debug();
 
+  // predicts data with the posterior samples (MCMC) or with the model (ALS)
   virtual void predict(Data& data, DVector<double>& out);
+  // the predictions of the test data of the last learn(): MCMC averages the
+  // predictions of all iterations, ALS uses those of the last iteration
+  void predictTest(DVector<double>& out);
 
   uint num_iter;
   uint num_eval_cases;
 
+  // number of independent chains (MCMC only): the chains run on up to
+  // num_threads threads, each with its own model, caches and random stream,
+  // and their samples are merged into one posterior mean
+  uint num_chains = 1;
+
+  // Checkpoints (checkpoint_file not empty): after every checkpoint_every
+  // iterations and after the last one, the state of the sampler is written
+  // to checkpoint_file. With resume, learning continues after the
+  // iterations of checkpoint_file if it exists. Several chains write one
+  // file each (checkpoint_file.chain<c>).
+  std::string checkpoint_file;
+  uint checkpoint_every = 1;
+  bool resume = false;
+
+  // MCMC keeps every posterior_every-th sample after the first 5 iterations
+  // in posterior (0 = none). The samples predict data other than the test
+  // data of learn() (see predict); ALS predicts such data with its model.
+  uint posterior_every = 0;
+  fm_posterior posterior;
+
   // Hyperpriors
   double alpha_0, gamma_0, beta_0, mu_0;
   double w0_mean_0;
@@ -89,34 +144,92 @@ class fm_learn_mcmc : public fm_learn {
   // use the two-level (hierarchical) model (TRUE) or the one-level (FALSE)
   bool do_multilevel;
 
-  uint nan_cntr_v, nan_cntr_w, nan_cntr_w0, nan_cntr_alpha, nan_cntr_w_mu, nan_cntr_w_lambda, nan_cntr_v_mu, nan_cntr_v_lambda;
-  uint inf_cntr_v, inf_cntr_w, inf_cntr_w0, inf_cntr_alpha, inf_cntr_w_mu, inf_cntr_w_lambda, inf_cntr_v_mu, inf_cntr_v_lambda;
+  // the counters of w and v are incremented by parallel draws
+  std::atomic<uint> nan_cntr_v, nan_cntr_w;
+  uint nan_cntr_w0, nan_cntr_alpha, nan_cntr_w_mu, nan_cntr_w_lambda, nan_cntr_v_mu, nan_cntr_v_lambda;
+  std::atomic<uint> inf_cntr_v, inf_cntr_w;
+  uint inf_cntr_w0, inf_cntr_alpha, inf_cntr_w_mu, inf_cntr_w_lambda, inf_cntr_v_mu, inf_cntr_v_lambda;
 
  protected:
   virtual double predict_case(Data& data);
   virtual void _learn(Data& train, Data& test);
 
+  // learns one chain on train and test
+  void learnChain(Data& train, Data& test);
+  // learns num_chains chains in parallel, merges their predictions and
+  // reports the R-hat of the test predictions
+  void learnChains(Data& train, Data& test);
+  // a new, uninitialized sampler of the same kind for another chain
+  virtual fm_learn_mcmc* createChain();
+  // only the first chain prints its iterations
+  bool print_progress = true;
+
+  // The checkpoint has the model, the priors, the prediction sums, the
+  // e-terms of the training cases, the state of the stop criteria and the
+  // state of the random stream (with checkpoints the sampler draws from a
+  // stream instead of rand()). The posterior samples are in a file of their
+  // own (checkpoint_file.posterior), to which every checkpoint appends only
+  // the new samples; the checkpoint has their number.
+  // stopped: a stop criterion ended learning after this checkpoint
+  void saveCheckpoint(uint num_complete_iter, Data& train, Data& test, bool stopped);
+  // returns the number of complete iterations of the checkpoint, the
+  // e-terms of the training cases are returned in cache_e; stopped is true
+  // if the checkpoint was written when a stop criterion ended learning
+  uint loadCheckpoint(Data& train, Data& test, std::vector<double>& cache_e, bool& stopped);
+  // the number of samples in checkpoint_file.posterior; with 0 the next
+  // checkpoint rewrites the file (after resuming, the file may have samples
+  // after those of the checkpoint)
+  uint checkpoint_posterior_samples = 0;
+
   // Predict all datasets mentioned in main_data and store the prediction in the
   // e-term.
   void predict_data_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_term*>& main_cache);
+  // One pass over the transpose data data_t (attribute ids shifted by
+  // attr_offset) that computes for every case c all factors together:
+  // q[c*k+f] = sum_i v_if x_ci and
+  // lin[c] = sum_i w_i x_ci - 1/2 sum_f sum_i v_if^2 x_ci^2.
+  // With more than one thread and data_t in memory, each thread fills
+  // its own range of cases.
+  void predict_columns(LargeSparseMatrix<DATA_FLOAT>* data_t, uint attr_offset, uint num_cases, std::vector<double>& q, std::vector<double>& lin);
+  // per-case buffers of predict_columns for the main table and the relations
+  std::vector<double> pred_q, pred_lin;
+  std::vector< std::vector<double> > rel_pred_q, rel_pred_lin;
+  // for the threads of predict_columns: the entries of column i for task t
+  // are pred_split[i*(T+1)+t] ... pred_split[i*(T+1)+t+1]-1
+  std::vector<uint> pred_split;
 
   // add the q(f)-terms to the main relation q-cache (using only the transpose data)
   void add_main_q(Data& train, uint f);
 
   void draw_all(Data& train);
 
+  // Parallel sampling of w and v of the main table (num_threads != 1 and
+  // the transposed training data in memory): the attributes are colored so
+  // that attributes of one color have no training case in common. Given all
+  // other parameters, their parameters are independent, so all attributes of
+  // a color are drawn in parallel and the sampler stays exact.
+  void buildColoring(Data& train);
+  // calls draw(attribute, column) for every attribute with observations,
+  // color by color; every attribute draws from its own random stream
+  void drawColored(Data& train, const std::function<void(uint attribute, sparse_row<DATA_FLOAT>& feature_data)>& draw);
+  bool parallel_draw = false;
+  // the attributes of color k are color_attr[color_first[k]], ...,
+  // color_attr[color_first[k+1]-1]
+  std::vector<uint> color_first;
+  std::vector<uint> color_attr;
+
   // Sample the model parameters w0, w, v. The samplers for w and v have an
   // additional function for relational data.
   void draw_w0(double& w0, double& reg, Data& train);
-  void draw_w(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data);
-  void draw_w_rel(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache);
-  void draw_v(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data);
-  void draw_v_rel(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache);
+  void draw_w(FM_PARAM_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data);
+  void draw_w_rel(FM_PARAM_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache);
+  void draw_v(FM_PARAM_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data);
+  void draw_v_rel(FM_PARAM_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache);
 
   // Sample the priors.
   void draw_alpha(double& alpha, uint num_train_total);
-  void draw_w_mu(double* w);
-  void draw_w_lambda(double* w);
+  void draw_w_mu(FM_PARAM_FLOAT* w);
+  void draw_w_lambda(FM_PARAM_FLOAT* w);
   void draw_v_mu();
   void draw_v_lambda();
 
@@ -127,7 +240,17 @@ class fm_learn_mcmc : public fm_learn {
 
   DVector<double> pred_sum_all;
   DVector<double> pred_sum_all_but5;
+  DVector<double> pred_sum_sqr_but5; // sum of the squares (for the R-hat of several chains)
   DVector<double> pred_this;
+  uint num_sampled_iter; // number of iterations in pred_sum_all
+  DVector<double> best_pred_this; // pred_this of the best iteration (ALS with patience)
+
+  // The stop criterion -patience is measured on the validation data, never
+  // on the test data. MCMC sums up the predictions of the samples like for
+  // the test data, ALS uses the prediction of the current iteration.
+  double evaluateValidation(int iter);
+  DVector<double> pred_validation;
+  DVector<double> pred_sum_validation;
 
   e_q_term* cache = nullptr;
   e_q_term* cache_test = nullptr;
@@ -141,6 +264,34 @@ fm_learn_mcmc::~fm_learn_mcmc() {
   delete this->cache_test;
 }
 
+double fm_learn_mcmc::evaluateValidation(int iter) {
+  predict_batch(*validation, pred_validation, num_threads);
+  double sum_sqr = 0;
+  uint num_correct = 0;
+  for (uint i = 0; i < validation->num_cases; i++) {
+    double p = pred_validation(i);
+    if (task == TASK_REGRESSION) {
+      p = std::min(max_target, std::max(min_target, p));
+    } else {
+      p = cdf_gaussian(p);
+    }
+    if (do_sample) {
+      pred_sum_validation(i) += p;
+      p = pred_sum_validation(i) / (iter + 1);
+    }
+    double target = validation->target(i);
+    if (task == TASK_REGRESSION) {
+      sum_sqr += (p - target) * (p - target);
+    } else if (((p >= 0.5) && (target > 0.0)) || ((p < 0.5) && (target < 0.0))) {
+      num_correct++;
+    }
+  }
+  if (task == TASK_REGRESSION) {
+    return std::sqrt(sum_sqr / validation->num_cases);
+  }
+  return 1.0 - (double) num_correct / validation->num_cases;
+}
+
 double fm_learn_mcmc::evaluate(Data& data) {
   return std::numeric_limits<double>::quiet_NaN();
 }
@@ -152,247 +303,146 @@ double fm_learn_mcmc::predict_case(Data& data) {
 void fm_learn_mcmc::_learn(Data& train, Data& test) {
 }
 
-void fm_learn_mcmc::predict_data_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_term*>& main_cache) {
-
-  assert(main_data.dim == main_cache.dim);
-  if (main_data.dim == 0) { return ; }
-
-  DVector<RelationJoin>& relation = main_data(0)->relation;
-
-  // do this using only the transpose copy of the training data:
-  for (uint ds = 0; ds < main_cache.dim; ds++) {
-    e_q_term* m_cache = main_cache(ds);
-    Data* m_data = main_data(ds);
-    for (uint i = 0; i < m_data->num_cases; i++) {
-      m_cache[i].e = 0.0;
-      m_cache[i].q = 0.0;
-    }
-  }
-
-  for (uint r = 0; r < relation.dim; r++) {
-    for (uint c = 0; c < relation(r).data->num_cases; c++) {
-      rel_cache(r)[c].y = 0.0;
-      rel_cache(r)[c].q = 0.0;
-    }
-  }
-
-  // (1) do the 1/2 sum_f (sum_i v_if x_i)^2 and store it in the e/y-term
-  // (1.1) e_j = 1/2 sum_f (q_jf+ sum_R q^R_jf)^2
-  // (1.2) y^R_j = 1/2 sum_f q^R_jf^2
-  // Complexity: O(N_z(X^M) + \sum_{B} N_z(X^B) + n*|B| + \sum_B n^B) = O(\mathcal{C})
-  for (int f = 0; f < fm->num_factor; f++) {
-    double* v = fm->v.value[f];
-
-    // calculate cache[i].q = sum_i v_if x_i (== q_f-term)
-    // Complexity: O(N_z(X^M))
-    for (uint ds = 0; ds < main_cache.dim; ds++) {
-      e_q_term* m_cache = main_cache(ds);
-      Data* m_data = main_data(ds);
-      m_data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {
-        {
-          row_index = m_data->data_t->getRowIndex();
-          feature_data = &(m_data->data_t->getRow());
-          m_data->data_t->next();
-        }
-        double& v_if = v[row_index];
-
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          m_cache[train_case_index].q += v_if * x_li;
-        }
-      }
-    }
-
-    // calculate block_cache[i].q = sum_i v^B_if x^B_i (== q^B_f-term)
-    // Complexity: O(\sum_{B} N_z(X^B))
-    for (uint r = 0; r < relation.dim; r++) {
-      uint attr_offset = relation(r).data->attr_offset;
-      relation(r).data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
-        {
-          row_index = relation(r).data->data_t->getRowIndex();
-          feature_data = &(relation(r).data->data_t->getRow());
-          relation(r).data->data_t->next();
-        }
-        double& v_if = v[row_index + attr_offset];
-
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          rel_cache(r)[train_case_index].q += v_if * x_li;
-        }
-      }
+fm_learn_mcmc* fm_learn_mcmc::createChain() {
+  throw "several chains are not supported by this sampler";
+}
 
+void fm_learn_mcmc::predict_columns(LargeSparseMatrix<DATA_FLOAT>* data_t, uint attr_offset, uint num_cases, std::vector<double>& q, std::vector<double>& lin) {
+  const uint num_factor = fm->num_factor;
+  q.assign((uint64) num_cases * num_factor, 0.0);
+  lin.assign(num_cases, 0.0);
+
+  // adds the entries [entry, end) of the column of attribute; v_i is a
+  // buffer for the num_factor factors of the attribute
+  auto add_entries = [&](uint attribute, const sparse_entry<DATA_FLOAT>* entry, const sparse_entry<DATA_FLOAT>* end, double* v_i) {
+    if (entry == end) { return; }
+    double v_sqr = 0.0;
+    for (uint f = 0; f < num_factor; f++) {
+      v_i[f] = fm->v(f, attribute);
+      v_sqr += v_i[f] * v_i[f];
     }
-
-    // add 0.5*q^2 to e and set q to zero.
-    // O(n*|B|)
-    for (uint ds = 0; ds < main_cache.dim; ds++) {
-      e_q_term* m_cache = main_cache(ds);
-      Data* m_data = main_data(ds);
-      for (uint c = 0; c < m_data->num_cases; c++) {
-        double q_all = m_cache[c].q;
-          for (uint r = 0; r < m_data->relation.dim; r++) {
-            q_all += rel_cache(r)[m_data->relation(r).data_row_to_relation_row(c)].q;
-          }
-        m_cache[c].e += 0.5 * q_all*q_all;
-        m_cache[c].q = 0.0;
+    double w_i = fm->k1 ? (double) fm->w(attribute) : 0.0;
+    for (; entry != end; entry++) {
+      double x = entry->value;
+      double* q_c = &(q[(uint64) entry->id * num_factor]);
+      for (uint f = 0; f < num_factor; f++) {
+        q_c[f] += v_i[f] * x;
       }
+      lin[entry->id] += w_i * x - 0.5 * v_sqr * x * x;
     }
-
-
-    // Calculate the "prediction" part of the relation y
-    // O(\sum_B n^B)
-    for (uint r = 0; r < relation.dim; r++) {
-      // add 0.5*q^2 to y and set q to zero.
-      for (uint c = 0; c <  relation(r).data->num_cases; c++) {
-        rel_cache(r)[c].y += 0.5 * rel_cache(r)[c].q * rel_cache(r)[c].q;
-        rel_cache(r)[c].q = 0.0;
-      }
+  };
+
+  LargeSparseMatrixMemory<DATA_FLOAT>* data_memory = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(data_t);
+  if ((data_memory == NULL) || (thread_pool.getNumThreads() == 1)) {
+    std::vector<double> v_i(num_factor);
+    data_t->begin();
+    for (uint i = 0; i < data_t->getNumRows(); i++) {
+      sparse_row<DATA_FLOAT>& column = data_t->getRow();
+      add_entries(data_t->getRowIndex() + attr_offset, column.data, column.data + column.size, v_i.data());
+      data_t->next();
     }
-  }
-
-  // (2) do -1/2 sum_f (sum_i v_if^2 x_i^2) and store it in the q-term
-  for (int f = 0; f < fm->num_factor; f++) {
-    double* v = fm->v.value[f];
-
-    // sum up the q^S_f terms in the main-q-cache: 0.5*sum_i (v_if x_i)^2 (== q^S_f-term)
-    // Complexity: O(N_z(X^M))
-    for (uint ds = 0; ds < main_cache.dim; ds++) {
-      e_q_term* m_cache = main_cache(ds);
-      Data* m_data = main_data(ds);
-
-      m_data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {
-        {
-          row_index = m_data->data_t->getRowIndex();
-          feature_data = &(m_data->data_t->getRow());
-          m_data->data_t->next();
-        }
-        double& v_if = v[row_index];
-
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          m_cache[train_case_index].q -= 0.5 * v_if * v_if * x_li * x_li;
+  } else {
+    // Every thread writes only its own range of cases. The entries of a
+    // column are sorted by case, so the column is split once into the
+    // ranges of the threads; a thread skips the columns without entries in
+    // its range without reading their factors.
+    uint num_tasks = thread_pool.getNumThreads();
+    uint num_columns = data_memory->data.dim;
+    pred_split.resize((uint64) num_columns * (num_tasks + 1));
+    thread_pool.parallel_for(0, num_columns, FM_PREDICT_GRAIN_ROWS, [&](uint64 column_begin, uint64 column_end, int thread) {
+      for (uint64 i = column_begin; i < column_end; i++) {
+        const sparse_row<DATA_FLOAT>& column = data_memory->data(i);
+        uint* split = &(pred_split[i * (num_tasks + 1)]);
+        split[0] = 0;
+        for (uint t = 1; t < num_tasks; t++) {
+          uint case_begin = (uint64) num_cases * t / num_tasks;
+          split[t] = std::lower_bound(column.data + split[t - 1], column.data + column.size, case_begin, [](const sparse_entry<DATA_FLOAT>& e, uint c) { return e.id < c; }) - column.data;
         }
+        split[num_tasks] = column.size;
       }
-    }
-
-    // sum up the q^B,S_f terms in the block_cache.q: 0.5* sum_i (v^B_if x^B_i)^2 (== q^B,S_f-term)
-    // Complexity: O(\sum_{B} N_z(X^B))
-    for (uint r = 0; r < relation.dim; r++) {
-      uint attr_offset = relation(r).data->attr_offset;
-      relation(r).data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
-        {
-          row_index = relation(r).data->data_t->getRowIndex();
-          feature_data = &(relation(r).data->data_t->getRow());
-          relation(r).data->data_t->next();
-        }
-        double& v_if = v[row_index + attr_offset];
-
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          rel_cache(r)[train_case_index].q -= 0.5 * v_if * v_if * x_li * x_li;
-        }
+    });
+    thread_pool.run(num_tasks, [&](uint task, int thread) {
+      std::vector<double> v_i(num_factor);
+      for (uint i = 0; i < num_columns; i++) {
+        const sparse_row<DATA_FLOAT>& column = data_memory->data(i);
+        const uint* split = &(pred_split[(uint64) i * (num_tasks + 1)]);
+        add_entries(i + attr_offset, column.data + split[task], column.data + split[task + 1], v_i.data());
       }
-    }
+    });
   }
+}
 
-  // (3) add the w's to the q-term
-  if (fm->k1) {
-    for (uint ds = 0; ds < main_cache.dim; ds++) {
-      e_q_term* m_cache = main_cache(ds);
-      Data* m_data = main_data(ds);
-      m_data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < m_data->data_t->getNumRows(); i++) {
-        {
-          row_index = m_data->data_t->getRowIndex();
-          feature_data = &(m_data->data_t->getRow());
-          m_data->data_t->next();
-        }
-        double& w_i = fm->w(row_index);
+void fm_learn_mcmc::predict_data_and_write_to_eterms(DVector<Data*>& main_data, DVector<e_q_term*>& main_cache) {
 
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          m_cache[train_case_index].q += w_i * x_li;
-        }
-      }
-    }
-    for (uint r = 0; r < relation.dim; r++) {
-      uint attr_offset = relation(r).data->attr_offset;
-      relation(r).data->data_t->begin();
-      uint row_index;
-      sparse_row<DATA_FLOAT>* feature_data;
-      for (uint i = 0; i < relation(r).data->data_t->getNumRows(); i++) {
-        {
-          row_index = relation(r).data->data_t->getRowIndex();
-          feature_data = &(relation(r).data->data_t->getRow());
-          relation(r).data->data_t->next();
-        }
-        double& w_i = fm->w(row_index + attr_offset);
+  assert(main_data.dim == main_cache.dim);
+  if (main_data.dim == 0) { return ; }
 
-        for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
-          uint& train_case_index = feature_data->data[i_fd].id;
-          FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          rel_cache(r)[train_case_index].q += w_i * x_li;
+  DVector<RelationJoin>& relation = main_data(0)->relation;
+  const uint num_factor = fm->num_factor;
+
+  // (1) one pass over the transpose data of each relation block B:
+  // q^B_jf = sum_i v^B_if x^B_ji and
+  // y^B_j = 1/2 sum_f q^B_jf^2 + sum_i w^B_i x^B_ji - 1/2 sum_f sum_i v^B_if^2 x^B_ji^2
+  // Complexity: O(k * \sum_{B} N_z(X^B))
+  rel_pred_q.resize(relation.dim);
+  rel_pred_lin.resize(relation.dim);
+  for (uint r = 0; r < relation.dim; r++) {
+    predict_columns(relation(r).data->data_t, relation(r).data->attr_offset, relation(r).data->num_cases, rel_pred_q[r], rel_pred_lin[r]);
+    thread_pool.parallel_for(0, relation(r).data->num_cases, FM_PREDICT_GRAIN_ROWS, [&](uint64 case_begin, uint64 case_end, int thread) {
+      for (uint c = case_begin; c < case_end; c++) {
+        const double* q_c = &(rel_pred_q[r][(uint64) c * num_factor]);
+        double y = 0.0;
+        for (uint f = 0; f < num_factor; f++) {
+          y += 0.5 * q_c[f] * q_c[f];
         }
+        rel_cache(r)[c].y = y + rel_pred_lin[r][c];
+        rel_cache(r)[c].q = 0.0;
       }
-    }
-
+    });
   }
-  // (3) merge both for getting the prediction: w0+e(c)+q(c)
+
+  // (2) one pass over the transpose data of each main table, then
+  // e_j = w0 + 1/2 sum_f (q_jf + sum_B q^B_jf)^2 + the linear and squared terms of all tables
+  // Complexity: O(k * N_z(X^M) + k * n * |B|)
   for (uint ds = 0; ds < main_cache.dim; ds++) {
     e_q_term* m_cache = main_cache(ds);
     Data* m_data = main_data(ds);
-
-    for (uint c = 0; c < m_data->num_cases; c++) {
-      double q_all = m_cache[c].q;
-      for (uint r = 0; r < m_data->relation.dim; r++) {
-        q_all += rel_cache(r)[m_data->relation(r).data_row_to_relation_row(c)].q;
-      }
-      m_cache[c].e = m_cache[c].e + q_all;
-      if (fm->k0) {
-        m_cache[c].e += fm->w0;
+    predict_columns(m_data->data_t, 0, m_data->num_cases, pred_q, pred_lin);
+    thread_pool.parallel_for(0, m_data->num_cases, FM_PREDICT_GRAIN_ROWS, [&](uint64 case_begin, uint64 case_end, int thread) {
+      for (uint c = case_begin; c < case_end; c++) {
+        double* q_c = &(pred_q[(uint64) c * num_factor]);
+        double lin = pred_lin[c];
+        for (uint r = 0; r < m_data->relation.dim; r++) {
+          uint rel_row = m_data->relation(r).data_row_to_relation_row(c);
+          const double* q_rel = &(rel_pred_q[r][(uint64) rel_row * num_factor]);
+          for (uint f = 0; f < num_factor; f++) {
+            q_c[f] += q_rel[f];
+          }
+          lin += rel_pred_lin[r][rel_row];
+        }
+        double e = 0.0;
+        for (uint f = 0; f < num_factor; f++) {
+          e += 0.5 * q_c[f] * q_c[f];
+        }
+        e += lin;
+        if (fm->k0) {
+          e += fm->w0;
+        }
+        m_cache[c].e = e;
+        m_cache[c].q = 0.0;
       }
-      m_cache[c].q = 0.0;
-    }
-  }
-
-  // The "prediction" in each block is calculated
-  for (uint r = 0; r < relation.dim; r++) {
-    // y_i = y_i + q_i = [1/2 sum_f (q^B_if)^2] + [sum w^B_i x^B_i -1/2 sum_f (sum_i v^B_if^2 x^B_i^2)]
-    for (uint c = 0; c <  relation(r).data->num_cases; c++) {
-      rel_cache(r)[c].y = rel_cache(r)[c].y + rel_cache(r)[c].q;
-      rel_cache(r)[c].q = 0.0;
-    }
+    });
   }
 }
 
-void fm_learn_mcmc::predict(Data& data, DVector<double>& out) {
-  assert(data.num_cases == out.dim);
+void fm_learn_mcmc::predictTest(DVector<double>& out) {
   if (do_sample) {
-    assert(data.num_cases == pred_sum_all.dim);
+    assert(out.dim == pred_sum_all.dim);
     for (uint i = 0; i < out.dim; i++) {
-      out(i) = pred_sum_all(i) / num_iter;
+      out(i) = pred_sum_all(i) / num_sampled_iter;
     }
   } else {
-    assert(data.num_cases == pred_this.dim);
+    assert(out.dim == pred_this.dim);
     for (uint i = 0; i < out.dim; i++) {
       out(i) = pred_this(i);
     }
@@ -410,8 +460,51 @@ void fm_learn_mcmc::predict(Data& data, DVector<double>& out) {
   }
 }
 
+void fm_learn_mcmc::predict(Data& data, DVector<double>& out) {
+  assert(data.num_cases == out.dim);
+  if (data.data == NULL) {
+    throw "the rows of the data are needed for predicting with the model or the posterior samples";
+  }
+  if (data.relation.dim > 0) {
+    throw "data with relations can only be predicted as the test data of learning (predictTest)";
+  }
+  // like the test predictions during learning: the mean of the clipped
+  // predictions (regression) or of the probabilities (classification)
+  auto transform = [&](double p) {
+    if (task == TASK_REGRESSION) {
+      return std::max(min_target, std::min(max_target, p));
+    } else if (task == TASK_CLASSIFICATION) {
+      return cdf_gaussian(p);
+    }
+    throw "task not supported";
+  };
+  if (! do_sample) {
+    predict_batch(data, out, num_threads);
+    for (uint i = 0; i < out.dim; i++) {
+      out(i) = transform(out(i));
+    }
+    return;
+  }
+  if (posterior.num_samples == 0) {
+    throw "there are no posterior samples for predicting data other than the test data of learning (see -posterior_every)";
+  }
+  thread_pool.setNumThreads(num_threads);
+  std::vector< std::vector<double> > sample_pred(thread_pool.getNumThreads(), std::vector<double>(posterior.num_samples));
+  parallel_for_rows(data, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row, int thread) {
+    double* p = sample_pred[thread].data();
+    for (uint r = 0; r < num_rows; r++) {
+      posterior.predict(rows[r], p);
+      double sum = 0;
+      for (uint s = 0; s < posterior.num_samples; s++) {
+        sum += transform(p[s]);
+      }
+      out(first_row + r) = sum / posterior.num_samples;
+    }
+  });
+}
+
 void fm_learn_mcmc::add_main_q(Data& train, uint f) {
-  double* v = fm->v.value[f];
+  FM_PARAM_FLOAT* v = fm->v.factor(f);
 
   {
     train.data_t->begin();
@@ -423,11 +516,11 @@ void fm_learn_mcmc::add_main_q(Data& train, uint f) {
         feature_data = &(train.data_t->getRow());
         train.data_t->next();
       }
-      double& v_if = v[row_index];
+      FM_PARAM_FLOAT& v_if = v[row_index];
       for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
         uint& train_case_index = feature_data->data[i_fd].id;
         FM_FLOAT& x_li = feature_data->data[i_fd].value;
-        cache[train_case_index].q += v_if * x_li;
+        cache[train_case_index].q += (double) v_if * x_li;
       }
 
     }
@@ -458,18 +551,26 @@ void fm_learn_mcmc::draw_all(Data& train) {
     }
 
     // draw the w from their posterior
-    train.data_t->begin();
     uint row_index;
     sparse_row<DATA_FLOAT>* feature_data;
-    for (uint i = 0; i < train.data_t->getNumRows(); i++) {
-      {
-        row_index = train.data_t->getRowIndex();
-        feature_data = &(train.data_t->getRow());
-        train.data_t->next();
-        count_how_many_variables_are_drawn++;
+    if (parallel_draw) {
+      drawColored(train, [&](uint attribute, sparse_row<DATA_FLOAT>& feature_data) {
+        uint g = meta->attr_group(attribute);
+        draw_w(fm->w(attribute), w_mu(g), w_lambda(g), feature_data);
+      });
+      count_how_many_variables_are_drawn += train.data_t->getNumRows();
+    } else {
+      train.data_t->begin();
+      for (uint i = 0; i < train.data_t->getNumRows(); i++) {
+        {
+          row_index = train.data_t->getRowIndex();
+          feature_data = &(train.data_t->getRow());
+          train.data_t->next();
+          count_how_many_variables_are_drawn++;
+        }
+        uint g = meta->attr_group(row_index);
+        draw_w(fm->w(row_index), w_mu(g), w_lambda(g), *feature_data);
       }
-      uint g = meta->attr_group(row_index);
-      draw_w(fm->w(row_index), w_mu(g), w_lambda(g), *feature_data);
     }
     // draw w's of the main table for which there is no observation in the training data
     uint draw_to = fm->num_attribute;
@@ -541,7 +642,7 @@ void fm_learn_mcmc::draw_all(Data& train) {
 
     add_main_q(train, f);
 
-    double* v = fm->v.value[f];
+    FM_PARAM_FLOAT* v = fm->v.factor(f);
 
     for (uint r = 0; r < train.relation.dim; r++) {
       RelationJoin& join = train.relation(r);
@@ -559,12 +660,12 @@ void fm_learn_mcmc::draw_all(Data& train) {
           feature_data = &(join.data->data_t->getRow());
           join.data->data_t->next();
         }
-        double& v_if = v[row_index + attr_offset];
+        FM_PARAM_FLOAT& v_if = v[row_index + attr_offset];
 
         for (uint i_fd = 0; i_fd < feature_data->size; i_fd++) {
           uint& train_case_index = feature_data->data[i_fd].id;
           FM_FLOAT& x_li = feature_data->data[i_fd].value;
-          r_cache[train_case_index].q += v_if * x_li;
+          r_cache[train_case_index].q += (double) v_if * x_li;
         }
       }
     }
@@ -577,18 +678,26 @@ void fm_learn_mcmc::draw_all(Data& train) {
     }
 
     // draw the thetas from their posterior
-    train.data_t->begin();
     uint row_index;
     sparse_row<DATA_FLOAT>* feature_data;
-    for (uint i = 0; i < train.data_t->getNumRows(); i++) {
-      {
-        row_index = train.data_t->getRowIndex();
-        feature_data = &(train.data_t->getRow());
-        train.data_t->next();
-        count_how_many_variables_are_drawn++;
+    if (parallel_draw) {
+      drawColored(train, [&](uint attribute, sparse_row<DATA_FLOAT>& feature_data) {
+        uint g = meta->attr_group(attribute);
+        draw_v(v[attribute], v_mu(g,f), v_lambda(g,f), feature_data);
+      });
+      count_how_many_variables_are_drawn += train.data_t->getNumRows();
+    } else {
+      train.data_t->begin();
+      for (uint i = 0; i < train.data_t->getNumRows(); i++) {
+        {
+          row_index = train.data_t->getRowIndex();
+          feature_data = &(train.data_t->getRow());
+          train.data_t->next();
+          count_how_many_variables_are_drawn++;
+        }
+        uint g = meta->attr_group(row_index);
+        draw_v(v[row_index], v_mu(g,f), v_lambda(g,f), *feature_data);
       }
-      uint g = meta->attr_group(row_index);
-      draw_v(v[row_index], v_mu(g,f), v_lambda(g,f), *feature_data);
     }
     // draw v's of the main table for which there is no observation in the training data
     uint draw_to = fm->num_attribute;
@@ -647,6 +756,84 @@ void fm_learn_mcmc::draw_all(Data& train) {
   }
 }
 
+void fm_learn_mcmc::buildColoring(Data& train) {
+  LargeSparseMatrixMemory<DATA_FLOAT>* data_t = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(train.data_t);
+  assert(data_t != NULL);
+  uint num_attr = data_t->data.dim;
+  // colors of the attributes of each case that are colored already; the
+  // colors of case c are case_color[case_first[c]] ... case_color[case_fill[c]-1]
+  std::vector<uint64> case_first(train.num_cases + 1, 0);
+  for (uint a = 0; a < num_attr; a++) {
+    for (uint j = 0; j < data_t->data(a).size; j++) {
+      case_first[data_t->data(a).data[j].id + 1]++;
+    }
+  }
+  for (uint c = 0; c < train.num_cases; c++) {
+    case_first[c + 1] += case_first[c];
+  }
+  std::vector<uint> case_color(case_first.back());
+  std::vector<uint64> case_fill(case_first.begin(), case_first.end() - 1);
+
+  // greedy: every attribute gets the smallest color that no attribute of
+  // its cases has
+  std::vector<uint> attr_color(num_attr);
+  std::vector<uint> color_used; // color_used[k] == a+1: color k is taken for attribute a
+  for (uint a = 0; a < num_attr; a++) {
+    sparse_row<DATA_FLOAT>& feature_data = data_t->data(a);
+    for (uint j = 0; j < feature_data.size; j++) {
+      uint c = feature_data.data[j].id;
+      for (uint64 l = case_first[c]; l < case_fill[c]; l++) {
+        color_used[case_color[l]] = a + 1;
+      }
+    }
+    uint k = 0;
+    while ((k < color_used.size()) && (color_used[k] == a + 1)) { k++; }
+    if (k == color_used.size()) { color_used.push_back(0); }
+    attr_color[a] = k;
+    for (uint j = 0; j < feature_data.size; j++) {
+      uint c = feature_data.data[j].id;
+      case_color[case_fill[c]++] = k;
+    }
+  }
+
+  // sort the attributes by color, within a color by id
+  uint num_colors = color_used.size();
+  color_first.assign(num_colors + 1, 0);
+  for (uint a = 0; a < num_attr; a++) {
+    color_first[attr_color[a] + 1]++;
+  }
+  for (uint k = 0; k < num_colors; k++) {
+    color_first[k + 1] += color_first[k];
+  }
+  color_attr.resize(num_attr);
+  std::vector<uint> pos(color_first.begin(), color_first.end() - 1);
+  for (uint a = 0; a < num_attr; a++) {
+    color_attr[pos[attr_color[a]]++] = a;
+  }
+  std::cout << "MCMC: " << num_attr << " attributes in " << num_colors << " colors without common training cases." << std::endl;
+}
+
+void fm_learn_mcmc::drawColored(Data& train, const std::function<void(uint attribute, sparse_row<DATA_FLOAT>& feature_data)>& draw) {
+  LargeSparseMatrixMemory<DATA_FLOAT>* data_t = static_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(train.data_t);
+  // the stream of an attribute is derived from one seed per call, so the
+  // draws do not depend on the number of threads
+  uint64 seed = ran_seed();
+  for (uint k = 0; k + 1 < color_first.size(); k++) {
+    thread_pool.parallel_for(color_first[k], color_first[k + 1], FM_MCMC_GRAIN_ATTRIBUTES, [&](uint64 begin, uint64 end, int thread) {
+      // the calling thread may have a stream of its own (checkpoints)
+      RandomStream* outer_stream = ran_stream;
+      for (uint64 j = begin; j < end; j++) {
+        uint attribute = color_attr[j];
+        uint64 state = seed ^ attribute;
+        RandomStream stream(ran_splitmix64(state));
+        ran_set_stream(&stream);
+        draw(attribute, data_t->data(attribute));
+        ran_set_stream(outer_stream);
+      }
+    });
+  }
+}
+
 void fm_learn_mcmc::draw_w0(double& w0, double& reg, Data& train) {
   // h = 1
   // h^2 = 1
@@ -689,13 +876,13 @@ void fm_learn_mcmc::draw_w0(double& w0, double& reg, Data& train) {
   }
 }
 
-void fm_learn_mcmc::draw_w(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data) {
+void fm_learn_mcmc::draw_w(FM_PARAM_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data) {
   double w_sigma_sqr = 0;
   double w_mean = 0;
   for (uint i_fd = 0; i_fd < feature_data.size; i_fd++) {
     uint& train_case_index = feature_data.data[i_fd].id;
     FM_FLOAT x_li = feature_data.data[i_fd].value;
-    w_mean += x_li * (cache[train_case_index].e - w * x_li);
+    w_mean += x_li * (cache[train_case_index].e - (double) w * x_li);
     w_sigma_sqr += x_li * x_li;
   }
   w_sigma_sqr = (double) 1.0 / (w_lambda + alpha * w_sigma_sqr);
@@ -738,7 +925,7 @@ void fm_learn_mcmc::draw_w(double& w, double& w_mu, double& w_lambda, sparse_row
   }
 }
 
-void fm_learn_mcmc::draw_w_rel(double& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
+void fm_learn_mcmc::draw_w_rel(FM_PARAM_FLOAT& w, double& w_mu, double& w_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
   double w_sigma_sqr = 0;
   double w_mean = 0;
   // w_sigma_sqr = \sum h^2
@@ -796,7 +983,7 @@ void fm_learn_mcmc::draw_w_rel(double& w, double& w_mu, double& w_lambda, sparse
   }
 }
 
-void fm_learn_mcmc::draw_v(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data) {
+void fm_learn_mcmc::draw_v(FM_PARAM_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data) {
   double v_sigma_sqr = 0;
   double v_mean = 0;
   // v_sigma_sqr = \sum h^2 (always)
@@ -805,7 +992,7 @@ void fm_learn_mcmc::draw_v(double& v, double& v_mu, double& v_lambda, sparse_row
     uint& train_case_index = feature_data.data[i_fd].id;
     FM_FLOAT& x_li = feature_data.data[i_fd].value;
     e_q_term* cache_li = &(cache[train_case_index]);
-    double h = x_li * ( cache_li->q - x_li * v);
+    double h = x_li * ( cache_li->q - x_li * (double) v);
     v_mean += h * cache_li->e;
     v_sigma_sqr += h * h;
   }
@@ -853,7 +1040,7 @@ void fm_learn_mcmc::draw_v(double& v, double& v_mu, double& v_lambda, sparse_row
   }
 }
 
-void fm_learn_mcmc::draw_v_rel(double& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
+void fm_learn_mcmc::draw_v_rel(FM_PARAM_FLOAT& v, double& v_mu, double& v_lambda, sparse_row<DATA_FLOAT>& feature_data, relation_cache* r_cache) {
   double v_sigma_sqr = 0;
   double v_mean = 0;
   // v_sigma_sqr = \sum h^2
@@ -863,7 +1050,7 @@ void fm_learn_mcmc::draw_v_rel(double& v, double& v_mu, double& v_lambda, sparse
     uint& train_case_index = feature_data.data[i_fd].id;
     FM_FLOAT x_li = feature_data.data[i_fd].value;
     relation_cache* cache_li = &(r_cache[train_case_index]);
-    double h = x_li * ( cache_li->q - x_li * v);
+    double h = x_li * ( cache_li->q - x_li * (double) v);
     v_mean += (h*cache_li->we + x_li*cache_li->weq);
     v_sigma_sqr += (h * h * cache_li->wnum + 2 * cache_li->wc * x_li * h + x_li * x_li * cache_li->wc_sqr);
     num_all += r_cache[train_case_index].wnum;
@@ -945,7 +1132,7 @@ void fm_learn_mcmc::draw_alpha(double& alpha, uint num_train_total) {
   }
 }
 
-void fm_learn_mcmc::draw_w_mu(double* w) {
+void fm_learn_mcmc::draw_w_mu(FM_PARAM_FLOAT* w) {
   if (! do_multilevel) {
     w_mu.init(mu_0);
     return;
@@ -984,7 +1171,7 @@ void fm_learn_mcmc::draw_w_mu(double* w) {
   }
 }
 
-void fm_learn_mcmc::draw_w_lambda(double* w) {
+void fm_learn_mcmc::draw_w_lambda(FM_PARAM_FLOAT* w) {
   if (! do_multilevel) {
     return;
   }
@@ -1106,6 +1293,9 @@ void fm_learn_mcmc::draw_v_lambda() {
 void fm_learn_mcmc::init() {
   fm_learn::init();
 
+  // the samplers sweep over one factor at a time
+  fm->setLayout(FM_LAYOUT_FACTOR_MAJOR);
+
   cache_for_group_values.setSize(meta->num_attr_groups);
 
   empty_data_row.size = 0;
@@ -1165,12 +1355,29 @@ void fm_learn_mcmc::init() {
 }
 
 void fm_learn_mcmc::learn(Data& train, Data& test) {
+  if (num_chains > 1) {
+    learnChains(train, test);
+  } else {
+    learnChain(train, test);
+  }
+  // saved samples predict without the training data
+  posterior.task = task;
+  posterior.min_target = min_target;
+  posterior.max_target = max_target;
+}
+
+void fm_learn_mcmc::learnChain(Data& train, Data& test) {
   pred_sum_all.setSize(test.num_cases);
   pred_sum_all_but5.setSize(test.num_cases);
+  pred_sum_sqr_but5.setSize(test.num_cases);
   pred_this.setSize(test.num_cases);
   pred_sum_all.init(0.0);
   pred_sum_all_but5.init(0.0);
+  pred_sum_sqr_but5.init(0.0);
   pred_this.init(0.0);
+  num_sampled_iter = 0;
+  posterior.init(*fm);
+  checkpoint_posterior_samples = 0;
 
   // init caches data structure
   MemoryLog::getInstance().logNew("e_q_term", sizeof(e_q_term), train.num_cases);
@@ -1194,7 +1401,26 @@ void fm_learn_mcmc::learn(Data& train, Data& test) {
     }
   }
 
-  _learn(train, test);
+  thread_pool.setNumThreads(num_threads);
+  parallel_draw = (thread_pool.getNumThreads() > 1) && (dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(train.data_t) != NULL);
+  if (parallel_draw) {
+    buildColoring(train);
+  }
+
+  // with checkpoints, the random numbers are drawn from a stream, whose
+  // state is saved (several chains have their stream already)
+  std::unique_ptr<RandomStream> random;
+  if ((! checkpoint_file.empty()) && (ran_stream == NULL)) {
+    random.reset(new RandomStream(ran_seed()));
+    ran_set_stream(random.get());
+  }
+  try {
+    _learn(train, test);
+  } catch (...) {
+    if (random) { ran_set_stream(NULL); }
+    throw;
+  }
+  if (random) { ran_set_stream(NULL); }
 
   // free data structures
   for (uint i = 0; i < train.relation.dim; i++) {
@@ -1209,8 +1435,443 @@ void fm_learn_mcmc::learn(Data& train, Data& test) {
   this->cache = nullptr;
 }
 
+void fm_learn_mcmc::learnChains(Data& train, Data& test) {
+  if (! do_sample) {
+    throw "several chains need sampling (MCMC)";
+  }
+
+  // The chains share the values of the data, but each has its own cursors
+  // on it (see LargeSparseMatrix::clone). Chain 0 samples fm on the
+  // original data and prints its iterations.
+  struct chain {
+    std::unique_ptr<fm_learn_mcmc> learner;
+    std::unique_ptr<fm_model> model;
+    // the original data for chain 0, otherwise copies of it
+    Data* train;
+    Data* test;
+    Data* validation;
+    std::unique_ptr<Data> train_copy, test_copy, validation_copy;
+    std::vector<RelationData*> relation;
+    std::unique_ptr<RandomStream> random;
+    ~chain() {
+      for (uint r = 0; r < relation.size(); r++) {
+        delete relation[r]->data_t;
+        delete relation[r];
+      }
+    }
+  };
+  auto copy_data = [](Data& data, std::vector<RelationData*>& relation) {
+    Data* result = new Data(0, false, true);
+    result->data_t = data.data_t->clone();
+    result->target.assign(data.target);
+    result->num_feature = data.num_feature;
+    result->num_cases = data.num_cases;
+    result->min_target = data.min_target;
+    result->max_target = data.max_target;
+    result->relation.setSize(data.relation.dim);
+    for (uint r = 0; r < data.relation.dim; r++) {
+      result->relation(r).data_row_to_relation_row.assign(data.relation(r).data_row_to_relation_row);
+      result->relation(r).data = relation[r];
+    }
+    return result;
+  };
+
+  uint64 seed = ran_seed();
+  std::vector< std::unique_ptr<chain> > chains(num_chains);
+  for (uint c = 0; c < num_chains; c++) {
+    chains[c].reset(new chain());
+    chain& ch = *chains[c];
+    uint64 state = seed ^ c;
+    ch.random.reset(new RandomStream(ran_splitmix64(state)));
+
+    fm_model* model = fm;
+    ch.train = &train;
+    ch.test = &test;
+    ch.validation = validation;
+    if (c > 0) {
+      for (uint r = 0; r < train.relation.dim; r++) {
+        RelationData* original = train.relation(r).data;
+        RelationData* rel = new RelationData(0, false, true);
+        rel->meta = original->meta;
+        rel->data_t = original->data_t->clone();
+        rel->num_feature = original->num_feature;
+        rel->num_cases = original->num_cases;
+        rel->attr_offset = original->attr_offset;
+        ch.relation.push_back(rel);
+      }
+      ch.train_copy.reset(copy_data(train, ch.relation));
+      ch.test_copy.reset(copy_data(test, ch.relation));
+      ch.train = ch.train_copy.get();
+      ch.test = ch.test_copy.get();
+      if (validation != NULL) {
+        // the rows of the validation data are predicted (-patience)
+        ch.validation_copy.reset(new Data(0, true, false));
+        ch.validation_copy->data = validation->data->clone();
+        ch.validation_copy->target.assign(validation->target);
+        ch.validation_copy->num_feature = validation->num_feature;
+        ch.validation_copy->num_cases = validation->num_cases;
+        ch.validation_copy->min_target = validation->min_target;
+        ch.validation_copy->max_target = validation->max_target;
+        ch.validation = ch.validation_copy.get();
+      }
+
+      // a new model with its own random initialization
+      ch.model.reset(new fm_model());
+      model = ch.model.get();
+      model->num_attribute = fm->num_attribute;
+      model->k0 = fm->k0;
+      model->k1 = fm->k1;
+      model->num_factor = fm->num_factor;
+      model->layout = FM_LAYOUT_FACTOR_MAJOR;
+      model->reg0 = fm->reg0;
+      model->regw = fm->regw;
+      model->regv = fm->regv;
+      model->init_mean = fm->init_mean;
+      model->init_stdev = fm->init_stdev;
+      ran_set_stream(ch.random.get());
+      model->init();
+      model->w.init_normal(model->init_mean, model->init_stdev);
+      ran_set_stream(NULL);
+    }
+
+    fm_learn_mcmc* learner = createChain();
+    ch.learner.reset(learner);
+    learner->fm = model;
+    learner->meta = meta;
+    learner->task = task;
+    learner->min_target = min_target;
+    learner->max_target = max_target;
+    learner->validation = ch.validation;
+    learner->num_threads = 1;
+    learner->max_time = max_time;
+    learner->patience = patience;
+    learner->min_delta = min_delta;
+    learner->min_param_change = min_param_change;
+    learner->num_iter = num_iter;
+    learner->num_eval_cases = num_eval_cases;
+    learner->do_sample = do_sample;
+    learner->do_multilevel = do_multilevel;
+    learner->posterior_every = posterior_every;
+    if (! checkpoint_file.empty()) {
+      learner->checkpoint_file = checkpoint_file + ".chain" + std::to_string(c);
+      learner->checkpoint_every = checkpoint_every;
+      learner->resume = resume;
+    }
+    learner->init();
+    // the log fields of chain 0 were added by init() of this learner
+    learner->log = (c == 0) ? log : NULL;
+    learner->print_progress = (c == 0);
+    learner->alpha_0 = alpha_0;
+    learner->gamma_0 = gamma_0;
+    learner->beta_0 = beta_0;
+    learner->mu_0 = mu_0;
+    learner->w0_mean_0 = w0_mean_0;
+    learner->alpha = alpha;
+    learner->w_mu.assign(w_mu);
+    learner->w_lambda.assign(w_lambda);
+    learner->v_mu.assign(v_mu);
+    learner->v_lambda.assign(v_lambda);
+  }
+
+  thread_pool.setNumThreads(num_threads);
+  std::cout << "MCMC: " << num_chains << " chains on " << std::min((int) num_chains, thread_pool.getNumThreads()) << " threads, the iterations of chain 0 are shown." << std::endl;
+  double learn_time = getwalltime();
+  thread_pool.run(num_chains, [&](uint c, int thread) {
+    ran_set_stream(chains[c]->random.get());
+    try {
+      chains[c]->learner->learn(*chains[c]->train, *chains[c]->test);
+    } catch (...) {
+      ran_set_stream(NULL);
+      throw;
+    }
+    ran_set_stream(NULL);
+  });
+  learn_time = getwalltime() - learn_time;
+
+  // merge the samples of all chains
+  pred_sum_all.setSize(test.num_cases);
+  pred_sum_all_but5.setSize(test.num_cases);
+  pred_sum_sqr_but5.setSize(test.num_cases);
+  pred_sum_all.init(0.0);
+  pred_sum_all_but5.init(0.0);
+  pred_sum_sqr_but5.init(0.0);
+  pred_this.assign(chains[0]->learner->pred_this);
+  num_sampled_iter = 0;
+  for (uint c = 0; c < num_chains; c++) {
+    fm_learn_mcmc* learner = chains[c]->learner.get();
+    for (uint i = 0; i < test.num_cases; i++) {
+      pred_sum_all(i) += learner->pred_sum_all(i);
+      pred_sum_all_but5(i) += learner->pred_sum_all_but5(i);
+      pred_sum_sqr_but5(i) += learner->pred_sum_sqr_but5(i);
+    }
+    num_sampled_iter += learner->num_sampled_iter;
+  }
+  posterior.init(*fm);
+  for (uint c = 0; c < num_chains; c++) {
+    posterior.add(chains[c]->learner->posterior);
+  }
+
+  // Potential scale reduction (R-hat, Gelman and Rubin) of every evaluated
+  // test prediction over the samples after the burn-in of 5 iterations:
+  // sqrt(((n-1)/n W + B/n) / W) with the mean variance W within the chains
+  // and the variance B/n of the chain means. Values close to 1 indicate
+  // that the chains have mixed.
+  uint num_eval = std::min(num_eval_cases, test.num_cases);
+  double n = 0;
+  bool has_samples = true;
+  for (uint c = 0; c < num_chains; c++) {
+    double n_c = (double) chains[c]->learner->num_sampled_iter - 5;
+    has_samples = has_samples && (n_c >= 2);
+    n += n_c / num_chains;
+  }
+  double rhat_sum = 0, rhat_max = 0;
+  uint num_rhat = 0, num_rhat_above = 0;
+  if (has_samples) {
+    std::vector<double> mean(num_chains);
+    for (uint i = 0; i < num_eval; i++) {
+      double w = 0, mean_all = 0;
+      for (uint c = 0; c < num_chains; c++) {
+        fm_learn_mcmc* learner = chains[c]->learner.get();
+        double n_c = (double) learner->num_sampled_iter - 5;
+        mean[c] = learner->pred_sum_all_but5(i) / n_c;
+        w += (learner->pred_sum_sqr_but5(i) - n_c * mean[c] * mean[c]) / (n_c - 1) / num_chains;
+        mean_all += mean[c] / num_chains;
+      }
+      double b = 0;
+      for (uint c = 0; c < num_chains; c++) {
+        b += (mean[c] - mean_all) * (mean[c] - mean_all) / (num_chains - 1);
+      }
+      if (w <= 0) { continue; }
+      double rhat = std::sqrt(((n - 1) / n * w + b) / w);
+      rhat_sum += rhat;
+      rhat_max = std::max(rhat_max, rhat);
+      num_rhat++;
+      if (rhat > 1.1) { num_rhat_above++; }
+    }
+  }
+
+  // the measure of the merged prediction
+  double measure = 0;
+  for (uint i = 0; i < num_eval; i++) {
+    double p = pred_sum_all(i) / num_sampled_iter;
+    if (task == TASK_REGRESSION) {
+      p = std::min(max_target, std::max(min_target, p));
+      measure += (p - test.target(i)) * (p - test.target(i));
+    } else if (((p >= 0.5) && (test.target(i) > 0.0)) || ((p < 0.5) && (test.target(i) < 0.0))) {
+      measure += 1;
+    }
+  }
+  measure = (task == TASK_REGRESSION) ? std::sqrt(measure / num_eval) : measure / num_eval;
+
+  std::cout << "#Chains=" << num_chains << "\t#Samples=" << num_sampled_iter << "\tTest=" << measure << "\ttime=" << learn_time << std::endl;
+  if (num_rhat > 0) {
+    std::cout << "R-hat of the test predictions:\tmean=" << rhat_sum / num_rhat << "\tmax=" << rhat_max << "\t#(R-hat>1.1)=" << num_rhat_above << " of " << num_rhat << std::endl;
+  } else {
+    std::cout << "R-hat of the test predictions: not enough samples (at least 7 iterations per chain are needed)" << std::endl;
+  }
+}
+
+void fm_learn_mcmc::saveCheckpoint(uint num_complete_iter, Data& train, Data& test, bool stopped) {
+  // the posterior samples are written first, so the checkpoint never has
+  // more samples than the file of the samples
+  std::string posterior_file = checkpoint_file + ".posterior";
+  if ((checkpoint_posterior_samples == 0) && (posterior.num_samples > 0)) {
+    std::string tmp_posterior_file = posterior_file + ".tmp";
+    std::ofstream out_posterior(tmp_posterior_file.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (! out_posterior.is_open()) {
+      throw "unable to write " + tmp_posterior_file;
+    }
+    posterior.writeSamples(out_posterior, 0);
+    out_posterior.close();
+    if (out_posterior.fail() || (std::rename(tmp_posterior_file.c_str(), posterior_file.c_str()) != 0)) {
+      throw "unable to write " + posterior_file;
+    }
+  } else if (posterior.num_samples > checkpoint_posterior_samples) {
+    std::ofstream out_posterior(posterior_file.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+    if (! out_posterior.is_open()) {
+      throw "unable to write " + posterior_file;
+    }
+    posterior.writeSamples(out_posterior, checkpoint_posterior_samples);
+    out_posterior.close();
+    if (out_posterior.fail()) {
+      throw "unable to write " + posterior_file;
+    }
+  }
+  checkpoint_posterior_samples = posterior.num_samples;
+
+  // the file is replaced at once, so a run that is stopped while writing
+  // still has the previous checkpoint
+  std::string tmp_file = checkpoint_file + ".tmp";
+  std::ofstream out(tmp_file.c_str(), std::ios_base::out | std::ios_base::binary);
+  if (! out.is_open()) {
+    throw "unable to write " + tmp_file;
+  }
+  auto write = [&](const void* values, uint64 size) {
+    out.write(reinterpret_cast<const char*>(values), size);
+  };
+  fm_mcmc_checkpoint_header header;
+  header.id = FM_MCMC_CHECKPOINT_ID;
+  header.param_size = sizeof(FM_PARAM_FLOAT);
+  header.num_complete_iter = num_complete_iter;
+  header.num_attribute = fm->num_attribute;
+  header.num_factor = fm->num_factor;
+  header.num_attr_groups = meta->num_attr_groups;
+  header.num_train_cases = train.num_cases;
+  header.num_test_cases = test.num_cases;
+  header.num_validation_cases = pred_sum_validation.dim;
+  header.stopped = stopped;
+  header.keep_best = keep_best;
+  header.patience = patience;
+  header.min_delta = min_delta;
+  header.elapsed_time = getwalltime() - stop_start_time;
+  write(&header, sizeof(header));
+
+  // model and priors
+  write(&(fm->w0), sizeof(double));
+  write(fm->w.value, sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+  for (int f = 0; f < fm->num_factor; f++) {
+    write(fm->v.factor(f), sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+  }
+  write(&alpha, sizeof(double));
+  write(w_mu.value, sizeof(double) * w_mu.dim);
+  write(w_lambda.value, sizeof(double) * w_lambda.dim);
+  for (uint g = 0; g < meta->num_attr_groups; g++) {
+    write(v_mu.value[g], sizeof(double) * fm->num_factor);
+    write(v_lambda.value[g], sizeof(double) * fm->num_factor);
+  }
+
+  // predictions and e-terms
+  write(&num_sampled_iter, sizeof(uint));
+  write(pred_sum_all.value, sizeof(double) * test.num_cases);
+  write(pred_sum_all_but5.value, sizeof(double) * test.num_cases);
+  write(pred_sum_sqr_but5.value, sizeof(double) * test.num_cases);
+  write(pred_this.value, sizeof(double) * test.num_cases);
+  write(pred_sum_validation.value, sizeof(double) * pred_sum_validation.dim);
+  for (uint c = 0; c < train.num_cases; c++) {
+    write(&(cache[c].e), sizeof(double));
+  }
+
+  // stop criteria (the best parameters only for ALS with patience)
+  write(&best_loss, sizeof(double));
+  write(&best_iter, sizeof(int));
+  if (keep_best && (best_iter >= 0)) {
+    write(&best_w0, sizeof(double));
+    write(best_w.value, sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+    for (int f = 0; f < fm->num_factor; f++) {
+      write(best_v.factor(f), sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+    }
+    write(best_pred_this.value, sizeof(double) * test.num_cases);
+  }
+
+  write(&(ran_stream->state), sizeof(uint64));
+  write(&(posterior.num_samples), sizeof(uint));
+  out.close();
+  if (out.fail()) {
+    throw "unable to write " + tmp_file;
+  }
+  if (std::rename(tmp_file.c_str(), checkpoint_file.c_str()) != 0) {
+    throw "unable to write " + checkpoint_file;
+  }
+}
+
+uint fm_learn_mcmc::loadCheckpoint(Data& train, Data& test, std::vector<double>& cache_e, bool& stopped) {
+  stopped = false;
+  std::ifstream in(checkpoint_file.c_str(), std::ios_base::in | std::ios_base::binary);
+  if (! in.is_open()) {
+    std::cout << "No checkpoint " << checkpoint_file << ", learning starts with the first iteration." << std::endl;
+    return 0;
+  }
+  auto read = [&](void* values, uint64 size) {
+    in.read(reinterpret_cast<char*>(values), size);
+  };
+  fm_mcmc_checkpoint_header header;
+  read(&header, sizeof(header));
+  if (in.fail() || (header.id != FM_MCMC_CHECKPOINT_ID)) {
+    throw checkpoint_file + " is not a checkpoint of MCMC or ALS";
+  }
+  if ((header.param_size != sizeof(FM_PARAM_FLOAT)) || (header.num_attribute != fm->num_attribute) || (header.num_factor != (uint) fm->num_factor) || (header.num_attr_groups != meta->num_attr_groups) || (header.num_train_cases != train.num_cases) || (header.num_test_cases != test.num_cases) || (header.num_validation_cases != pred_sum_validation.dim)) {
+    throw "the checkpoint " + checkpoint_file + " does not match the data or the model";
+  }
+  if ((header.keep_best != (uint) keep_best) || (header.patience != patience) || (header.min_delta != min_delta)) {
+    throw "the checkpoint " + checkpoint_file + " was written with other stop criteria (-patience, -min_delta) or another method";
+  }
+
+  read(&(fm->w0), sizeof(double));
+  read(fm->w.value, sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+  for (int f = 0; f < fm->num_factor; f++) {
+    read(fm->v.factor(f), sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+  }
+  read(&alpha, sizeof(double));
+  read(w_mu.value, sizeof(double) * w_mu.dim);
+  read(w_lambda.value, sizeof(double) * w_lambda.dim);
+  for (uint g = 0; g < meta->num_attr_groups; g++) {
+    read(v_mu.value[g], sizeof(double) * fm->num_factor);
+    read(v_lambda.value[g], sizeof(double) * fm->num_factor);
+  }
+
+  read(&num_sampled_iter, sizeof(uint));
+  read(pred_sum_all.value, sizeof(double) * test.num_cases);
+  read(pred_sum_all_but5.value, sizeof(double) * test.num_cases);
+  read(pred_sum_sqr_but5.value, sizeof(double) * test.num_cases);
+  read(pred_this.value, sizeof(double) * test.num_cases);
+  read(pred_sum_validation.value, sizeof(double) * pred_sum_validation.dim);
+  cache_e.resize(train.num_cases);
+  read(cache_e.data(), sizeof(double) * train.num_cases);
+
+  read(&best_loss, sizeof(double));
+  read(&best_iter, sizeof(int));
+  if (keep_best && (best_iter >= 0)) {
+    read(&best_w0, sizeof(double));
+    best_w.setSize(fm->num_attribute);
+    read(best_w.value, sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+    best_v = fm->v;
+    for (int f = 0; f < fm->num_factor; f++) {
+      read(best_v.factor(f), sizeof(FM_PARAM_FLOAT) * fm->num_attribute);
+    }
+    best_pred_this.setSize(test.num_cases);
+    read(best_pred_this.value, sizeof(double) * test.num_cases);
+  }
+
+  read(&(ran_stream->state), sizeof(uint64));
+  uint num_posterior_samples;
+  read(&num_posterior_samples, sizeof(uint));
+  if (in.fail()) {
+    throw "the checkpoint " + checkpoint_file + " is incomplete";
+  }
+  if (num_posterior_samples > 0) {
+    std::string posterior_file = checkpoint_file + ".posterior";
+    std::ifstream in_posterior(posterior_file.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (! in_posterior.is_open() || ! posterior.readSamples(in_posterior, num_posterior_samples)) {
+      throw "the posterior samples " + posterior_file + " of the checkpoint are incomplete";
+    }
+  }
+  checkpoint_posterior_samples = 0;
+  if (min_param_change > 0) {
+    // the change of the first iteration after resuming is measured
+    // against the loaded parameters
+    prev_w0 = fm->w0;
+    prev_w.assign(fm->w);
+    prev_v = fm->v;
+  }
+  // the time budget (-max_time) includes the learning before the checkpoint
+  stop_start_time = getwalltime() - header.elapsed_time;
+  stop_last_time = getwalltime();
+  stopped = header.stopped;
+  if (stopped) {
+    std::cout << "The checkpoint " << checkpoint_file << " was written when learning stopped after iteration " << header.num_complete_iter - 1 << "; learning is not continued." << std::endl;
+  } else {
+    std::cout << "Resuming after iteration " << header.num_complete_iter - 1 << " from " << checkpoint_file << std::endl;
+  }
+  return header.num_complete_iter;
+}
+
 void fm_learn_mcmc::debug() {
   fm_learn::debug();
+  std::cout << "num_chains=" << num_chains << std::endl;
+  std::cout << "checkpoint_file=" << checkpoint_file << std::endl;
+  std::cout << "checkpoint_every=" << checkpoint_every << std::endl;
+  std::cout << "resume=" << resume << std::endl;
+  std::cout << "posterior_every=" << posterior_every << std::endl;
   std::cout << "do_multilevel=" << do_multilevel << std::endl;
   std::cout << "do_sampling=" << do_sample << std::endl;
   std::cout << "num_eval_cases=" << num_eval_cases << std::endl;
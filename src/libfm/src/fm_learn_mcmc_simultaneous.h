@@ -48,6 +48,7 @@ class fm_learn_mcmc_simultaneous : public fm_learn_mcmc {
   virtual ~fm_learn_mcmc_simultaneous() = default;
  protected:
   virtual void _learn(Data& train, Data& test);
+  virtual fm_learn_mcmc* createChain() { return new fm_learn_mcmc_simultaneous(); }
   void _evaluate(DVector<double>& pred, DVector<DATA_FLOAT>& target, double normalizer, double& rmse, double& mae, uint from_case, uint to_case);
   void _evaluate_class(DVector<double>& pred, DVector<DATA_FLOAT>& target, double normalizer, double& accuracy, double& loglikelihood, uint from_case, uint to_case);
   void _evaluate(DVector<double>& pred, DVector<DATA_FLOAT>& target, double normalizer, double& rmse, double& mae, uint& num_eval_cases);
@@ -67,6 +68,27 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
   main_cache(0) = cache;
   main_cache(1) = cache_test;
 
+  // the samples of MCMC are averaged, ALS can go back to the best iteration
+  keep_best = ! do_sample;
+  initStopCriteria();
+  if (patience > 0) {
+    if (validation == NULL) {
+      throw "the stop criterion -patience needs validation data (-validation)";
+    }
+    if (train.relation.dim > 0) {
+      throw "the stop criterion -patience does not support relations";
+    }
+    pred_validation.setSize(validation->num_cases);
+    pred_sum_validation.setSize(validation->num_cases);
+    pred_sum_validation.init(0.0);
+  } else {
+    pred_sum_validation.setSize(0);
+  }
+  std::vector<double> resume_e;
+  bool resume_stopped = false;
+  if (resume && (! checkpoint_file.empty())) {
+    num_complete_iter = loadCheckpoint(train, test, resume_e, resume_stopped);
+  }
 
   predict_data_and_write_to_eterms(main_data, main_cache);
   if (task == TASK_REGRESSION) {
@@ -86,8 +108,16 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
   } else {
     throw "unknown task";
   }
+  if (num_complete_iter > 0) {
+    // the e-terms after the last iteration, for classification they
+    // contain the sampled targets
+    for (uint c = 0; c < train.num_cases; c++) {
+      cache[c].e = resume_e[c];
+    }
+  }
 
-  for (uint i = num_complete_iter; i < num_iter; i++) {
+  // a run that was stopped by a stop criterion is not continued
+  for (uint i = num_complete_iter; (i < num_iter) && (! resume_stopped); i++) {
     double iteration_time = getusertime();
     clock_t iteration_time3 = clock();
     double iteration_time4 = getusertime4();
@@ -123,6 +153,9 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
     // predict test and train
     predict_data_and_write_to_eterms(main_data, main_cache);
     // (prediction of train is not necessary but it increases numerical stability)
+    if (do_sample && (posterior_every > 0) && (i >= 5) && ((i - 5) % posterior_every == 0)) {
+      posterior.add(*fm);
+    }
 
     double acc_train = 0.0;
     double rmse_train = 0.0;
@@ -136,6 +169,7 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
         pred_sum_all(c) += p;
         if (i >= 5) {
           pred_sum_all_but5(c) += p;
+          pred_sum_sqr_but5(c) += p*p;
         }
       }
 
@@ -159,6 +193,7 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
         pred_sum_all(c) += p;
         if (i >= 5) {
           pred_sum_all_but5(c) += p;
+          pred_sum_sqr_but5(c) += p*p;
         }
       }
 
@@ -212,13 +247,16 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
 
 
     // Evaluate the test data sets
+    double validation_loss = std::numeric_limits<double>::quiet_NaN();
     if (task == TASK_REGRESSION) {
       double rmse_test_this, mae_test_this, rmse_test_all, mae_test_all, rmse_test_all_but5, mae_test_all_but5;
        _evaluate(pred_this, test.target, 1.0, rmse_test_this, mae_test_this, num_eval_cases);
        _evaluate(pred_sum_all, test.target, 1.0/(i+1), rmse_test_all, mae_test_all, num_eval_cases);
        _evaluate(pred_sum_all_but5, test.target, 1.0/(i-5+1), rmse_test_all_but5, mae_test_all_but5, num_eval_cases);
 
-      std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test_all << std::endl;
+      if (print_progress) {
+        std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test_all << std::endl;
+      }
 
       if (log != NULL) {
         log->log("rmse", rmse_test_all);
@@ -243,7 +281,9 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
        _evaluate_class(pred_sum_all, test.target, 1.0/(i+1), acc_test_all, ll_test_all, num_eval_cases);
        _evaluate_class(pred_sum_all_but5, test.target, 1.0/(i-5+1), acc_test_all_but5, ll_test_all_but5, num_eval_cases);
 
-      std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << acc_train << "\tTest=" << acc_test_all << "\tTest(ll)=" << ll_test_all << std::endl;
+      if (print_progress) {
+        std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << acc_train << "\tTest=" << acc_test_all << "\tTest(ll)=" << ll_test_all << std::endl;
+      }
 
       if (log != NULL) {
         log->log("accuracy", acc_test_all);
@@ -268,6 +308,23 @@ void fm_learn_mcmc_simultaneous::_learn(Data& train, Data& test) {
     } else {
       throw "unknown task";
     }
+
+    if (patience > 0) {
+      validation_loss = evaluateValidation(i);
+    }
+    num_sampled_iter = i + 1;
+    bool stop = stopAfterIteration(i, validation_loss);
+    if (keep_best && isBestIteration(i)) {
+      best_pred_this = pred_this;
+    }
+    if ((! checkpoint_file.empty()) && (stop || ((i + 1) % checkpoint_every == 0) || (i + 1 == num_iter))) {
+      saveCheckpoint(i + 1, train, test, stop);
+    }
+    if (stop) { break; }
+  }
+  if (keep_best && (patience > 0) && (best_pred_this.dim == pred_this.dim)) {
+    restoreBestParameters();
+    pred_this = best_pred_this;
   }
 }
 
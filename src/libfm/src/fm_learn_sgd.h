@@ -27,15 +27,27 @@
 #ifndef FM_LEARN_SGD_H_
 #define FM_LEARN_SGD_H_
 
+#include <algorithm>
+#include <map>
+#include <random>
 #include "fm_learn.h"
 #include "../../fm_core/fm_sgd.h"
 
 class fm_learn_sgd: public fm_learn {
  public:
+  fm_learn_sgd();
   virtual ~fm_learn_sgd() = default;
   virtual void init();
   virtual void learn(Data& train, Data& test);
   void SGD(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+  // the two parts of SGD: the step for w0 and the step for w and v of x
+  virtual void SGD_w0(const double multiplier);
+  virtual void SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+  // one step with the mean gradient of the rows x[0], ..., x[num_rows-1];
+  // multiplier[r] and the num_factor values at sum + r*num_factor belong to
+  // row r and were computed with the parameters before the step. Every
+  // touched parameter is updated once.
+  void SGD_batch(sparse_row<DATA_FLOAT>* x, uint num_rows, const double* multiplier, const double* sum);
 
   void debug();
   virtual void predict(Data& data, DVector<double>& out);
@@ -43,9 +55,93 @@ class fm_learn_sgd: public fm_learn {
   int num_iter;
   double learn_rate;
   DVector<double> learn_rates;
+
+  // Shuffle the training rows in every epoch. Data in memory is permuted
+  // completely. Data on disk is read in a random order of its cache blocks
+  // and the rows of shuffle_buffer blocks at a time are mixed in memory
+  // (0: only the order of the blocks is random).
+  bool shuffle;
+  uint shuffle_buffer;
+
+  // Evaluation during learning:
+  // - eval_every:        the test and validation data is evaluated every
+  //                      eval_every-th iteration and after the last one
+  // - eval_sample:       held-out data is evaluated on a fixed random sample
+  //                      of at most eval_sample rows (0 = all rows)
+  // - progressive_train: the training measure is taken from the predictions
+  //                      that the SGD pass makes before the step of each row
+  //                      instead of an extra pass over the training data
+  int eval_every;
+  uint eval_sample;
+  bool progressive_train;
+
+ protected:
+  bool isEvalIteration(int iter) { return ((iter + 1) % eval_every == 0) || (iter + 1 == num_iter); }
+  // evaluate() on the eval_sample rows of data; the sample is drawn once.
+  // The measures are logged with log_suffix appended to their names, so the
+  // validation data does not overwrite the values of the test data.
+  double evaluateHeldOut(Data& data, const std::string& log_suffix = "");
+  // rmse or accuracy of sums over num_rows rows
+  double measure(const eval_sums& sums, uint64 num_rows);
+  void logHeldOut(const eval_sums& sums, uint64 num_rows, double eval_time, const std::string& log_suffix);
+
+  // fixed sample of held-out data; the rows point to entries
+  struct eval_sample_rows {
+    std::vector< sparse_row<DATA_FLOAT> > rows;
+    std::vector< sparse_entry<DATA_FLOAT> > entries;
+    std::vector<DATA_FLOAT> target;
+  };
+  std::map<Data*, eval_sample_rows> eval_samples;
+
+  // calls fn(rows, target, num_rows) one after another for blocks of rows
+  // that cover every training row once per epoch (in a random order with
+  // shuffle); target[r] is the target of rows[r]
+  void for_each_epoch_block(Data& train, const std::function<void(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows)>& fn);
+
+  std::mt19937 shuffle_random;
+  bool shuffle_random_seeded;
+  // shuffled rows and their targets; the rows point to the data in memory or
+  // to shuffle_entries
+  std::vector< sparse_row<DATA_FLOAT> > shuffle_rows;
+  std::vector<DATA_FLOAT> shuffle_target;
+  std::vector< sparse_entry<DATA_FLOAT> > shuffle_entries;
+  std::vector<uint> shuffle_order;
+
+  // Update of single parameters with the gradient of the loss (without the
+  // regularization); stepV gets the gradients of all factors of attribute i.
+  // SGD_batch uses these functions, so learners with another update rule
+  // only need to overwrite them (and SGD_w0/SGD_row, see SGD_row_steps).
+  virtual void stepW0(double grad);
+  virtual void stepW(uint i, double grad);
+  virtual void stepV(uint i, const double* grad);
+  // SGD_row by calls of stepW and stepV
+  void SGD_row_steps(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+
+  // entries of a mini-batch by attribute for SGD_batch: slot s holds the
+  // entries batch_entry[batch_slot_begin[s]] ... [batch_slot_begin[s+1]-1]
+  // of attribute batch_attr[s]; attributes that are not in the batch have
+  // slot -1
+  struct batch_entry_t {
+    uint row;
+    DATA_FLOAT value;
+  };
+  DVector<int> batch_slot;
+  std::vector<uint> batch_attr;
+  std::vector<uint> batch_slot_begin;
+  std::vector<uint> batch_slot_pos;
+  std::vector<batch_entry_t> batch_entry;
 };
 
 // Implementation
+fm_learn_sgd::fm_learn_sgd() {
+  shuffle = false;
+  shuffle_buffer = 1;
+  shuffle_random_seeded = false;
+  eval_every = 1;
+  eval_sample = 0;
+  progressive_train = false;
+}
+
 void fm_learn_sgd::init() {
   fm_learn::init();
   learn_rates.setSize(3);
@@ -65,19 +161,328 @@ void fm_learn_sgd::learn(Data& train, Data& test) {
   std::cout.flush();
 }
 
+double fm_learn_sgd::measure(const eval_sums& sums, uint64 num_rows) {
+  if (task == TASK_REGRESSION) {
+    return std::sqrt(sums.sum_sqr/num_rows);
+  }
+  return (double) sums.num_correct / (double) num_rows;
+}
+
+double fm_learn_sgd::evaluateHeldOut(Data& data, const std::string& log_suffix) {
+  double eval_time = getwalltime();
+  if ((eval_sample == 0) || (eval_sample >= data.data->getNumRows())) {
+    eval_sums sums = evaluate_parallel(data);
+    eval_time = (getwalltime() - eval_time);
+    logHeldOut(sums, data.data->getNumRows(), eval_time, log_suffix);
+    return measure(sums, data.data->getNumRows());
+  }
+  eval_sample_rows& sample = eval_samples[&data];
+  if (sample.rows.empty()) {
+    // selection sampling in one pass: row r is taken with probability
+    // (rows still needed) / (rows left); the seed is fixed so that the
+    // sample does not change the random numbers of learning
+    std::mt19937 sample_random(data.data->getNumRows());
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    uint num_rows = data.data->getNumRows();
+    std::vector<uint64> row_offset;
+    for_each_row_block(data, [&](sparse_row<DATA_FLOAT>* rows, uint block_rows, uint first_row) {
+      for (uint r = 0; r < block_rows; r++) {
+        uint needed = eval_sample - sample.rows.size();
+        if (uniform(sample_random) * (num_rows - (first_row + r)) < needed) {
+          row_offset.push_back(sample.entries.size());
+          sample.entries.insert(sample.entries.end(), rows[r].data, rows[r].data + rows[r].size);
+          sample.rows.push_back(rows[r]);
+          sample.target.push_back(data.target(first_row + r));
+        }
+      }
+    });
+    for (uint r = 0; r < sample.rows.size(); r++) {
+      sample.rows[r].data = sample.entries.data() + row_offset[r];
+    }
+  }
+
+  thread_pool.setNumThreads(num_threads);
+  uint num_rows = sample.rows.size();
+  uint num_blocks = (num_rows + FM_PREDICT_GRAIN_ROWS - 1) / FM_PREDICT_GRAIN_ROWS;
+  std::vector<eval_sums> block_sums(num_blocks);
+  thread_pool.parallel_for(0, num_rows, FM_PREDICT_GRAIN_ROWS, [&](uint64 row_begin, uint64 row_end, int thread) {
+    for (uint64 r = row_begin; r < row_end; r++) {
+      evaluate_prediction(fm->predict(sample.rows[r]), sample.target[r], block_sums[row_begin / FM_PREDICT_GRAIN_ROWS]);
+    }
+  });
+  eval_sums sums;
+  for (uint b = 0; b < num_blocks; b++) {
+    sums.sum_sqr += block_sums[b].sum_sqr;
+    sums.sum_abs += block_sums[b].sum_abs;
+    sums.num_correct += block_sums[b].num_correct;
+  }
+  eval_time = (getwalltime() - eval_time);
+  logHeldOut(sums, num_rows, eval_time, log_suffix);
+  return measure(sums, num_rows);
+}
+
+void fm_learn_sgd::logHeldOut(const eval_sums& sums, uint64 num_rows, double eval_time, const std::string& log_suffix) {
+  if (log == NULL) { return; }
+  if (task == TASK_REGRESSION) {
+    log->log("rmse" + log_suffix, measure(sums, num_rows));
+    log->log("mae" + log_suffix, sums.sum_abs/num_rows);
+  } else {
+    log->log("accuracy" + log_suffix, measure(sums, num_rows));
+  }
+  log->log("time_pred" + log_suffix, eval_time);
+}
+
+void fm_learn_sgd::for_each_epoch_block(Data& train, const std::function<void(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows)>& fn) {
+  if (! shuffle) {
+    for_each_row_block(train, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row) {
+      fn(rows, train.target.value + first_row, num_rows);
+    });
+    return;
+  }
+  if (! shuffle_random_seeded) {
+    // seeded from rand() so that -seed also fixes the order of the rows
+    shuffle_random.seed(rand());
+    shuffle_random_seeded = true;
+  }
+
+  LargeSparseMatrixMemory<DATA_FLOAT>* data_memory = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(train.data);
+  if (data_memory != NULL) {
+    // permutation of all rows; only the row headers are copied
+    uint num_rows = data_memory->data.dim;
+    shuffle_order.resize(num_rows);
+    for (uint r = 0; r < num_rows; r++) {
+      shuffle_order[r] = r;
+    }
+    std::shuffle(shuffle_order.begin(), shuffle_order.end(), shuffle_random);
+    shuffle_rows.resize(num_rows);
+    shuffle_target.resize(num_rows);
+    for (uint r = 0; r < num_rows; r++) {
+      shuffle_rows[r] = data_memory->data(shuffle_order[r]);
+      shuffle_target[r] = train.target(shuffle_order[r]);
+    }
+    fn(shuffle_rows.data(), shuffle_target.data(), num_rows);
+    return;
+  }
+
+  LargeSparseMatrixHD<DATA_FLOAT>* data_hd = dynamic_cast<LargeSparseMatrixHD<DATA_FLOAT>*>(train.data);
+  if (data_hd == NULL) {
+    throw "shuffling is not supported for this type of data";
+  }
+  // random order of the cache blocks
+  uint num_blocks = data_hd->getNumBlocks();
+  shuffle_order.resize(num_blocks);
+  for (uint b = 0; b < num_blocks; b++) {
+    shuffle_order[b] = b;
+  }
+  std::shuffle(shuffle_order.begin(), shuffle_order.end(), shuffle_random);
+  if (shuffle_buffer == 0) {
+    // the rows of a block are used directly from the cache
+    for (uint b = 0; b < num_blocks; b++) {
+      sparse_row<DATA_FLOAT>* rows;
+      uint num_rows = data_hd->readBlock(shuffle_order[b], rows);
+      fn(rows, train.target.value + data_hd->getBlockFirstRow(shuffle_order[b]), num_rows);
+    }
+    return;
+  }
+  // the rows of shuffle_buffer blocks are copied and mixed
+  std::vector<uint64> row_offset;
+  std::vector<uint> row_order;
+  std::vector< sparse_row<DATA_FLOAT> > buffer_rows;
+  std::vector<DATA_FLOAT> buffer_target;
+  for (uint b0 = 0; b0 < num_blocks; b0 += shuffle_buffer) {
+    buffer_rows.clear();
+    buffer_target.clear();
+    row_offset.clear();
+    shuffle_entries.clear();
+    for (uint b = b0; b < std::min(num_blocks, b0 + shuffle_buffer); b++) {
+      sparse_row<DATA_FLOAT>* rows;
+      uint num_rows = data_hd->readBlock(shuffle_order[b], rows);
+      uint first_row = data_hd->getBlockFirstRow(shuffle_order[b]);
+      for (uint r = 0; r < num_rows; r++) {
+        row_offset.push_back(shuffle_entries.size());
+        shuffle_entries.insert(shuffle_entries.end(), rows[r].data, rows[r].data + rows[r].size);
+        buffer_rows.push_back(rows[r]);
+        buffer_target.push_back(train.target(first_row + r));
+      }
+    }
+    uint num_rows = buffer_rows.size();
+    row_order.resize(num_rows);
+    for (uint r = 0; r < num_rows; r++) {
+      row_order[r] = r;
+    }
+    std::shuffle(row_order.begin(), row_order.end(), shuffle_random);
+    shuffle_rows.resize(num_rows);
+    shuffle_target.resize(num_rows);
+    for (uint r = 0; r < num_rows; r++) {
+      shuffle_rows[r] = buffer_rows[row_order[r]];
+      shuffle_rows[r].data = shuffle_entries.data() + row_offset[row_order[r]];
+      shuffle_target[r] = buffer_target[row_order[r]];
+    }
+    fn(shuffle_rows.data(), shuffle_target.data(), num_rows);
+  }
+}
+
 void fm_learn_sgd::SGD(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
-  fm_SGD(fm, learn_rate, x, multiplier, sum);
+  SGD_w0(multiplier);
+  SGD_row(x, multiplier, sum);
+}
+
+void fm_learn_sgd::SGD_w0(const double multiplier) {
+  fm_SGD_w0(fm, learn_rate, multiplier);
+}
+
+void fm_learn_sgd::SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  fm_SGD_row(fm, learn_rate, x, multiplier, sum);
+}
+
+void fm_learn_sgd::stepW0(double grad) {
+  if (fm->k0) {
+    fm->w0 -= learn_rate * (grad + fm->reg0 * fm->w0);
+  }
+}
+
+void fm_learn_sgd::stepW(uint i, double grad) {
+  FM_PARAM_FLOAT& w = fm->w(i);
+  w -= learn_rate * (grad + fm->regw * w);
+}
+
+void fm_learn_sgd::stepV(uint i, const double* grad) {
+  if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    FM_PARAM_FLOAT* v_i = fm->v.attribute(i);
+    for (int f = 0; f < fm->num_factor; f++) {
+      v_i[f] -= learn_rate * (grad[f] + fm->regv * v_i[f]);
+    }
+  } else {
+    for (int f = 0; f < fm->num_factor; f++) {
+      FM_PARAM_FLOAT& v = fm->v(f, i);
+      v -= learn_rate * (grad[f] + fm->regv * v);
+    }
+  }
+}
+
+void fm_learn_sgd::SGD_row_steps(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  alignas(FM_CACHE_LINE_SIZE) double stack_grad[FM_PREDICT_STACK_FACTORS];
+  double* grad = stack_grad;
+  if (fm->num_factor > FM_PREDICT_STACK_FACTORS) {
+    thread_local std::vector<double> large_grad;
+    large_grad.resize(fm->num_factor);
+    grad = large_grad.data();
+  }
+  for (uint i = 0; i < x.size; i++) {
+    uint attr_id = x.data[i].id;
+    double x_i = x.data[i].value;
+    if (fm->k1) {
+      stepW(attr_id, multiplier * x_i);
+    }
+    for (int f = 0; f < fm->num_factor; f++) {
+      grad[f] = multiplier * (sum(f) * x_i - (double) fm->v(f, attr_id) * x_i * x_i);
+    }
+    stepV(attr_id, grad);
+  }
+}
+
+void fm_learn_sgd::SGD_batch(sparse_row<DATA_FLOAT>* x, uint num_rows, const double* multiplier, const double* sum) {
+  if (num_rows == 0) { return; }
+  const int num_factor = fm->num_factor;
+  if (fm->k0) {
+    double grad = 0;
+    for (uint r = 0; r < num_rows; r++) {
+      grad += multiplier[r];
+    }
+    stepW0(grad / num_rows);
+  }
+
+  // one slot per distinct attribute in the order of the first occurrence;
+  // the entries of the batch are sorted by slot and within a slot by row
+  if (batch_slot.dim != fm->num_attribute) {
+    batch_slot.setSize(fm->num_attribute);
+    batch_slot.init(-1);
+  }
+  batch_attr.clear();
+  batch_slot_begin.assign(1, 0);
+  for (uint r = 0; r < num_rows; r++) {
+    for (uint i = 0; i < x[r].size; i++) {
+      uint attr_id = x[r].data[i].id;
+      if (batch_slot(attr_id) < 0) {
+        batch_slot(attr_id) = batch_attr.size();
+        batch_attr.push_back(attr_id);
+        batch_slot_begin.push_back(0);
+      }
+      batch_slot_begin[batch_slot(attr_id) + 1]++;
+    }
+  }
+  uint num_slots = batch_attr.size();
+  for (uint slot = 0; slot < num_slots; slot++) {
+    batch_slot_begin[slot + 1] += batch_slot_begin[slot];
+  }
+  batch_entry.resize(batch_slot_begin[num_slots]);
+  batch_slot_pos.assign(batch_slot_begin.begin(), batch_slot_begin.end() - 1);
+  for (uint r = 0; r < num_rows; r++) {
+    for (uint i = 0; i < x[r].size; i++) {
+      batch_entry[batch_slot_pos[batch_slot(x[r].data[i].id)]++] = { r, x[r].data[i].value };
+    }
+  }
+
+  // Every slot sums up its gradients over its entries in row order, so the
+  // sums do not depend on the number of threads. The gradient of a slot only
+  // depends on its own parameters, so it is updated right away.
+  thread_pool.parallel_for(0, num_slots, FM_PREDICT_GRAIN_ROWS, [&](uint64 slot_begin, uint64 slot_end, int thread) {
+    alignas(FM_CACHE_LINE_SIZE) double stack_grad[FM_PREDICT_STACK_FACTORS];
+    double* grad_v = stack_grad;
+    if (num_factor > FM_PREDICT_STACK_FACTORS) {
+      thread_local std::vector<double> large_grad;
+      large_grad.resize(num_factor);
+      grad_v = large_grad.data();
+    }
+    for (uint64 slot = slot_begin; slot < slot_end; slot++) {
+      uint attr_id = batch_attr[slot];
+      double grad_w = 0;
+      for (int f = 0; f < num_factor; f++) {
+        grad_v[f] = 0;
+      }
+      for (uint j = batch_slot_begin[slot]; j < batch_slot_begin[slot + 1]; j++) {
+        uint r = batch_entry[j].row;
+        double x_i = batch_entry[j].value;
+        const double* sum_r = sum + (uint64) r * num_factor;
+        grad_w += multiplier[r] * x_i;
+        if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+          fm_dispatch_num_factor(num_factor, [&](auto k) {
+            const int nf = (decltype(k)::value > 0) ? decltype(k)::value : num_factor;
+            const FM_PARAM_FLOAT* v_i = fm->v.attribute(attr_id);
+            for (int f = 0; f < nf; f++) {
+              grad_v[f] += multiplier[r] * (sum_r[f] * x_i - (double) v_i[f] * x_i * x_i);
+            }
+          });
+        } else {
+          for (int f = 0; f < num_factor; f++) {
+            grad_v[f] += multiplier[r] * (sum_r[f] * x_i - (double) fm->v(f, attr_id) * x_i * x_i);
+          }
+        }
+      }
+      if (fm->k1) {
+        stepW(attr_id, grad_w / num_rows);
+      }
+      for (int f = 0; f < num_factor; f++) {
+        grad_v[f] /= num_rows;
+      }
+      stepV(attr_id, grad_v);
+      batch_slot(attr_id) = -1;
+    }
+  });
 }
 
 void fm_learn_sgd::debug() {
   std::cout << "num_iter=" << num_iter << std::endl;
+  std::cout << "eval_every=" << eval_every << std::endl;
+  std::cout << "eval_sample=" << eval_sample << std::endl;
+  std::cout << "progressive_train=" << progressive_train << std::endl;
   fm_learn::debug();
 }
 
 void fm_learn_sgd::predict(Data& data, DVector<double>& out) {
-  assert(data.data->getNumRows() == out.dim);
-  for (data.data->begin(); !data.data->end(); data.data->next()) {
-    double p = predict_case(data);
+  predict_batch(data, out, num_threads);
+  for (uint i = 0; i < out.dim; i++) {
+    double p = out(i);
     if (task == TASK_REGRESSION ) {
       p = std::min(max_target, p);
       p = std::max(min_target, p);
@@ -86,7 +491,7 @@ void fm_learn_sgd::predict(Data& data, DVector<double>& out) {
     } else {
       throw "task not supported";
     }
-    out(data.data->getRowIndex()) = p;
+    out(i) = p;
   }
 }
 
@@ -0,0 +1,338 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//
+// fm_learn_sgd_bpr.h: Stochastic Gradient Descent based learning for
+// pairwise ranking from implicit feedback (BPR)
+//
+// Based on the publication(s):
+// - Steffen Rendle, Christoph Freudenthaler, Zeno Gantner, Lars
+//   Schmidt-Thieme (2009): BPR: Bayesian Personalized Ranking from Implicit
+//   Feedback, in Proceedings of the 25th Conference on Uncertainty in
+//   Artificial Intelligence (UAI 2009), Montreal, Canada.
+//
+// Every training row with a positive target is an observed (context, item)
+// pair. The item is the attribute of the row in the attribute group
+// item_group (-meta), all other attributes are the context. For a positive
+// row x a negative row x' is built by replacing its item with an item that is
+// sampled by popularity^neg_exponent from an alias table, and
+//   theta' = theta + alpha * (sigma(y(x') - y(x)) * grad_theta(y(x) - y(x')) - lambda*theta)
+// The rows are processed in parallel with lock-free updates (hogwild).
+
+#ifndef FM_LEARN_SGD_BPR_H_
+#define FM_LEARN_SGD_BPR_H_
+
+#include <cmath>
+#include <mutex>
+#include <vector>
+#include "fm_learn_sgd.h"
+#include "../../util/alias_table.h"
+
+class fm_learn_sgd_bpr: public fm_learn_sgd {
+ public:
+  fm_learn_sgd_bpr();
+  virtual ~fm_learn_sgd_bpr() = default;
+  virtual void init();
+  virtual void learn(Data& train, Data& test);
+  // share of the positive rows of data that are ranked above a sampled
+  // negative row (sampled AUC); the negatives are the same in every call
+  virtual double evaluate(Data& data);
+  // scores of the rows
+  virtual void predict(Data& data, DVector<double>& out);
+  void debug();
+
+  int item_group; // attribute group of the items; -1 = the last group
+  double neg_exponent; // 0 = uniform, 1 = proportional to the popularity
+
+ protected:
+  // attribute id of the item of x; -1 if x has no item
+  int rowItem(const sparse_row<DATA_FLOAT>& x);
+  // index into items of a sampled negative item that is not the item pos_item
+  int sampleNegative(int pos_item, uint64& random_state);
+  // x with its item replaced by the attribute neg_item
+  void makeNegative(const sparse_row<DATA_FLOAT>& x, uint neg_item, std::vector< sparse_entry<DATA_FLOAT> >& entries, sparse_row<DATA_FLOAT>& x_neg);
+  // SGD step for the positive row x; returns 1 if x was ranked above the
+  // negative, 0.5 for a tie and 0 else (-1 if no pair could be built)
+  double learnPair(sparse_row<DATA_FLOAT>& x, uint64& random_state, int thread);
+  void buildSampler(Data& train);
+  // 1 - sampled AUC
+  virtual double validationLoss(Data& data);
+
+  std::vector<uint> items; // attribute ids of the items
+  AliasTable item_sampler; // samples an index into items
+  uint64 eval_seed;
+
+  // scratch per thread
+  DVector< DVector<double> > thread_sum_pos, thread_sum_neg, thread_sum_sqr;
+  std::vector<fm_pair_scratch> thread_pair;
+  std::vector< std::vector< sparse_entry<DATA_FLOAT> > > thread_neg_entries;
+  std::vector<uint64> thread_random;
+  // w0 only gets the regularization steps, which every thread applies once
+  // per range of rows
+  std::mutex w0_mutex;
+};
+
+// Implementation
+fm_learn_sgd_bpr::fm_learn_sgd_bpr() {
+  item_group = -1;
+  neg_exponent = 1.0;
+  eval_seed = 0;
+}
+
+void fm_learn_sgd_bpr::init() {
+  fm_learn_sgd::init();
+
+  if (log != NULL) {
+    log->addField("auc_train", std::numeric_limits<double>::quiet_NaN());
+    log->addField("auc_test", std::numeric_limits<double>::quiet_NaN());
+  }
+}
+
+int fm_learn_sgd_bpr::rowItem(const sparse_row<DATA_FLOAT>& x) {
+  for (uint i = 0; i < x.size; i++) {
+    if ((int) meta->attr_group(x.data[i].id) == item_group) {
+      return x.data[i].id;
+    }
+  }
+  return -1;
+}
+
+void fm_learn_sgd_bpr::buildSampler(Data& train) {
+  if (meta->num_attr_groups < 2) {
+    throw "BPR needs the attribute groups (-meta) to tell the items from the context";
+  }
+  if (item_group < 0) {
+    item_group = meta->num_attr_groups - 1;
+  }
+  if (item_group >= (int) meta->num_attr_groups) {
+    throw "unknown item group " + std::to_string(item_group);
+  }
+  // popularity = number of positive training rows of an item
+  DVector<int> item_index;
+  item_index.setSize(fm->num_attribute);
+  item_index.init(-1);
+  items.clear();
+  for (uint i = 0; i < fm->num_attribute; i++) {
+    if ((int) meta->attr_group(i) == item_group) {
+      item_index(i) = items.size();
+      items.push_back(i);
+    }
+  }
+  if (items.size() < 2) {
+    throw "BPR needs at least two items";
+  }
+  if (neg_exponent < 0) {
+    throw "the exponent of the negative sampling must not be negative";
+  }
+  std::vector<double> popularity(items.size(), 0.0);
+  for_each_row_block(train, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row) {
+    for (uint r = 0; r < num_rows; r++) {
+      int item = rowItem(rows[r]);
+      if ((item >= 0) && (train.target(first_row + r) > 0)) {
+        popularity[item_index(item)]++;
+      }
+    }
+  });
+  std::vector<double> weight(items.size());
+  for (uint j = 0; j < items.size(); j++) {
+    weight[j] = std::pow(popularity[j], neg_exponent);
+  }
+  item_sampler.init(weight);
+  std::cout << "BPR: " << items.size() << " items in attribute group " << item_group << ", negatives sampled by popularity^" << neg_exponent << std::endl;
+}
+
+int fm_learn_sgd_bpr::sampleNegative(int pos_item, uint64& random_state) {
+  // a few tries to avoid the positive item
+  for (int t = 0; t < 10; t++) {
+    uint item = items[item_sampler.sample(ran_splitmix64(random_state))];
+    if ((int) item != pos_item) {
+      return item;
+    }
+  }
+  return -1;
+}
+
+void fm_learn_sgd_bpr::makeNegative(const sparse_row<DATA_FLOAT>& x, uint neg_item, std::vector< sparse_entry<DATA_FLOAT> >& entries, sparse_row<DATA_FLOAT>& x_neg) {
+  entries.clear();
+  bool has_item = false;
+  for (uint i = 0; i < x.size; i++) {
+    if ((int) meta->attr_group(x.data[i].id) != item_group) {
+      entries.push_back(x.data[i]);
+    } else if (! has_item) {
+      sparse_entry<DATA_FLOAT> e = x.data[i];
+      e.id = neg_item;
+      entries.push_back(e);
+      has_item = true;
+    }
+  }
+  x_neg.data = entries.data();
+  x_neg.size = entries.size();
+}
+
+double fm_learn_sgd_bpr::learnPair(sparse_row<DATA_FLOAT>& x, uint64& random_state, int thread) {
+  int pos_item = rowItem(x);
+  if (pos_item < 0) { return -1; }
+  int neg_item = sampleNegative(pos_item, random_state);
+  if (neg_item < 0) { return -1; }
+  sparse_row<DATA_FLOAT> x_neg;
+  makeNegative(x, neg_item, thread_neg_entries[thread], x_neg);
+  DVector<double>& sum_pos = thread_sum_pos(thread);
+  DVector<double>& sum_neg = thread_sum_neg(thread);
+  double diff = fm->predict(x, sum_pos, thread_sum_sqr(thread)) - fm->predict(x_neg, sum_neg, thread_sum_sqr(thread));
+  // derivative of -ln sigma(diff)
+  double mult = -1.0 / (1.0 + exp(diff));
+  fm_pairSGD(fm, learn_rate, x, x_neg, mult, sum_pos, sum_neg, thread_pair[thread]);
+  return (diff > 0) ? 1.0 : ((diff == 0) ? 0.5 : 0.0);
+}
+
+double fm_learn_sgd_bpr::evaluate(Data& data) {
+  if (items.empty()) {
+    throw "BPR: the model has not been trained";
+  }
+  thread_pool.setNumThreads(num_threads);
+  // per thread: sum of the pair results and number of pairs
+  std::vector<double> correct(thread_pool.getNumThreads(), 0.0);
+  std::vector<uint64> num_pairs(thread_pool.getNumThreads(), 0);
+  std::vector< std::vector< sparse_entry<DATA_FLOAT> > > neg_entries(thread_pool.getNumThreads());
+  parallel_for_rows(data, [&](sparse_row<DATA_FLOAT>* rows, uint num_rows, uint first_row, int thread) {
+    for (uint r = 0; r < num_rows; r++) {
+      if (! (data.target(first_row + r) > 0)) { continue; }
+      int pos_item = rowItem(rows[r]);
+      if (pos_item < 0) { continue; }
+      // the negative of a row only depends on the row index
+      uint64 random_state = eval_seed ^ ((uint64) (first_row + r) * 0x9E3779B97F4A7C15ULL);
+      int neg_item = sampleNegative(pos_item, random_state);
+      if (neg_item < 0) { continue; }
+      sparse_row<DATA_FLOAT> x_neg;
+      makeNegative(rows[r], neg_item, neg_entries[thread], x_neg);
+      double diff = fm->predict(rows[r]) - fm->predict(x_neg);
+      correct[thread] += (diff > 0) ? 1.0 : ((diff == 0) ? 0.5 : 0.0);
+      num_pairs[thread]++;
+    }
+  });
+  double sum_correct = 0;
+  uint64 sum_pairs = 0;
+  for (uint t = 0; t < correct.size(); t++) {
+    sum_correct += correct[t];
+    sum_pairs += num_pairs[t];
+  }
+  if (sum_pairs == 0) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return sum_correct / sum_pairs;
+}
+
+double fm_learn_sgd_bpr::validationLoss(Data& data) {
+  return 1.0 - evaluate(data);
+}
+
+void fm_learn_sgd_bpr::predict(Data& data, DVector<double>& out) {
+  predict_batch(data, out, num_threads);
+}
+
+void fm_learn_sgd_bpr::learn(Data& train, Data& test) {
+  fm_learn_sgd::learn(train, test);
+
+  std::cout << "Training using BPR." << std::endl;
+  buildSampler(train);
+  eval_seed = rand();
+  thread_pool.setNumThreads(num_threads);
+  int num_threads_pool = thread_pool.getNumThreads();
+  if (num_threads_pool > 1) {
+    std::cout << "BPR: lock-free parallel updates (hogwild) with " << num_threads_pool << " threads." << std::endl;
+  }
+  thread_sum_pos.setSize(num_threads_pool);
+  thread_sum_neg.setSize(num_threads_pool);
+  thread_sum_sqr.setSize(num_threads_pool);
+  thread_pair.resize(num_threads_pool);
+  thread_neg_entries.resize(num_threads_pool);
+  thread_random.resize(num_threads_pool);
+  for (int t = 0; t < num_threads_pool; t++) {
+    thread_sum_pos(t).setSize(fm->num_factor);
+    thread_sum_neg(t).setSize(fm->num_factor);
+    thread_sum_sqr(t).setSize(fm->num_factor);
+    thread_random[t] = ((uint64) rand() << 32) ^ rand();
+  }
+
+  if ((patience > 0) && (validation == NULL)) {
+    throw "the stop criterion -patience needs validation data (-validation)";
+  }
+  initStopCriteria();
+  for (int i = 0; i < num_iter; i++) {
+    double iteration_time = getwalltime();
+    std::vector<double> correct(num_threads_pool, 0.0);
+    std::vector<uint64> num_pairs(num_threads_pool, 0);
+    for_each_epoch_block(train, [&](sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+      thread_pool.parallel_for(0, num_rows, FM_PREDICT_GRAIN_ROWS, [&](uint64 row_begin, uint64 row_end, int thread) {
+        uint64 random_state = thread_random[thread];
+        double range_correct = 0;
+        uint64 range_pairs = 0;
+        for (uint64 r = row_begin; r < row_end; r++) {
+          if (! (target[r] > 0)) { continue; }
+          double result = learnPair(rows[r], random_state, thread);
+          if (result >= 0) {
+            range_correct += result;
+            range_pairs++;
+          }
+        }
+        thread_random[thread] = random_state;
+        if (fm->k0 && (range_pairs > 0)) {
+          std::lock_guard<std::mutex> lock(w0_mutex);
+          fm->w0 *= std::pow(1.0 - learn_rate * fm->reg0, (double) range_pairs);
+        }
+        correct[thread] += range_correct;
+        num_pairs[thread] += range_pairs;
+      });
+    });
+    iteration_time = (getwalltime() - iteration_time);
+
+    // the training measure is collected during the epoch
+    double sum_correct = 0;
+    uint64 sum_pairs = 0;
+    for (int t = 0; t < num_threads_pool; t++) {
+      sum_correct += correct[t];
+      sum_pairs += num_pairs[t];
+    }
+    double auc_train = (sum_pairs > 0) ? (sum_correct / sum_pairs) : std::numeric_limits<double>::quiet_NaN();
+    bool eval_iteration = isEvalIteration(i);
+    double auc_test = eval_iteration ? evaluate(test) : std::numeric_limits<double>::quiet_NaN();
+    std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << auc_train;
+    if (eval_iteration) {
+      std::cout << "\tTest=" << auc_test;
+    }
+    std::cout << std::endl;
+    if (log != NULL) {
+      log->log("auc_train", auc_train);
+      log->log("auc_test", auc_test);
+      log->log("time_learn", iteration_time);
+      log->newLine();
+    }
+    double validation_loss = ((patience > 0) && eval_iteration) ? validationLoss(*validation) : std::numeric_limits<double>::quiet_NaN();
+    if (stopAfterIteration(i, validation_loss)) { break; }
+  }
+  restoreBestParameters();
+}
+
+void fm_learn_sgd_bpr::debug() {
+  std::cout << "item_group=" << item_group << std::endl;
+  std::cout << "neg_exponent=" << neg_exponent << std::endl;
+  fm_learn_sgd::debug();
+}
+
+#endif /*FM_LEARN_SGD_BPR_H_*/
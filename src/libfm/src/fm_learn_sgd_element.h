@@ -28,54 +28,323 @@
 #ifndef FM_LEARN_SGD_ELEMENT_H_
 #define FM_LEARN_SGD_ELEMENT_H_
 
+#include <mutex>
 #include "fm_learn_sgd.h"
 
+// number of rows of a round of the partitioned schedule or of a mini-batch
+// that are handed to a thread at once
+const uint FM_PARTITION_GRAIN_ROWS = 64;
+// hogwild: number of rows after which a thread applies its steps of w0
+const uint FM_HOGWILD_W0_ROWS = 16;
+
 class fm_learn_sgd_element: public fm_learn_sgd {
  public:
+  fm_learn_sgd_element();
   virtual ~fm_learn_sgd_element() = default;
   virtual void init();
   virtual void learn(Data& train, Data& test);
+
+  // how the rows are processed with more than one thread
+  // - hogwild:     ranges of rows in parallel, lock-free updates
+  // - partitioned: rounds of rows without common attributes; the result does
+  //                not depend on the number of threads (for data on disk or
+  //                with shuffling the rounds are built for every block)
+  const static int PARALLEL_HOGWILD = 0;
+  const static int PARALLEL_PARTITIONED = 1;
+  int parallel;
+
+  // number of rows per SGD step; with more than one row the predictions of a
+  // batch are computed in parallel and the parameters are updated once per
+  // batch (deterministic for any number of threads)
+  uint batch_size;
+
+ protected:
+  // the learner keeps state per parameter (moments, step counts), which
+  // lock-free updates would corrupt; hogwild is replaced by partitioned
+  bool parameter_state;
+
+  // SGD step for one row; returns the multiplier of the gradient and adds
+  // the error of the prediction before the step to progress
+  double learnRow(sparse_row<DATA_FLOAT>& x, DATA_FLOAT target, DVector<double>& sum, DVector<double>& sum_sqr, bool update_w0, eval_sums& progress);
+  // derivative of the loss with respect to the prediction p
+  double lossMultiplier(double p, DATA_FLOAT target);
+  // SGD steps for all rows of a block; target[r] is the target of rows[r]
+  void learnBlockBatch(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows);
+  void learnBlockHogwild(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows);
+  void learnBlockPartitioned(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows);
+  void buildPartition(sparse_row<DATA_FLOAT>* rows, uint num_rows);
+
+  DVector< DVector<double> > thread_sum, thread_sum_sqr;
+  // progressive evaluation of the current epoch, one per thread
+  std::vector<eval_sums> thread_progress;
+  // hogwild: multipliers of the rows of a range for the steps of w0
+  std::vector< std::vector<double> > thread_w0_mult;
+  std::mutex w0_mutex;
+
+  // rows of the partitioned schedule: round r consists of the rows
+  // partition_row[partition_round(r)] ... partition_row[partition_round(r+1)-1]
+  DVector<uint> partition_row;
+  std::vector<uint> partition_round;
+  DVector<double> partition_mult;
+  // the block of the partition; NULL if it has to be built for every block
+  sparse_row<DATA_FLOAT>* partition_rows;
+  DVector<uint> attr_next_round;
+
+  std::vector<double> batch_mult;
+  std::vector<double> batch_sum; // num_factor values per row of the batch
 };
 
 // Implementation
+fm_learn_sgd_element::fm_learn_sgd_element() {
+  parallel = PARALLEL_HOGWILD;
+  batch_size = 1;
+  partition_rows = NULL;
+  parameter_state = false;
+}
+
 void fm_learn_sgd_element::init() {
   fm_learn_sgd::init();
 
   if (log != NULL) {
     log->addField("rmse_train", std::numeric_limits<double>::quiet_NaN());
+    if ((patience > 0) && (validation != NULL)) {
+      if (task == TASK_REGRESSION) {
+        log->addField("rmse_validation", std::numeric_limits<double>::quiet_NaN());
+        log->addField("mae_validation", std::numeric_limits<double>::quiet_NaN());
+      } else {
+        log->addField("accuracy_validation", std::numeric_limits<double>::quiet_NaN());
+      }
+      log->addField("time_pred_validation", std::numeric_limits<double>::quiet_NaN());
+    }
+  }
+}
+
+double fm_learn_sgd_element::lossMultiplier(double p, DATA_FLOAT target) {
+  double mult = 0;
+  if (task == 0) {
+    p = std::min(max_target, p);
+    p = std::max(min_target, p);
+    mult = -(target-p);
+  } else if (task == 1) {
+    mult = -target*(1.0-1.0/(1.0+exp(-target*p)));
+  }
+  return mult;
+}
+
+double fm_learn_sgd_element::learnRow(sparse_row<DATA_FLOAT>& x, DATA_FLOAT target, DVector<double>& sum, DVector<double>& sum_sqr, bool update_w0, eval_sums& progress) {
+  double p = fm->predict(x, sum, sum_sqr);
+  evaluate_prediction(p, target, progress);
+  double mult = lossMultiplier(p, target);
+  if (update_w0) {
+    SGD(x, mult, sum);
+  } else {
+    SGD_row(x, mult, sum);
+  }
+  return mult;
+}
+
+void fm_learn_sgd_element::learnBlockHogwild(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+  // The threads work on different ranges of rows and update the shared
+  // parameters without locks. Rows of sparse data rarely share parameters,
+  // so conflicting updates are rare and only lose a single step. But w0 is
+  // shared by all rows, so with several threads every thread collects the
+  // steps of w0 and applies them every FM_HOGWILD_W0_ROWS rows in row order
+  // under a lock.
+  const bool shared_w0 = (thread_pool.getNumThreads() > 1);
+  thread_pool.parallel_for(0, num_rows, FM_PREDICT_GRAIN_ROWS, [&](uint64 row_begin, uint64 row_end, int thread) {
+    std::vector<double>& w0_mult = thread_w0_mult[thread];
+    for (uint64 r = row_begin; r < row_end; r++) {
+      double mult = learnRow(rows[r], target[r], thread_sum(thread), thread_sum_sqr(thread), ! shared_w0, thread_progress[thread]);
+      if (! shared_w0) { continue; }
+      w0_mult.push_back(mult);
+      if ((w0_mult.size() == FM_HOGWILD_W0_ROWS) || (r + 1 == row_end)) {
+        std::lock_guard<std::mutex> lock(w0_mutex);
+        for (uint j = 0; j < w0_mult.size(); j++) {
+          SGD_w0(w0_mult[j]);
+        }
+        w0_mult.clear();
+      }
+    }
+  });
+}
+
+void fm_learn_sgd_element::buildPartition(sparse_row<DATA_FLOAT>* rows, uint num_rows) {
+  // A row is put in the round after the last round that contains one of its
+  // attributes. So the rows of a round have no attribute in common and every
+  // parameter w_i, v_i is updated by the same rows in the same order as in a
+  // sequential pass.
+  DVector<uint> row_round;
+  row_round.setSize(num_rows);
+  if (attr_next_round.dim != fm->num_attribute) {
+    attr_next_round.setSize(fm->num_attribute);
+    attr_next_round.init(0);
+  }
+  uint num_rounds = 0;
+  for (uint r = 0; r < num_rows; r++) {
+    sparse_row<DATA_FLOAT>& x = rows[r];
+    uint round = 0;
+    for (uint i = 0; i < x.size; i++) {
+      round = std::max(round, attr_next_round(x.data[i].id));
+    }
+    for (uint i = 0; i < x.size; i++) {
+      attr_next_round(x.data[i].id) = round + 1;
+    }
+    row_round(r) = round;
+    num_rounds = std::max(num_rounds, round + 1);
+  }
+  // reset only the attributes of the block for the next one
+  for (uint r = 0; r < num_rows; r++) {
+    for (uint i = 0; i < rows[r].size; i++) {
+      attr_next_round(rows[r].data[i].id) = 0;
+    }
+  }
+  // sort the rows by round, within a round by row index
+  partition_round.assign(num_rounds + 1, 0);
+  for (uint r = 0; r < row_round.dim; r++) {
+    partition_round[row_round(r) + 1]++;
+  }
+  for (uint k = 0; k < num_rounds; k++) {
+    partition_round[k + 1] += partition_round[k];
+  }
+  partition_row.setSize(row_round.dim);
+  std::vector<uint> pos(partition_round.begin(), partition_round.end() - 1);
+  for (uint r = 0; r < row_round.dim; r++) {
+    partition_row(pos[row_round(r)]++) = r;
+  }
+  partition_mult.setSize(row_round.dim);
+}
+
+void fm_learn_sgd_element::learnBlockPartitioned(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+  if (rows != partition_rows) {
+    buildPartition(rows, num_rows);
+  }
+  for (uint k = 0; k + 1 < partition_round.size(); k++) {
+    // All rows of a round see the same w0; the steps for w0 are applied
+    // after the round in row order.
+    thread_pool.parallel_for(partition_round[k], partition_round[k + 1], FM_PARTITION_GRAIN_ROWS, [&](uint64 begin, uint64 end, int thread) {
+      for (uint64 j = begin; j < end; j++) {
+        uint r = partition_row(j);
+        partition_mult(j) = learnRow(rows[r], target[r], thread_sum(thread), thread_sum_sqr(thread), false, thread_progress[thread]);
+      }
+    });
+    for (uint j = partition_round[k]; j < partition_round[k + 1]; j++) {
+      SGD_w0(partition_mult(j));
+    }
+  }
+}
+
+void fm_learn_sgd_element::learnBlockBatch(sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+  const int num_factor = fm->num_factor;
+  batch_mult.resize(batch_size);
+  batch_sum.resize((uint64) batch_size * num_factor);
+  for (uint b = 0; b < num_rows; b += batch_size) {
+    uint n = std::min(batch_size, num_rows - b);
+    // predict the whole batch with the parameters before the step
+    thread_pool.parallel_for(0, n, FM_PARTITION_GRAIN_ROWS, [&](uint64 begin, uint64 end, int thread) {
+      for (uint64 r = begin; r < end; r++) {
+        double p = fm->predict(rows[b + r], batch_sum.data() + r * num_factor, thread_sum_sqr(thread).value);
+        batch_mult[r] = lossMultiplier(p, target[b + r]);
+        evaluate_prediction(p, target[b + r], thread_progress[thread]);
+      }
+    });
+    SGD_batch(rows + b, n, batch_mult.data(), batch_sum.data());
   }
 }
 
 void fm_learn_sgd_element::learn(Data& train, Data& test) {
   fm_learn_sgd::learn(train, test);
 
-  std::cout << "SGD: DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING DATA TO GET THE BEST RESULTS." << std::endl;
+  if (shuffle) {
+    std::cout << "SGD: shuffling the rows in every iteration." << std::endl;
+  } else {
+    std::cout << "SGD: DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING DATA (-shuffle) TO GET THE BEST RESULTS." << std::endl;
+  }
+  thread_pool.setNumThreads(num_threads);
+  partition_rows = NULL;
+  if ((batch_size > 1) && (parallel == PARALLEL_PARTITIONED)) {
+    throw "-batch_size > 1 cannot be combined with -sgd_parallel partitioned";
+  }
+  if (parameter_state && (parallel == PARALLEL_HOGWILD) && (batch_size == 1) && (thread_pool.getNumThreads() > 1)) {
+    std::cout << "SGD: the optimizer keeps state per parameter, so the rows are partitioned instead of hogwild." << std::endl;
+    parallel = PARALLEL_PARTITIONED;
+  }
+  if (batch_size > 1) {
+    std::cout << "SGD: mini-batches of " << batch_size << " rows." << std::endl;
+  } else if (parallel == PARALLEL_PARTITIONED) {
+    // the partition of unshuffled data in memory is the same in every epoch
+    LargeSparseMatrixMemory<DATA_FLOAT>* data = dynamic_cast<LargeSparseMatrixMemory<DATA_FLOAT>*>(train.data);
+    if ((data != NULL) && (! shuffle)) {
+      buildPartition(data->data.value, data->data.dim);
+      partition_rows = data->data.value;
+      std::cout << "SGD: partitioned " << data->data.dim << " rows into " << (partition_round.size() - 1) << " rounds without common attributes." << std::endl;
+    } else {
+      std::cout << "SGD: partitioned every block of rows into rounds without common attributes." << std::endl;
+    }
+  } else if (thread_pool.getNumThreads() > 1) {
+    std::cout << "SGD: lock-free parallel updates (hogwild) with " << thread_pool.getNumThreads() << " threads." << std::endl;
+  }
+  // one sum/sum_sqr buffer per thread
+  thread_sum.setSize(thread_pool.getNumThreads());
+  thread_sum_sqr.setSize(thread_pool.getNumThreads());
+  for (int t = 0; t < thread_pool.getNumThreads(); t++) {
+    thread_sum(t).setSize(fm->num_factor);
+    thread_sum_sqr(t).setSize(fm->num_factor);
+  }
+  thread_w0_mult.resize(thread_pool.getNumThreads());
+  if ((patience > 0) && (validation == NULL)) {
+    throw "the stop criterion -patience needs validation data (-validation)";
+  }
+  if (progressive_train) {
+    std::cout << "SGD: the training measure is taken during the SGD pass (progressive)." << std::endl;
+  }
+  initStopCriteria();
   // SGD
   for (int i = 0; i < num_iter; i++) {
 
-    double iteration_time = getusertime();
-    for (train.data->begin(); !train.data->end(); train.data->next()) {
-      double p = fm->predict(train.data->getRow(), sum, sum_sqr);
-      double mult = 0;
-      if (task == 0) {
-        p = std::min(max_target, p);
-        p = std::max(min_target, p);
-        mult = -(train.target(train.data->getRowIndex())-p);
-      } else if (task == 1) {
-        mult = -train.target(train.data->getRowIndex())*(1.0-1.0/(1.0+exp(-train.target(train.data->getRowIndex())*p)));
+    double iteration_time = getwalltime();
+    thread_progress.assign(thread_pool.getNumThreads(), eval_sums());
+    for_each_epoch_block(train, [&](sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+      if (batch_size > 1) {
+        learnBlockBatch(rows, target, num_rows);
+      } else if (parallel == PARALLEL_PARTITIONED) {
+        learnBlockPartitioned(rows, target, num_rows);
+      } else {
+        learnBlockHogwild(rows, target, num_rows);
+      }
+    });
+    iteration_time = (getwalltime() - iteration_time);
+    double rmse_train;
+    if (progressive_train) {
+      eval_sums progress;
+      for (uint t = 0; t < thread_progress.size(); t++) {
+        progress.sum_sqr += thread_progress[t].sum_sqr;
+        progress.num_correct += thread_progress[t].num_correct;
+      }
+      rmse_train = measure(progress, train.data->getNumRows());
+    } else {
+      rmse_train = evaluate(train);
+    }
+    bool eval_iteration = isEvalIteration(i);
+    std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train;
+    if (eval_iteration) {
+      std::cout << "\tTest=" << evaluateHeldOut(test);
+    }
+    std::cout << std::endl;
+    double validation_loss = std::numeric_limits<double>::quiet_NaN();
+    if ((patience > 0) && eval_iteration) {
+      validation_loss = evaluateHeldOut(*validation, "_validation");
+      if (task == TASK_CLASSIFICATION) {
+        validation_loss = 1.0 - validation_loss;
       }
-      SGD(train.data->getRow(), mult, sum);
     }
-    iteration_time = (getusertime() - iteration_time);
-    double rmse_train = evaluate(train);
-    double rmse_test = evaluate(test);
-    std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << std::endl;
     if (log != NULL) {
       log->log("rmse_train", rmse_train);
       log->log("time_learn", iteration_time);
       log->newLine();
     }
+    if (stopAfterIteration(i, validation_loss)) { break; }
   }
+  restoreBestParameters();
 }
 
 #endif /*FM_LEARN_SGD_ELEMENT_H_*/
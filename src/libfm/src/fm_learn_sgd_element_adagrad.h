@@ -0,0 +1,117 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//
+// fm_learn_sgd_element_adagrad.h: SGD with per-parameter learning rates
+// (AdaGrad) for classification and regression
+//
+// Based on the publication(s):
+// - John Duchi, Elad Hazan, Yoram Singer (2011): Adaptive Subgradient Methods
+//   for Online Learning and Stochastic Optimization, Journal of Machine
+//   Learning Research 12.
+//
+// G' = G + g^2
+// theta' = theta - alpha * g / (sqrt(G') + epsilon)
+// with g = grad_theta + lambda*theta. Only the parameters of the attributes
+// of a row (and w0) are touched, so the state is updated lazily.
+
+#ifndef FM_LEARN_SGD_ELEMENT_ADAGRAD_H_
+#define FM_LEARN_SGD_ELEMENT_ADAGRAD_H_
+
+#include <cmath>
+#include "fm_learn_sgd_element.h"
+
+class fm_learn_sgd_element_adagrad: public fm_learn_sgd_element {
+ public:
+  fm_learn_sgd_element_adagrad();
+  virtual ~fm_learn_sgd_element_adagrad() = default;
+  virtual void learn(Data& train, Data& test);
+  virtual void SGD_w0(const double multiplier);
+  virtual void SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+  void debug();
+
+  double epsilon;
+
+ protected:
+  virtual void stepW0(double grad);
+  virtual void stepW(uint i, double grad);
+  virtual void stepV(uint i, const double* grad);
+
+  // alpha is the learning rate of the layer (learn_rates)
+  template <typename T> void step(T& theta, T& sum_sqr_grad, double grad, double reg, double alpha);
+
+  // sum of the squared gradients of w0, w and v
+  double sum_sqr_grad_w0;
+  DVector<FM_PARAM_FLOAT> sum_sqr_grad_w;
+  fm_factor_matrix<FM_PARAM_FLOAT> sum_sqr_grad_v;
+};
+
+// Implementation
+fm_learn_sgd_element_adagrad::fm_learn_sgd_element_adagrad() {
+  epsilon = 1e-8;
+  parameter_state = true;
+}
+
+void fm_learn_sgd_element_adagrad::learn(Data& train, Data& test) {
+  sum_sqr_grad_w0 = 0;
+  sum_sqr_grad_w.setSize(fm->num_attribute);
+  sum_sqr_grad_w.init(0);
+  sum_sqr_grad_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
+  sum_sqr_grad_v.init(0);
+  std::cout << "Training using AdaGrad." << std::endl;
+  fm_learn_sgd_element::learn(train, test);
+}
+
+void fm_learn_sgd_element_adagrad::SGD_w0(const double multiplier) {
+  stepW0(multiplier);
+}
+
+void fm_learn_sgd_element_adagrad::SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  SGD_row_steps(x, multiplier, sum);
+}
+
+template <typename T> void fm_learn_sgd_element_adagrad::step(T& theta, T& sum_sqr_grad, double grad, double reg, double alpha) {
+  double g = grad + reg * theta;
+  sum_sqr_grad += g * g;
+  theta -= alpha * g / (std::sqrt((double) sum_sqr_grad) + epsilon);
+}
+
+void fm_learn_sgd_element_adagrad::stepW0(double grad) {
+  if (fm->k0) {
+    step(fm->w0, sum_sqr_grad_w0, grad, fm->reg0, learn_rates(0));
+  }
+}
+
+void fm_learn_sgd_element_adagrad::stepW(uint i, double grad) {
+  step(fm->w(i), sum_sqr_grad_w(i), grad, fm->regw, learn_rates(1));
+}
+
+void fm_learn_sgd_element_adagrad::stepV(uint i, const double* grad) {
+  double alpha = learn_rates(2);
+  for (int f = 0; f < fm->num_factor; f++) {
+    step(fm->v(f, i), sum_sqr_grad_v(f, i), grad[f], fm->regv, alpha);
+  }
+}
+
+void fm_learn_sgd_element_adagrad::debug() {
+  std::cout << "epsilon=" << epsilon << std::endl;
+  fm_learn_sgd::debug();
+}
+
+#endif /*FM_LEARN_SGD_ELEMENT_ADAGRAD_H_*/
@@ -0,0 +1,148 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//
+// fm_learn_sgd_element_adam.h: SGD with adaptive moment estimation (Adam)
+// for classification and regression
+//
+// Based on the publication(s):
+// - Diederik P. Kingma, Jimmy Ba (2015): Adam: A Method for Stochastic
+//   Optimization, in Proceedings of the 3rd International Conference on
+//   Learning Representations (ICLR 2015), San Diego, USA.
+//
+// m' = beta1*m + (1-beta1)*g
+// s' = beta2*s + (1-beta2)*g^2
+// theta' = theta - alpha * (m'/(1-beta1^t)) / (sqrt(s'/(1-beta2^t)) + epsilon)
+// with g = grad_theta + lambda*theta. The moments are updated lazily: only the
+// parameters of the attributes of a row (and w0) are touched, and t counts
+// the updates of each attribute, so the bias correction is per attribute.
+
+#ifndef FM_LEARN_SGD_ELEMENT_ADAM_H_
+#define FM_LEARN_SGD_ELEMENT_ADAM_H_
+
+#include <cmath>
+#include "fm_learn_sgd_element.h"
+
+class fm_learn_sgd_element_adam: public fm_learn_sgd_element {
+ public:
+  fm_learn_sgd_element_adam();
+  virtual ~fm_learn_sgd_element_adam() = default;
+  virtual void learn(Data& train, Data& test);
+  virtual void SGD_w0(const double multiplier);
+  virtual void SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+  void debug();
+
+  double beta1;
+  double beta2;
+  double epsilon;
+
+ protected:
+  virtual void stepW0(double grad);
+  virtual void stepW(uint i, double grad);
+  virtual void stepV(uint i, const double* grad);
+
+  // step with the bias corrected learning rate of the t-th update
+  template <typename T> void step(T& theta, T& m, T& s, double grad, double reg, double rate);
+  // alpha is the learning rate of the layer (learn_rates)
+  double rate(uint t, double alpha);
+
+  // first and second moments of the gradients and number of updates
+  double m_w0, s_w0;
+  uint t_w0;
+  DVector<FM_PARAM_FLOAT> m_w, s_w;
+  DVector<uint> t_w;
+  fm_factor_matrix<FM_PARAM_FLOAT> m_v, s_v;
+  DVector<uint> t_v;
+};
+
+// Implementation
+fm_learn_sgd_element_adam::fm_learn_sgd_element_adam() {
+  beta1 = 0.9;
+  beta2 = 0.999;
+  epsilon = 1e-8;
+  parameter_state = true;
+}
+
+void fm_learn_sgd_element_adam::learn(Data& train, Data& test) {
+  m_w0 = 0;
+  s_w0 = 0;
+  t_w0 = 0;
+  m_w.setSize(fm->num_attribute);
+  s_w.setSize(fm->num_attribute);
+  t_w.setSize(fm->num_attribute);
+  m_w.init(0);
+  s_w.init(0);
+  t_w.init(0);
+  m_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
+  s_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
+  t_v.setSize(fm->num_attribute);
+  m_v.init(0);
+  s_v.init(0);
+  t_v.init(0);
+  std::cout << "Training using Adam." << std::endl;
+  fm_learn_sgd_element::learn(train, test);
+}
+
+void fm_learn_sgd_element_adam::SGD_w0(const double multiplier) {
+  stepW0(multiplier);
+}
+
+void fm_learn_sgd_element_adam::SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  SGD_row_steps(x, multiplier, sum);
+}
+
+double fm_learn_sgd_element_adam::rate(uint t, double alpha) {
+  return alpha * std::sqrt(1.0 - std::pow(beta2, t)) / (1.0 - std::pow(beta1, t));
+}
+
+template <typename T> void fm_learn_sgd_element_adam::step(T& theta, T& m, T& s, double grad, double reg, double rate) {
+  double g = grad + reg * theta;
+  m = beta1 * m + (1.0 - beta1) * g;
+  s = beta2 * s + (1.0 - beta2) * g * g;
+  theta -= rate * m / (std::sqrt((double) s) + epsilon);
+}
+
+void fm_learn_sgd_element_adam::stepW0(double grad) {
+  if (fm->k0) {
+    t_w0++;
+    step(fm->w0, m_w0, s_w0, grad, fm->reg0, rate(t_w0, learn_rates(0)));
+  }
+}
+
+void fm_learn_sgd_element_adam::stepW(uint i, double grad) {
+  t_w(i)++;
+  step(fm->w(i), m_w(i), s_w(i), grad, fm->regw, rate(t_w(i), learn_rates(1)));
+}
+
+void fm_learn_sgd_element_adam::stepV(uint i, const double* grad) {
+  t_v(i)++;
+  double r = rate(t_v(i), learn_rates(2));
+  for (int f = 0; f < fm->num_factor; f++) {
+    step(fm->v(f, i), m_v(f, i), s_v(f, i), grad[f], fm->regv, r);
+  }
+}
+
+void fm_learn_sgd_element_adam::debug() {
+  std::cout << "beta1=" << beta1 << std::endl;
+  std::cout << "beta2=" << beta2 << std::endl;
+  std::cout << "epsilon=" << epsilon << std::endl;
+  fm_learn_sgd::debug();
+}
+
+#endif /*FM_LEARN_SGD_ELEMENT_ADAM_H_*/
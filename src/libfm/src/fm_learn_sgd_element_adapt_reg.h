@@ -37,7 +37,9 @@
 #ifndef FM_LEARN_SGD_ELEMENT_ADAPT_REG_H_
 #define FM_LEARN_SGD_ELEMENT_ADAPT_REG_H_
 
+#include <atomic>
 #include <sstream>
+#include <thread>
 #include "fm_learn_sgd.h"
 
 class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
@@ -51,6 +53,8 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
   double predict_scaled(sparse_row<FM_FLOAT>& x);
 
   void sgd_lambda_step(sparse_row<FM_FLOAT>& x, const DATA_FLOAT target);
+  // lambda step with the next row of the validation data (cyclic)
+  void next_lambda_step();
 
   void update_means();
 
@@ -67,15 +71,32 @@ class fm_learn_sgd_element_adapt_reg: public fm_learn_sgd {
   double mean_w, var_w;
   DVector<double> mean_v, var_v;
 
-  // for each parameter there is one gradient to store
-  DVector<double> grad_w;
-  DMatrix<double> grad_v;
+  // for each parameter there is one gradient to store (the one of its last
+  // theta step); it is kept in the precision of the parameters
+  DVector<FM_PARAM_FLOAT> grad_w;
+  fm_factor_matrix<FM_PARAM_FLOAT> grad_v; // same layout as fm->v
 
   Data* validation;
 
-  // local parameters in the lambda_update step
-  DVector<double> lambda_w_grad;
-  DVector<double> sum_f, sum_f_dash_f;
+  // local parameters in the lambda_update step; only the groups of the row
+  // are visited, they get the slots 0, 1, ... in the order of their first
+  // attribute (row_group_slot(g) = -1 for the other groups)
+  DVector<int> row_group_slot;
+  std::vector<uint> row_groups;
+  std::vector<double> lambda_w_grad; // per slot
+  std::vector<double> sum_f_dash; // per factor
+  std::vector<double> sum_f, sum_f_dash_f; // num_factor values per slot
+  DVector<double> lambda_sum, lambda_sum_sqr;
+
+  // With more than one thread the theta steps and the lambda steps run
+  // concurrently on two threads against the shared model (without locks,
+  // like hogwild). The lambda thread makes at most as many steps as the
+  // theta thread has made in the epoch so far.
+  std::atomic<uint64> theta_steps;
+  std::atomic<bool> theta_finished;
+
+  // progressive evaluation of the theta steps of the current epoch
+  eval_sums progress;
 };
 
 // Implementation
@@ -90,14 +111,15 @@ void fm_learn_sgd_element_adapt_reg::init() {
   var_v.setSize(fm->num_factor);
 
   grad_w.setSize(fm->num_attribute);
-  grad_v.setSize(fm->num_factor, fm->num_attribute);
+  grad_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
 
   grad_w.init(0.0);
   grad_v.init(0.0);
 
-  lambda_w_grad.setSize(meta->num_attr_groups);
-  sum_f.setSize(meta->num_attr_groups);
-  sum_f_dash_f.setSize(meta->num_attr_groups);
+  row_group_slot.setSize(meta->num_attr_groups);
+  row_group_slot.init(-1);
+  lambda_sum.setSize(fm->num_factor);
+  lambda_sum_sqr.setSize(fm->num_factor);
 
 
   if (log != NULL) {
@@ -137,6 +159,7 @@ void fm_learn_sgd_element_adapt_reg::init() {
 
 void fm_learn_sgd_element_adapt_reg::sgd_theta_step(sparse_row<FM_FLOAT>& x, const DATA_FLOAT target) {
   double p = fm->predict(x, sum, sum_sqr);
+  evaluate_prediction(p, target, progress);
   double mult = 0;
   if (task == 0) {
     p = std::min(max_target, p);
@@ -155,17 +178,30 @@ void fm_learn_sgd_element_adapt_reg::sgd_theta_step(sparse_row<FM_FLOAT>& x, con
   if (fm->k1) {
     for (uint i = 0; i < x.size; i++) {
       uint g = meta->attr_group(x.data[i].id);
-      double& w = fm->w(x.data[i].id);
+      FM_PARAM_FLOAT& w = fm->w(x.data[i].id);
       grad_w(x.data[i].id) = mult * x.data[i].value;
       w -= learn_rate * (grad_w(x.data[i].id) + 2 * reg_w(g) * w);
     }
   }
-  for (int f = 0; f < fm->num_factor; f++) {
+  if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
     for (uint i = 0; i < x.size; i++) {
       uint g = meta->attr_group(x.data[i].id);
-      double& v = fm->v(f,x.data[i].id);
-      grad_v(f,x.data[i].id) = mult * (x.data[i].value * (sum(f) - v * x.data[i].value)); // grad_v_if = (y(x)-y) * [ x_i*(\sum_j x_j v_jf) - v_if*x^2 ]
-      v -= learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
+      FM_PARAM_FLOAT* v_i = fm->v.attribute(x.data[i].id);
+      FM_PARAM_FLOAT* grad_v_i = grad_v.attribute(x.data[i].id);
+      for (int f = 0; f < fm->num_factor; f++) {
+        FM_PARAM_FLOAT& v = v_i[f];
+        grad_v_i[f] = mult * (x.data[i].value * (sum(f) - (double) v * x.data[i].value));
+        v -= learn_rate * (grad_v_i[f] + 2 * reg_v(g,f) * v);
+      }
+    }
+  } else {
+    for (int f = 0; f < fm->num_factor; f++) {
+      for (uint i = 0; i < x.size; i++) {
+        uint g = meta->attr_group(x.data[i].id);
+        FM_PARAM_FLOAT& v = fm->v(f,x.data[i].id);
+        grad_v(f,x.data[i].id) = mult * (x.data[i].value * (sum(f) - (double) v * x.data[i].value)); // grad_v_if = (y(x)-y) * [ x_i*(\sum_j x_j v_jf) - v_if*x^2 ]
+        v -= learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
+      }
     }
   }
 }
@@ -179,23 +215,44 @@ double fm_learn_sgd_element_adapt_reg::predict_scaled(sparse_row<FM_FLOAT>& x) {
     for (uint i = 0; i < x.size; i++) {
       assert(x.data[i].id < fm->num_attribute);
       uint g = meta->attr_group(x.data[i].id);
-      double& w = fm->w(x.data[i].id);
+      FM_PARAM_FLOAT& w = fm->w(x.data[i].id);
       double w_dash = w - learn_rate * (grad_w(x.data[i].id) + 2 * reg_w(g) * w);
       p += w_dash * x.data[i].value;
     }
   }
-  for (int f = 0; f < fm->num_factor; f++) {
-    sum(f) = 0.0;
-    sum_sqr(f) = 0.0;
+  if (fm->v.layout == FM_LAYOUT_ATTRIBUTE_MAJOR) {
+    for (int f = 0; f < fm->num_factor; f++) {
+      lambda_sum(f) = 0.0;
+      lambda_sum_sqr(f) = 0.0;
+    }
     for (uint i = 0; i < x.size; i++) {
       uint g = meta->attr_group(x.data[i].id);
-      double& v = fm->v(f,x.data[i].id);
-      double v_dash = v - learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
-      double d = v_dash * x.data[i].value;
-      sum(f) += d;
-      sum_sqr(f) += d*d;
+      const FM_PARAM_FLOAT* v_i = fm->v.attribute(x.data[i].id);
+      const FM_PARAM_FLOAT* grad_v_i = grad_v.attribute(x.data[i].id);
+      for (int f = 0; f < fm->num_factor; f++) {
+        double v_dash = v_i[f] - learn_rate * (grad_v_i[f] + 2 * reg_v(g,f) * v_i[f]);
+        double d = v_dash * x.data[i].value;
+        lambda_sum(f) += d;
+        lambda_sum_sqr(f) += d*d;
+      }
+    }
+    for (int f = 0; f < fm->num_factor; f++) {
+      p += 0.5 * (lambda_sum(f)*lambda_sum(f) - lambda_sum_sqr(f));
+    }
+  } else {
+    for (int f = 0; f < fm->num_factor; f++) {
+      lambda_sum(f) = 0.0;
+      lambda_sum_sqr(f) = 0.0;
+      for (uint i = 0; i < x.size; i++) {
+        uint g = meta->attr_group(x.data[i].id);
+        FM_PARAM_FLOAT& v = fm->v(f,x.data[i].id);
+        double v_dash = v - learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
+        double d = v_dash * x.data[i].value;
+        lambda_sum(f) += d;
+        lambda_sum_sqr(f) += d*d;
+      }
+      p += 0.5 * (lambda_sum(f)*lambda_sum(f) - lambda_sum_sqr(f));
     }
-    p += 0.5 * (sum(f)*sum(f) - sum_sqr(f));
   }
   return p;
 }
@@ -211,42 +268,73 @@ void fm_learn_sgd_element_adapt_reg::sgd_lambda_step(sparse_row<FM_FLOAT>& x, co
     grad_loss = target * ( (1.0/(1.0+exp(-target*p))) -  1.0);
   }
 
+  // lambda of a group without attributes in x has no gradient, so only the
+  // groups of x are visited
+  row_groups.clear();
+  for (uint i = 0; i < x.size; i++) {
+    uint g = meta->attr_group(x.data[i].id);
+    if (row_group_slot(g) < 0) {
+      row_group_slot(g) = row_groups.size();
+      row_groups.push_back(g);
+    }
+  }
+  const uint num_slots = row_groups.size();
+  const int num_factor = fm->num_factor;
+
   if (fm->k1) {
-    lambda_w_grad.init(0.0);
+    lambda_w_grad.assign(num_slots, 0.0);
     for (uint i = 0; i < x.size; i++) {
       uint g = meta->attr_group(x.data[i].id);
-      lambda_w_grad(g) += x.data[i].value * fm->w(x.data[i].id);
+      lambda_w_grad[row_group_slot(g)] += x.data[i].value * (double) fm->w(x.data[i].id);
     }
-    for (uint g = 0; g < meta->num_attr_groups; g++) {
-      lambda_w_grad(g) = -2 * learn_rate * lambda_w_grad(g);
-      reg_w(g) -= learn_rate * grad_loss * lambda_w_grad(g);
+    for (uint s = 0; s < num_slots; s++) {
+      uint g = row_groups[s];
+      lambda_w_grad[s] = -2 * learn_rate * lambda_w_grad[s];
+      reg_w(g) -= learn_rate * grad_loss * lambda_w_grad[s];
       reg_w(g) = std::max(0.0, reg_w(g));
     }
   }
-  for (int f = 0; f < fm->num_factor; f++) {
-    // grad_lambdafg = (grad l(y(x),y)) * (-2 * alpha * (\sum_{l} x_l * v'_lf) * (\sum_{l \in group(g)} x_l * v_lf) - \sum_{l \in group(g)} x^2_l * v_lf * v'_lf)
-    // sum_f_dash      := \sum_{l} x_l * v'_lf, this is independent of the groups
-    // sum_f(g)        := \sum_{l \in group(g)} x_l * v_lf
-    // sum_f_dash_f(g) := \sum_{l \in group(g)} x^2_l * v_lf * v'_lf
-    double sum_f_dash = 0.0;
-    sum_f.init(0.0);
-    sum_f_dash_f.init(0.0);
-    for (uint i = 0; i < x.size; i++) {
+  // grad_lambdafg = (grad l(y(x),y)) * (-2 * alpha * (\sum_{l} x_l * v'_lf) * (\sum_{l \in group(g)} x_l * v_lf) - \sum_{l \in group(g)} x^2_l * v_lf * v'_lf)
+  // sum_f_dash      := \sum_{l} x_l * v'_lf, this is independent of the groups
+  // sum_f(g)        := \sum_{l \in group(g)} x_l * v_lf
+  // sum_f_dash_f(g) := \sum_{l \in group(g)} x^2_l * v_lf * v'_lf
+  sum_f_dash.assign(num_factor, 0.0);
+  sum_f.assign((uint64) num_slots * num_factor, 0.0);
+  sum_f_dash_f.assign((uint64) num_slots * num_factor, 0.0);
+  for (uint i = 0; i < x.size; i++) {
+    uint attr_id = x.data[i].id;
+    uint g = meta->attr_group(attr_id);
+    double* sum_f_g = sum_f.data() + (uint64) row_group_slot(g) * num_factor;
+    double* sum_f_dash_f_g = sum_f_dash_f.data() + (uint64) row_group_slot(g) * num_factor;
+    double x_i = x.data[i].value;
+    for (int f = 0; f < num_factor; f++) {
       // v_if' =  [ v_if * (1-alpha*lambda_v_f) - alpha * grad_v_if]
-      uint g = meta->attr_group(x.data[i].id);
-      double& v = fm->v(f,x.data[i].id);
-      double v_dash = v - learn_rate * (grad_v(f,x.data[i].id) + 2 * reg_v(g,f) * v);
+      double v = fm->v(f,attr_id);
+      double v_dash = v - learn_rate * (grad_v(f,attr_id) + 2 * reg_v(g,f) * v);
 
-      sum_f_dash += v_dash * x.data[i].value;
-      sum_f(g) += v * x.data[i].value;
-      sum_f_dash_f(g) += v_dash * x.data[i].value * v * x.data[i].value;
+      sum_f_dash[f] += v_dash * x_i;
+      sum_f_g[f] += v * x_i;
+      sum_f_dash_f_g[f] += v_dash * x_i * v * x_i;
     }
-    for (uint g = 0; g < meta->num_attr_groups; g++) {
-      double lambda_v_grad = -2 * learn_rate *  (sum_f_dash * sum_f(g) - sum_f_dash_f(g));
+  }
+  for (uint s = 0; s < num_slots; s++) {
+    uint g = row_groups[s];
+    for (int f = 0; f < num_factor; f++) {
+      uint64 j = (uint64) s * num_factor + f;
+      double lambda_v_grad = -2 * learn_rate *  (sum_f_dash[f] * sum_f[j] - sum_f_dash_f[j]);
       reg_v(g,f) -= learn_rate * grad_loss * lambda_v_grad;
       reg_v(g,f) = std::max(0.0, reg_v(g,f));
     }
+    row_group_slot(g) = -1;
+  }
+}
+
+void fm_learn_sgd_element_adapt_reg::next_lambda_step() {
+  if (validation->data->end()) {
+    validation->data->begin();
   }
+  sgd_lambda_step(validation->data->getRow(), validation->target(validation->data->getRowIndex()));
+  validation->data->next();
 }
 
 void fm_learn_sgd_element_adapt_reg::update_means() {
@@ -256,10 +344,10 @@ void fm_learn_sgd_element_adapt_reg::update_means() {
   var_v.init(0);
   for (uint j = 0; j < fm->num_attribute; j++) {
     mean_w += fm->w(j);
-    var_w += fm->w(j)*fm->w(j);
+    var_w += (double) fm->w(j)*fm->w(j);
     for (int f = 0; f < fm->num_factor; f++) {
       mean_v(f) += fm->v(f,j);
-      var_v(f) += fm->v(f,j)*fm->v(f,j);
+      var_v(f) += (double) fm->v(f,j)*fm->v(f,j);
     }
   }
   mean_w /= (double) fm->num_attribute;
@@ -278,7 +366,12 @@ void fm_learn_sgd_element_adapt_reg::update_means() {
 void fm_learn_sgd_element_adapt_reg::learn(Data& train, Data& test) {
   fm_learn_sgd::learn(train, test);
 
-  std::cout << "Training using self-adaptive-regularization SGD."<< std::endl << "DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING AND VALIDATION DATA TO GET THE BEST RESULTS." << std::endl;
+  std::cout << "Training using self-adaptive-regularization SGD."<< std::endl;
+  if (shuffle) {
+    std::cout << "Shuffling the training rows in every iteration. DON'T FORGET TO SHUFFLE THE ROWS IN VALIDATION DATA TO GET THE BEST RESULTS." << std::endl;
+  } else {
+    std::cout << "DON'T FORGET TO SHUFFLE THE ROWS IN TRAINING (-shuffle) AND VALIDATION DATA TO GET THE BEST RESULTS." << std::endl;
+  }
 
   // make sure that fm-parameters are initialized correctly (no other side effects)
   fm->w.init(0);
@@ -292,33 +385,78 @@ void fm_learn_sgd_element_adapt_reg::learn(Data& train, Data& test) {
 
   std::cout << "Using " << train.data->getNumRows() << " rows for training model parameters and " << validation->data->getNumRows() << " for training shrinkage." << std::endl;
 
+  thread_pool.setNumThreads(num_threads);
+  if (thread_pool.getNumThreads() > 1) {
+    std::cout << "SGDA: theta steps and lambda steps on two threads." << std::endl;
+  }
+
+  initStopCriteria();
   // SGD
   for (int i = 0; i < num_iter; i++) {
-    double iteration_time = getusertime();
+    double iteration_time = getwalltime();
 
     // SGD-based learning: both lambda and theta are learned
-    update_means();
+    progress = eval_sums();
     validation->data->begin();
-    for (train.data->begin(); !train.data->end(); train.data->next()) {
-      sgd_theta_step(train.data->getRow(), train.target(train.data->getRowIndex()));
-
-      if (i > 0) { // make no lambda steps in the first iteration, because some of the gradients (grad_theta) might not be initialized.
-        if (validation->data->end()) {
-          update_means();
-          validation->data->begin();
+    if ((i > 0) && (thread_pool.getNumThreads() > 1)) {
+      theta_steps = 0;
+      theta_finished = false;
+      thread_pool.run(2, [&](uint task, int thread) {
+        if (task == 0) {
+          uint64 steps = 0;
+          try {
+            for_each_epoch_block(train, [&](sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+              for (uint r = 0; r < num_rows; r++) {
+                sgd_theta_step(rows[r], target[r]);
+                theta_steps.store(++steps, std::memory_order_release);
+              }
+            });
+          } catch (...) {
+            theta_finished = true;
+            throw;
+          }
+          theta_finished = true;
+        } else {
+          // the lambda steps follow the theta steps; if both tasks end up on
+          // the same thread, the theta task has run before
+          uint64 steps = 0;
+          while (true) {
+            bool finished = theta_finished;
+            if (steps < theta_steps.load(std::memory_order_acquire)) {
+              next_lambda_step();
+              steps++;
+            } else if (finished) {
+              break;
+            } else {
+              std::this_thread::yield();
+            }
+          }
         }
-        sgd_lambda_step(validation->data->getRow(), validation->target(validation->data->getRowIndex()));
-        validation->data->next();
-      }
+      });
+    } else {
+      for_each_epoch_block(train, [&](sparse_row<DATA_FLOAT>* rows, const DATA_FLOAT* target, uint num_rows) {
+        for (uint r = 0; r < num_rows; r++) {
+          sgd_theta_step(rows[r], target[r]);
+
+          if (i > 0) { // make no lambda steps in the first iteration, because some of the gradients (grad_theta) might not be initialized.
+            next_lambda_step();
+          }
+        }
+      });
     }
 
     // (3) Evaluation
-    iteration_time = (getusertime() - iteration_time);
+    iteration_time = (getwalltime() - iteration_time);
+    update_means();
 
-    double rmse_val = evaluate(*validation);
-    double rmse_train = evaluate(train);
-    double rmse_test = evaluate(test);
-    std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train << "\tTest=" << rmse_test << std::endl;
+    bool eval_iteration = isEvalIteration(i);
+    double rmse_val = eval_iteration ? evaluateHeldOut(*validation, "_val") : std::numeric_limits<double>::quiet_NaN();
+    double rmse_train = progressive_train ? measure(progress, train.data->getNumRows()) : evaluate(train);
+    std::cout << "#Iter=" << std::setw(3) << i << "\tTrain=" << rmse_train;
+    if (eval_iteration) {
+      std::cout << "\tTest=" << evaluateHeldOut(test);
+    }
+    std::cout << std::endl;
     if (log != NULL) {
       log->log("wmean", mean_w);
       log->log("wvar", var_w);
@@ -353,7 +491,10 @@ void fm_learn_sgd_element_adapt_reg::learn(Data& train, Data& test) {
       log->log("rmse_val", rmse_val);
       log->newLine();
     }
+    double validation_loss = (task == TASK_CLASSIFICATION) ? (1.0 - rmse_val) : rmse_val;
+    if (stopAfterIteration(i, validation_loss)) { break; }
   }
+  restoreBestParameters();
 }
 
 void fm_learn_sgd_element_adapt_reg::debug() {
@@ -0,0 +1,144 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+//
+// fm_learn_sgd_element_ftrl.h: Follow-the-regularized-leader (FTRL-Proximal)
+// learning for classification and regression
+//
+// Based on the publication(s):
+// - H. Brendan McMahan et al. (2013): Ad Click Prediction: a View from the
+//   Trenches, in Proceedings of the 19th ACM SIGKDD International Conference
+//   on Knowledge Discovery and Data Mining (KDD 2013), Chicago, USA.
+//
+// sigma = (sqrt(n + g^2) - sqrt(n)) / alpha
+// z' = z + g - sigma*theta
+// n' = n + g^2
+// theta' = 0                                                 if |z'| <= lambda1
+//        = -(z' - sign(z')*lambda1) / ((beta + sqrt(n'))/alpha + lambda2)  else
+// with the gradient g of the loss, alpha=learn_rates of the layer, lambda2 from -regular
+// and the L1 regularization lambda1 only for w (it would fix v at 0). The
+// state starts with z = -theta*(beta/alpha + lambda2), so the initial
+// factors are kept. Only the parameters of the attributes of a row (and w0)
+// are touched.
+
+#ifndef FM_LEARN_SGD_ELEMENT_FTRL_H_
+#define FM_LEARN_SGD_ELEMENT_FTRL_H_
+
+#include <cmath>
+#include "fm_learn_sgd_element.h"
+
+class fm_learn_sgd_element_ftrl: public fm_learn_sgd_element {
+ public:
+  fm_learn_sgd_element_ftrl();
+  virtual ~fm_learn_sgd_element_ftrl() = default;
+  virtual void learn(Data& train, Data& test);
+  virtual void SGD_w0(const double multiplier);
+  virtual void SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum);
+  void debug();
+
+  double beta;
+  double l1; // L1 regularization of w
+
+ protected:
+  virtual void stepW0(double grad);
+  virtual void stepW(uint i, double grad);
+  virtual void stepV(uint i, const double* grad);
+
+  template <typename T> void step(T& theta, T& z, T& n, double grad, double l1, double l2, double alpha);
+
+  double z_w0, n_w0;
+  DVector<FM_PARAM_FLOAT> z_w, n_w;
+  fm_factor_matrix<FM_PARAM_FLOAT> z_v, n_v;
+};
+
+// Implementation
+fm_learn_sgd_element_ftrl::fm_learn_sgd_element_ftrl() {
+  beta = 1.0;
+  l1 = 0.0;
+  parameter_state = true;
+}
+
+void fm_learn_sgd_element_ftrl::learn(Data& train, Data& test) {
+  if ((learn_rates(0) <= 0) || (learn_rates(1) <= 0) || (learn_rates(2) <= 0)) {
+    throw "FTRL needs positive learning rates";
+  }
+  z_w0 = -fm->w0 * (beta / learn_rates(0) + fm->reg0);
+  n_w0 = 0;
+  z_w.setSize(fm->num_attribute);
+  n_w.setSize(fm->num_attribute);
+  n_w.init(0);
+  z_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
+  n_v.setSize(fm->num_factor, fm->num_attribute, fm->v.layout);
+  n_v.init(0);
+  for (uint i = 0; i < fm->num_attribute; i++) {
+    z_w(i) = -fm->w(i) * (beta / learn_rates(1) + fm->regw);
+    for (int f = 0; f < fm->num_factor; f++) {
+      z_v(f, i) = -fm->v(f, i) * (beta / learn_rates(2) + fm->regv);
+    }
+  }
+  std::cout << "Training using FTRL-Proximal." << std::endl;
+  fm_learn_sgd_element::learn(train, test);
+}
+
+void fm_learn_sgd_element_ftrl::SGD_w0(const double multiplier) {
+  stepW0(multiplier);
+}
+
+void fm_learn_sgd_element_ftrl::SGD_row(sparse_row<DATA_FLOAT> &x, const double multiplier, DVector<double> &sum) {
+  SGD_row_steps(x, multiplier, sum);
+}
+
+template <typename T> void fm_learn_sgd_element_ftrl::step(T& theta, T& z, T& n, double grad, double l1, double l2, double alpha) {
+  double n_new = n + grad * grad;
+  double sigma = (std::sqrt(n_new) - std::sqrt((double) n)) / alpha;
+  double z_new = z + grad - sigma * theta;
+  z = z_new;
+  n = n_new;
+  if (std::abs(z_new) <= l1) {
+    theta = 0;
+  } else {
+    double sign = (z_new < 0) ? -1.0 : 1.0;
+    theta = -(z_new - sign * l1) / ((beta + std::sqrt(n_new)) / alpha + l2);
+  }
+}
+
+void fm_learn_sgd_element_ftrl::stepW0(double grad) {
+  if (fm->k0) {
+    step(fm->w0, z_w0, n_w0, grad, 0.0, fm->reg0, learn_rates(0));
+  }
+}
+
+void fm_learn_sgd_element_ftrl::stepW(uint i, double grad) {
+  step(fm->w(i), z_w(i), n_w(i), grad, l1, fm->regw, learn_rates(1));
+}
+
+void fm_learn_sgd_element_ftrl::stepV(uint i, const double* grad) {
+  double alpha = learn_rates(2);
+  for (int f = 0; f < fm->num_factor; f++) {
+    step(fm->v(f, i), z_v(f, i), n_v(f, i), grad[f], 0.0, fm->regv, alpha);
+  }
+}
+
+void fm_learn_sgd_element_ftrl::debug() {
+  std::cout << "beta=" << beta << std::endl;
+  std::cout << "l1=" << l1 << std::endl;
+  fm_learn_sgd::debug();
+}
+
+#endif /*FM_LEARN_SGD_ELEMENT_FTRL_H_*/
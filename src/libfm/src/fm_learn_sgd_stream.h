@@ -0,0 +1,156 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// fm_learn_sgd_stream.h: Online SGD on a stream of rows in libFM format
+// (e.g. stdin or a FIFO). Every row is read, used for one SGD step and
+// dropped, so only the model is kept in memory. The model grows when new
+// attribute ids appear or, with max_attribute, the ids are hashed into a
+// model of fixed size.
+
+#ifndef FM_LEARN_SGD_STREAM_H_
+#define FM_LEARN_SGD_STREAM_H_
+
+#include <cstdio>
+#include <istream>
+#include "fm_learn_sgd_element.h"
+
+class fm_learn_sgd_stream: public fm_learn_sgd_element {
+ public:
+  fm_learn_sgd_stream();
+  virtual ~fm_learn_sgd_stream() = default;
+  // one SGD step for every row of in until the end of the stream
+  void learnStream(std::istream& in);
+  void debug();
+
+  // every checkpoint_rows rows (and at the end of the stream) the
+  // progressive measure of the rows since the last checkpoint is reported
+  // and the model is written to checkpoint_file (if not empty)
+  uint64 checkpoint_rows;
+  std::string checkpoint_file;
+  int checkpoint_format;
+
+  // 0: the model grows with the largest attribute id; otherwise attribute id
+  // i is mapped to i mod max_attribute and the model has a fixed size
+  uint max_attribute;
+  // the largest attribute id seen so far plus one (or max_attribute); the
+  // model may have room for more attributes, but only these are saved
+  uint num_seen_attribute;
+
+ protected:
+  void checkpoint(uint64 num_rows, const eval_sums& progress, uint64 num_progress_rows, double learn_time);
+};
+
+// Implementation
+fm_learn_sgd_stream::fm_learn_sgd_stream() {
+  checkpoint_rows = 100000;
+  checkpoint_format = FM_MODEL_FORMAT_TEXT;
+  max_attribute = 0;
+  num_seen_attribute = 0;
+}
+
+void fm_learn_sgd_stream::checkpoint(uint64 num_rows, const eval_sums& progress, uint64 num_progress_rows, double learn_time) {
+  double measure_rows = (num_progress_rows > 0) ? measure(progress, num_progress_rows) : std::numeric_limits<double>::quiet_NaN();
+  std::cout << "#Rows=" << num_rows << "\tTrain=" << measure_rows << "\t#attributes=" << num_seen_attribute << std::endl;
+  if (log != NULL) {
+    log->log("rmse_train", measure_rows);
+    log->log("time_learn", learn_time);
+    log->newLine();
+  }
+  if (! checkpoint_file.empty()) {
+    // the model file is replaced at once, so readers never see a partial model
+    std::string tmp_file = checkpoint_file + ".tmp";
+    fm->saveModel(tmp_file, checkpoint_format, num_seen_attribute);
+    if (std::rename(tmp_file.c_str(), checkpoint_file.c_str()) != 0) {
+      throw "unable to write " + checkpoint_file;
+    }
+  }
+}
+
+void fm_learn_sgd_stream::learnStream(std::istream& in) {
+  if (max_attribute > 0) {
+    if (fm->num_attribute > max_attribute) {
+      throw "the model has more attributes than -stream_max_attribute";
+    }
+    fm->resize(max_attribute);
+  }
+  // the attributes of a loaded model count as seen
+  num_seen_attribute = fm->num_attribute;
+  std::cout << "SGD: learning from a stream, one step per row." << std::endl;
+  if (task == TASK_REGRESSION) {
+    // the range of the predictions is the range of the targets seen so far
+    min_target = std::numeric_limits<double>::max();
+    max_target = -std::numeric_limits<double>::max();
+  }
+
+  std::string line;
+  std::vector< sparse_entry<DATA_FLOAT> > entries;
+  DATA_FLOAT target;
+  eval_sums progress;
+  uint64 num_rows = 0;
+  uint64 num_progress_rows = 0;
+  double learn_time = getwalltime();
+  while (std::getline(in, line)) {
+    if (! Data::parseLine(line, target, entries)) { continue; }
+    if (task == TASK_CLASSIFICATION) {
+      target = (target <= 0.0) ? -1.0 : 1.0;
+    } else {
+      min_target = std::min(min_target, (double) target);
+      max_target = std::max(max_target, (double) target);
+    }
+    for (uint i = 0; i < entries.size(); i++) {
+      if (max_attribute > 0) {
+        entries[i].id %= max_attribute;
+      } else {
+        num_seen_attribute = std::max(num_seen_attribute, entries[i].id + 1);
+      }
+    }
+    if (num_seen_attribute > fm->num_attribute) {
+      // grow by at least a factor of two, so that the copies are amortized
+      fm->resize(std::max(num_seen_attribute, 2 * fm->num_attribute));
+    }
+    sparse_row<DATA_FLOAT> x;
+    x.data = entries.data();
+    x.size = entries.size();
+    learnRow(x, target, sum, sum_sqr, true, progress);
+    num_rows++;
+    num_progress_rows++;
+    if ((checkpoint_rows > 0) && (num_progress_rows == checkpoint_rows)) {
+      checkpoint(num_rows, progress, num_progress_rows, getwalltime() - learn_time);
+      progress = eval_sums();
+      num_progress_rows = 0;
+      learn_time = getwalltime();
+    }
+  }
+  if (in.bad()) {
+    throw "error while reading the stream";
+  }
+  if ((num_progress_rows > 0) || (num_rows == 0)) {
+    checkpoint(num_rows, progress, num_progress_rows, getwalltime() - learn_time);
+  }
+}
+
+void fm_learn_sgd_stream::debug() {
+  std::cout << "checkpoint_rows=" << checkpoint_rows << std::endl;
+  std::cout << "checkpoint_file=" << checkpoint_file << std::endl;
+  std::cout << "max_attribute=" << max_attribute << std::endl;
+  std::cout << "num_seen_attribute=" << num_seen_attribute << std::endl;
+  fm_learn_sgd::debug();
+}
+
+#endif /*FM_LEARN_SGD_STREAM_H_*/
@@ -0,0 +1,102 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// alias_table.h: Sampling from a discrete distribution in constant time
+//
+// Walker's alias method: every bucket k holds the probability prob[k] of
+// returning k and an alias for the remaining mass. A sample costs one random
+// number and two lookups, independent of the number of outcomes.
+//
+// Based on the publication(s):
+// - Michael D. Vose (1991): A Linear Algorithm for Generating Random Numbers
+//   with a Given Distribution, IEEE Transactions on Software Engineering 17.
+
+#ifndef ALIAS_TABLE_H_
+#define ALIAS_TABLE_H_
+
+#include <vector>
+#include "../util/memory.h"
+#include "../util/random.h"
+#include "../util/util.h"
+
+class AliasTable {
+ public:
+  // outcome i gets the probability weight[i] / sum(weight); the weights must
+  // be non-negative with a positive sum
+  void init(const std::vector<double>& weight);
+
+  // sample for a uniform random 64 bit number
+  uint sample(uint64 random) const;
+
+  uint size() const { return prob.size(); }
+
+ protected:
+  std::vector<double> prob;
+  std::vector<uint> alias;
+};
+
+// Implementation
+void AliasTable::init(const std::vector<double>& weight) {
+  uint n = weight.size();
+  double total = 0;
+  for (uint i = 0; i < n; i++) {
+    assert(weight[i] >= 0);
+    total += weight[i];
+  }
+  if (! (total > 0)) {
+    throw "alias table needs a positive sum of weights";
+  }
+  prob.resize(n);
+  alias.resize(n);
+  // scaled probabilities; buckets below 1 are filled up by ones above 1
+  std::vector<uint> small, large;
+  for (uint i = 0; i < n; i++) {
+    prob[i] = weight[i] * n / total;
+    alias[i] = i;
+    if (prob[i] < 1.0) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  while (! small.empty() && ! large.empty()) {
+    uint s = small.back();
+    small.pop_back();
+    uint l = large.back();
+    alias[s] = l;
+    prob[l] -= (1.0 - prob[s]);
+    if (prob[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // the remaining buckets are full up to rounding errors
+  for (uint i = 0; i < small.size(); i++) { prob[small[i]] = 1.0; }
+  for (uint i = 0; i < large.size(); i++) { prob[large[i]] = 1.0; }
+}
+
+uint AliasTable::sample(uint64 random) const {
+  // the upper 32 bits choose the bucket, the lower 32 bits decide between
+  // the bucket and its alias
+  uint k = ((random >> 32) * (uint64) prob.size()) >> 32;
+  double u = (random & 0xFFFFFFFFULL) * (1.0 / 4294967296.0);
+  return (u < prob[k]) ? k : alias[k];
+}
+
+#endif /*ALIAS_TABLE_H_*/
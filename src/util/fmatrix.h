@@ -23,6 +23,7 @@
 #define FMATRIX_H_
 
 #include <limits>
+#include <string>
 #include <vector>
 #include <assert.h>
 #include <iostream>
@@ -61,6 +62,11 @@ template <typename T> class LargeSparseMatrix {
   virtual uint64 getNumValues() = 0; // get the number of Values
   virtual ~LargeSparseMatrix() = 0;
 
+  // A matrix with the same values but its own position (begin/next), so that
+  // several threads can iterate at the same time. A matrix in memory shares
+  // its values with the clone, a matrix on disk opens the file again.
+  virtual LargeSparseMatrix<T>* clone() = 0;
+
   void saveToBinaryFile(std::string filename);
 
   void saveToTextFile(std::string filename);
@@ -83,12 +89,24 @@ template <typename T> class LargeSparseMatrixHD : public LargeSparseMatrix<T> {
   virtual sparse_row<T>& getRow();
   virtual uint getRowIndex();
 
+  virtual LargeSparseMatrix<T>* clone();
+
+  // Random access to the cache blocks, i.e. the consecutive rows that are
+  // read into the cache at once. readBlock loads a block and sets rows to
+  // its rows, which are valid until the next read; the iterator has to be
+  // restarted with begin() afterwards.
+  uint getNumBlocks();
+  uint getBlockFirstRow(uint block);
+  uint readBlock(uint block, sparse_row<T>*& rows);
+
  protected:
   void readcache();
+  void buildBlockIndex();
 
   DVector< sparse_row<T> > data;
   DVector< sparse_entry<T> > cache;
   std::string filename;
+  uint64 cache_size;
 
   std::ifstream in;
 
@@ -100,6 +118,10 @@ template <typename T> class LargeSparseMatrixHD : public LargeSparseMatrix<T> {
   uint num_cols;
   uint64 num_values;
   uint num_rows;
+
+  // first row and file position of every cache block, filled on first use
+  std::vector<uint> block_first_row;
+  std::vector<uint64> block_position;
 };
 
 template <typename T> class LargeSparseMatrixMemory : public LargeSparseMatrix<T> {
@@ -112,6 +134,7 @@ template <typename T> class LargeSparseMatrixMemory : public LargeSparseMatrix<T
   virtual uint getNumRows();
   virtual uint getNumCols();
   virtual uint64 getNumValues();
+  virtual LargeSparseMatrix<T>* clone();
   virtual ~LargeSparseMatrixMemory() {};
   // void loadFromTextFile(std::string filename);
 
@@ -197,6 +220,7 @@ template <typename T> void LargeSparseMatrixHD<T>::readcache() {
 
 template <typename T> LargeSparseMatrixHD<T>::LargeSparseMatrixHD(std::string filename, uint64 cache_size) {
   this->filename = filename;
+  this->cache_size = cache_size;
   in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
   if (in.is_open()) {
     file_header fh;
@@ -234,6 +258,10 @@ template <typename T> LargeSparseMatrixHD<T>::LargeSparseMatrixHD(std::string fi
   data.setSize(num_rows_in_cache);
 }
 
+template <typename T> LargeSparseMatrix<T>* LargeSparseMatrixHD<T>::clone() {
+  return new LargeSparseMatrixHD<T>(filename, cache_size);
+}
+
 template <typename T> uint LargeSparseMatrixHD<T>::getNumRows() {
   return num_rows;
 };
@@ -254,6 +282,77 @@ template <typename T> void LargeSparseMatrixHD<T>::next() {
   }
 }
 
+template <typename T> void LargeSparseMatrixHD<T>::buildBlockIndex() {
+  // the same partition into blocks as in readcache, but only the sizes of
+  // the rows are read
+  if (! in.is_open()) {
+    in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  }
+  block_first_row.clear();
+  block_position.clear();
+  in.seekg(sizeof(file_header), std::ios_base::beg);
+  uint64 position = sizeof(file_header);
+  uint row = 0;
+  while (row < num_rows) {
+    block_first_row.push_back(row);
+    block_position.push_back(position);
+    uint rows_in_block = 0;
+    uint64 entries_in_block = 0;
+    while ((row < num_rows) && (rows_in_block < data.dim)) {
+      uint size;
+      in.read(reinterpret_cast<char*>(&size), sizeof(uint));
+      if ((size + entries_in_block) > cache.dim) {
+        in.seekg(- (long int) sizeof(uint), std::ios::cur);
+        break;
+      }
+      in.seekg(sizeof(sparse_entry<T>)*size, std::ios::cur);
+      position += sizeof(uint) + sizeof(sparse_entry<T>)*size;
+      rows_in_block++;
+      entries_in_block += size;
+      row++;
+    }
+    if (rows_in_block == 0) {
+      throw "row " + std::to_string(row) + " of " + filename + " does not fit into the cache";
+    }
+  }
+  block_first_row.push_back(num_rows);
+}
+
+template <typename T> uint LargeSparseMatrixHD<T>::getNumBlocks() {
+  if (block_first_row.empty()) { buildBlockIndex(); }
+  return block_position.size();
+}
+
+template <typename T> uint LargeSparseMatrixHD<T>::getBlockFirstRow(uint block) {
+  if (block_first_row.empty()) { buildBlockIndex(); }
+  return block_first_row[block];
+}
+
+template <typename T> uint LargeSparseMatrixHD<T>::readBlock(uint block, sparse_row<T>*& rows) {
+  if (block_first_row.empty()) { buildBlockIndex(); }
+  if (! in.is_open()) {
+    in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  }
+  in.clear();
+  in.seekg(block_position[block], std::ios_base::beg);
+  uint num_block_rows = block_first_row[block + 1] - block_first_row[block];
+  uint64 num_entries = 0;
+  for (uint r = 0; r < num_block_rows; r++) {
+    sparse_row<T>& this_row = data.value[r];
+    in.read(reinterpret_cast<char*>(&(this_row.size)), sizeof(uint));
+    this_row.data = &(cache.value[num_entries]);
+    in.read(reinterpret_cast<char*>(this_row.data), sizeof(sparse_entry<T>)*this_row.size);
+    num_entries += this_row.size;
+  }
+  // the cache does not hold the rows of the iterator anymore
+  row_index = num_rows;
+  position_in_data_cache = 0;
+  number_of_valid_rows_in_cache = 0;
+  number_of_valid_entries_in_cache = 0;
+  rows = data.value;
+  return num_block_rows;
+}
+
 template <typename T> void LargeSparseMatrixHD<T>::begin() {
   if ((row_index == position_in_data_cache) && (number_of_valid_rows_in_cache > 0)) {
     // if the beginning is already in the cache, do nothing
@@ -269,6 +368,10 @@ template <typename T> void LargeSparseMatrixHD<T>::begin() {
   position_in_data_cache = 0;
   number_of_valid_rows_in_cache = 0;
   number_of_valid_entries_in_cache = 0;
+  if (! in.is_open()) {
+    in.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  }
+  in.clear();
   in.seekg(sizeof(file_header), std::ios_base::beg);
   readcache();
 }
@@ -317,4 +420,13 @@ template <typename T> uint64 LargeSparseMatrixMemory<T>::getNumValues() {
   return num_values;
 }
 
+template <typename T> LargeSparseMatrix<T>* LargeSparseMatrixMemory<T>::clone() {
+  // only the row headers are copied, the entries are shared
+  LargeSparseMatrixMemory<T>* result = new LargeSparseMatrixMemory<T>();
+  result->data.assign(data);
+  result->num_cols = num_cols;
+  result->num_values = num_values;
+  return result;
+}
+
 #endif /*FMATRIX_H_*/
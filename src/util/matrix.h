@@ -75,6 +75,9 @@ template <typename T> class DVector {
 
   void setSize(uint p_dim);
   void resize(uint p_dim);
+  // use p_dim values of external memory (e.g. a memory mapped file); the
+  // memory is not freed by the vector
+  void attach(T* p_value, uint p_dim);
 
   T get(uint x);
   T& operator() (unsigned x);
@@ -93,6 +96,9 @@ template <typename T> class DVector {
 
   T* value;
   uint dim;
+
+ protected:
+  bool owner; // is value allocated by this vector
 };
 
 class DVectorDouble : public DVector<double> {
@@ -100,6 +106,11 @@ class DVectorDouble : public DVector<double> {
   void init_normal(double mean, double stdev);
 };
 
+class DVectorFloat : public DVector<float> {
+ public:
+  void init_normal(double mean, double stdev);
+};
+
 class DMatrixDouble : public DMatrix<double> {
  public:
   void init(double mean, double stdev);
@@ -273,6 +284,7 @@ template <typename T> void DMatrix<T>::load(std::string filename) {
 template <typename T> DVector<T>::DVector() {
   dim = 0;
   value = NULL;
+  owner = true;
 }
 
 template <typename T> DVector<T>& DVector<T>::operator=(const DVector<T>& vec) {
@@ -283,11 +295,12 @@ template <typename T> DVector<T>& DVector<T>::operator=(const DVector<T>& vec) {
 template <typename T> DVector<T>::DVector(uint p_dim) {
   dim = 0;
   value = NULL;
+  owner = true;
   setSize(p_dim);
 }
 
 template <typename T> DVector<T>::~DVector() {
-  if (value != NULL) {
+  if ((value != NULL) && owner) {
     MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
     delete [] value;
   }
@@ -299,13 +312,24 @@ template <typename T> T DVector<T>::get(uint x) {
 
 template <typename T> void DVector<T>::setSize(uint p_dim) {
   if (p_dim == dim) { return; }
-  if (value != NULL) {
+  if ((value != NULL) && owner) {
     MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
     delete [] value;
   }
   dim = p_dim;
   MemoryLog::getInstance().logNew("dvector", sizeof(T), dim);
   value = new T[dim];
+  owner = true;
+}
+
+template <typename T> void DVector<T>::attach(T* p_value, uint p_dim) {
+  if ((value != NULL) && owner) {
+    MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
+    delete [] value;
+  }
+  dim = p_dim;
+  value = p_value;
+  owner = false;
 }
 
 template <typename T> T& DVector<T>::operator() (unsigned x) {
@@ -343,7 +367,7 @@ template <typename T> void DVector<T>::resize(uint p_dim) {
     new_value[i] = this->value[i];
   }
 
-  if (value != NULL) {
+  if ((value != NULL) && owner) {
     MemoryLog::getInstance().logFree("dvector", sizeof(T), dim);
     delete [] this->value;
   }
@@ -351,6 +375,7 @@ template <typename T> void DVector<T>::resize(uint p_dim) {
   this->dim = len;
   MemoryLog::getInstance().logNew("dvector", sizeof(T), dim);
   this->value = new_value;
+  this->owner = true;
 }
 
 template <typename T> void DVector<T>::save(std::string filename) {
@@ -419,6 +444,12 @@ void DVectorDouble::init_normal(double mean, double stdev) {
   }
 }
 
+void DVectorFloat::init_normal(double mean, double stdev) {
+  for (uint i_2 = 0; i_2 < dim; i_2++) {
+    value[i_2] = ran_gaussian(mean, stdev);
+  }
+}
+
 void DMatrixDouble::init(double mean, double stdev) {
   for (uint i_1 = 0; i_1 < dim1; i_1++) {
     for (uint i_2 = 0; i_2 < dim2; i_2++) {
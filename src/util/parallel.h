@@ -0,0 +1,191 @@
+// Copyright (C) 2010, 2011, 2012, 2013, 2014 Steffen Rendle
+// Contact:   srendle@libfm.org, http://www.libfm.org/
+//
+// This file is part of libFM.
+//
+// libFM is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libFM is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libFM.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// parallel.h: Thread pool for data parallel loops
+//
+// The pool keeps its worker threads alive between calls, so that loops which
+// are run once per iteration (prediction, evaluation, learning) do not pay for
+// thread creation. The calling thread takes part in the work as thread 0, so a
+// pool with n threads starts n-1 workers and a pool with one thread runs
+// everything inline. Calls must not be nested.
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../util/memory.h"
+#include "../util/util.h"
+
+class ThreadPool {
+ public:
+  ThreadPool();
+  ~ThreadPool();
+
+  // 0 or less means one thread per hardware thread
+  void setNumThreads(int num_threads);
+  int getNumThreads();
+
+  // calls fn(task, thread) for every task in [0, num_tasks); the tasks are
+  // handed out dynamically, thread is in [0, getNumThreads())
+  void run(uint num_tasks, const std::function<void(uint task, int thread)>& fn);
+
+  // splits [begin, end) into consecutive ranges of at most grain_size elements
+  // and calls fn(range_begin, range_end, thread) for each of them
+  void parallel_for(uint64 begin, uint64 end, uint64 grain_size, const std::function<void(uint64 range_begin, uint64 range_end, int thread)>& fn);
+
+ protected:
+  void stopWorkers();
+  void worker(int thread, uint64 seen);
+  void work(int thread);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable cv_start, cv_done;
+
+  const std::function<void(uint, int)>* job;
+  uint num_tasks;
+  std::atomic<uint> next_task;
+  uint64 generation;
+  int num_busy;
+  bool stop;
+  std::exception_ptr error;
+};
+
+// Implementation
+ThreadPool::ThreadPool() {
+  job = NULL;
+  num_tasks = 0;
+  next_task = 0;
+  generation = 0;
+  num_busy = 0;
+  stop = false;
+}
+
+ThreadPool::~ThreadPool() {
+  stopWorkers();
+}
+
+void ThreadPool::stopWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cv_start.notify_all();
+  for (uint t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  workers.clear();
+  stop = false;
+}
+
+void ThreadPool::setNumThreads(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (num_threads == getNumThreads()) { return; }
+  stopWorkers();
+  for (int t = 1; t < num_threads; t++) {
+    workers.push_back(std::thread(&ThreadPool::worker, this, t, generation));
+  }
+}
+
+int ThreadPool::getNumThreads() {
+  return workers.size() + 1;
+}
+
+void ThreadPool::worker(int thread, uint64 seen) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv_start.wait(lock, [&] { return stop || (generation != seen); });
+      if (stop) { return; }
+      seen = generation;
+    }
+    work(thread);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      num_busy--;
+      if (num_busy == 0) { cv_done.notify_all(); }
+    }
+  }
+}
+
+void ThreadPool::work(int thread) {
+  uint task;
+  while ((task = next_task++) < num_tasks) {
+    try {
+      (*job)(task, thread);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (! error) { error = std::current_exception(); }
+      // skip the remaining tasks
+      next_task = num_tasks;
+    }
+  }
+}
+
+void ThreadPool::run(uint num_tasks, const std::function<void(uint task, int thread)>& fn) {
+  if (workers.empty() || (num_tasks <= 1)) {
+    for (uint task = 0; task < num_tasks; task++) {
+      fn(task, 0);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->job = &fn;
+    this->num_tasks = num_tasks;
+    this->next_task = 0;
+    this->num_busy = workers.size();
+    this->error = nullptr;
+    generation++;
+  }
+  cv_start.notify_all();
+  work(0);
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [&] { return num_busy == 0; });
+    job = NULL;
+  }
+  if (error) {
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+void ThreadPool::parallel_for(uint64 begin, uint64 end, uint64 grain_size, const std::function<void(uint64 range_begin, uint64 range_end, int thread)>& fn) {
+  if (end <= begin) { return; }
+  grain_size = std::max((uint64) 1, grain_size);
+  uint num_ranges = (end - begin + grain_size - 1) / grain_size;
+  run(num_ranges, [&](uint task, int thread) {
+    uint64 range_begin = begin + task * grain_size;
+    uint64 range_end = std::min(end, range_begin + grain_size);
+    fn(range_begin, range_end, thread);
+  });
+}
+
+#endif /*PARALLEL_H_*/
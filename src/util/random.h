@@ -25,6 +25,35 @@
 #include <stdlib.h>
 #include <cmath>
 #include <assert.h>
+#include "../util/util.h"
+
+// a uniform random 64 bit number for the state, which is advanced (splitmix64)
+inline uint64 ran_splitmix64(uint64& state) {
+  uint64 z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// A stream of random numbers that does not depend on rand(). While a thread
+// has set a stream with ran_set_stream, all ran_* functions of this thread
+// draw from it; parallel samplers use one stream per task, so the numbers do
+// not depend on the number of threads.
+class RandomStream {
+ public:
+  RandomStream(uint64 seed) { state = seed; }
+  // uniform in [0,1)
+  double uniform() { return (ran_splitmix64(state) >> 11) * (1.0 / 9007199254740992.0); }
+  uint64 state;
+};
+
+// NULL: rand() is used
+thread_local RandomStream* ran_stream = NULL;
+void ran_set_stream(RandomStream* stream) { ran_stream = stream; }
+
+// a seed for a new stream: drawn from the stream of this thread if one is
+// set, otherwise from rand()
+uint64 ran_seed();
 
 double ran_gaussian();
 double ran_gaussian(double mean, double stdev);
@@ -170,9 +199,19 @@ double ran_gaussian(double mean, double stdev) {
 }
 
 double ran_uniform() {
+  if (ran_stream != NULL) {
+    return ran_stream->uniform();
+  }
   return rand()/((double)RAND_MAX + 1);
 }
 
+uint64 ran_seed() {
+  if (ran_stream != NULL) {
+    return ran_splitmix64(ran_stream->state);
+  }
+  return ((uint64) rand() << 31) ^ (uint64) rand();
+}
+
 double ran_exp() {
   return -std::log(1-ran_uniform());
 }
@@ -24,6 +24,7 @@
 
 #include <vector>
 #include <ctime>
+#include <chrono>
 
 #ifdef _WIN32
 #include <float.h>
@@ -89,6 +90,12 @@ double getusertime4() {
   return (double) time(NULL);
 }
 
+// elapsed real time in seconds (unlike the user time it does not add up the
+// time of several threads)
+double getwalltime() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 bool fileexists(std::string filename) {
   std::ifstream in_file (filename.c_str());
   return in_file.is_open();